@@ -11,12 +11,12 @@
 #include "session.h"
 #include "util.h"
 #include "hash.h"
+#include "cache.h"
 #include "translate.h"
 
 #include <cstdlib>
 #include <fstream>
 #include <sstream>
-#include <thread>
 
 extern "C" {
 #include <signal.h>
@@ -38,6 +38,20 @@ extern "C" {
 
 using namespace std;
 
+// The kernel headers that runtime/linux/runtime.h starts with.  They
+// make up most of what gcc parses for a small script, and they don't
+// depend on it, so compile_pass precompiles them once per kernel.
+static const char *runtime_pch_headers[] = {
+  "linux/module.h", "linux/ctype.h", "linux/kernel.h", "linux/miscdevice.h",
+  "linux/init.h", "linux/hash.h", "linux/string.h", "linux/kprobes.h",
+  "linux/proc_fs.h", "linux/vmalloc.h", "linux/slab.h", "linux/time.h",
+  "linux/random.h", "linux/spinlock.h", "linux/hardirq.h", "asm/uaccess.h",
+  "linux/kallsyms.h", "linux/vermagic.h", "linux/utsname.h",
+  "linux/version.h", "linux/compat.h", "linux/sched.h", "linux/mm.h",
+  "linux/timer.h", "linux/delay.h", "linux/profile.h", "linux/rcupdate.h",
+  NULL
+};
+
 /* Adjust and run make_cmd to build a kernel module. */
 static int
 run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
@@ -64,13 +78,12 @@ run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
       make_cmd.push_back("--no-print-directory");
     }
 
-  // Exploit SMP parallelism, if available.
-  long smp = thread::hardware_concurrency();
-  if (smp <= 0) smp = 1;
+  // Exploit SMP parallelism, if available, as bounded by -j.
+  long smp = s.jobs;
   // PR16276: but only if we're not running severely nproc-rlimited
   struct rlimit rlim;
   int rlimit_rc = getrlimit(RLIMIT_NPROC, &rlim);
-  const unsigned int severely_limited = smp*30; // WAG at number of gcc+make etc. nested processes
+  const rlim_t severely_limited = (rlim_t) max(smp, 1L) * 30; // WAG at number of gcc+make etc. nested processes
   bool nproc_limited = (rlimit_rc == 0 && (rlim.rlim_max <= severely_limited || 
                                            rlim.rlim_cur <= severely_limited));
   if (smp >= 1 && !nproc_limited)
@@ -150,10 +163,17 @@ make_make_objs_cmd(systemtap_session& s, const string& dir)
   return make_any_make_cmd(s, dir, "_module_" + dir);
 }
 
+// Each autoconf test writes its result to a file of its own, so that
+// make -j can run the compiles concurrently.  The stapconf header rule
+// collects them from $(STAPCONF_CHECKS).
 static void
-output_autoconf(systemtap_session& s, ofstream& o, const char *autoconf_c,
+output_autoconf(systemtap_session& s, ostream& o, const char *autoconf_c,
                 const char *deftrue, const char *deffalse)
 {
+  string target = "$(STAPCONF_HEADER)-" + string(autoconf_c);
+  target.erase(target.size() - 2); // drop ".c"
+  o << "STAPCONF_CHECKS += " << target << endl;
+  o << target << ":" << endl;
   o << "\t";
   if (s.verbose < 4)
     o << "@";
@@ -165,7 +185,7 @@ output_autoconf(systemtap_session& s, ofstream& o, const char *autoconf_c,
     o << "echo \"#define " << deftrue << " 1\"";
   if (deffalse)
     o << "; else echo \"#define " << deffalse << " 1\"";
-  o << "; fi >> $@" << endl;
+  o << "; fi > $@" << endl;
 }
 
 
@@ -316,70 +336,71 @@ compile_pass (systemtap_session& s)
   o << "STAPCONF_HEADER := " << s.tmpdir << "/" << s.stapconf_name << endl;
   o << "$(STAPCONF_HEADER):" << endl;
   o << "\t@> $@" << endl;
-  output_autoconf(s, o, "autoconf-hrtimer-rel.c", "STAPCONF_HRTIMER_REL", NULL);
+  ostringstream checks;
+  output_autoconf(s, checks, "autoconf-hrtimer-rel.c", "STAPCONF_HRTIMER_REL", NULL);
   output_exportconf(s, o, "hrtimer_get_res", "STAPCONF_HRTIMER_GET_RES");
-  output_autoconf(s, o, "autoconf-generated-compile.c", "STAPCONF_GENERATED_COMPILE", NULL);
-  output_autoconf(s, o, "autoconf-hrtimer-getset-expires.c", "STAPCONF_HRTIMER_GETSET_EXPIRES", NULL);
-  output_autoconf(s, o, "autoconf-inode-private.c", "STAPCONF_INODE_PRIVATE", NULL);
-  output_autoconf(s, o, "autoconf-inode-rwsem.c", "STAPCONF_INODE_RWSEM", NULL);
-  output_autoconf(s, o, "autoconf-constant-tsc.c", "STAPCONF_CONSTANT_TSC", NULL);
-  output_autoconf(s, o, "autoconf-ktime-get-real.c", "STAPCONF_KTIME_GET_REAL", NULL);
-  output_autoconf(s, o, "autoconf-x86-uniregs.c", "STAPCONF_X86_UNIREGS", NULL);
-  output_autoconf(s, o, "autoconf-nameidata.c", "STAPCONF_NAMEIDATA_CLEANUP", NULL);
+  output_autoconf(s, checks, "autoconf-generated-compile.c", "STAPCONF_GENERATED_COMPILE", NULL);
+  output_autoconf(s, checks, "autoconf-hrtimer-getset-expires.c", "STAPCONF_HRTIMER_GETSET_EXPIRES", NULL);
+  output_autoconf(s, checks, "autoconf-inode-private.c", "STAPCONF_INODE_PRIVATE", NULL);
+  output_autoconf(s, checks, "autoconf-inode-rwsem.c", "STAPCONF_INODE_RWSEM", NULL);
+  output_autoconf(s, checks, "autoconf-constant-tsc.c", "STAPCONF_CONSTANT_TSC", NULL);
+  output_autoconf(s, checks, "autoconf-ktime-get-real.c", "STAPCONF_KTIME_GET_REAL", NULL);
+  output_autoconf(s, checks, "autoconf-x86-uniregs.c", "STAPCONF_X86_UNIREGS", NULL);
+  output_autoconf(s, checks, "autoconf-nameidata.c", "STAPCONF_NAMEIDATA_CLEANUP", NULL);
   output_dual_exportconf(s, o, "unregister_kprobes", "unregister_kretprobes", "STAPCONF_UNREGISTER_KPROBES");
-  output_autoconf(s, o, "autoconf-kprobe-symbol-name.c", "STAPCONF_KPROBE_SYMBOL_NAME", NULL);
-  output_autoconf(s, o, "autoconf-real-parent.c", "STAPCONF_REAL_PARENT", NULL);
-  output_autoconf(s, o, "autoconf-uaccess.c", "STAPCONF_LINUX_UACCESS_H", NULL);
-  output_autoconf(s, o, "autoconf-oneachcpu-retry.c", "STAPCONF_ONEACHCPU_RETRY", NULL);
-  output_autoconf(s, o, "autoconf-dpath-path.c", "STAPCONF_DPATH_PATH", NULL);
+  output_autoconf(s, checks, "autoconf-kprobe-symbol-name.c", "STAPCONF_KPROBE_SYMBOL_NAME", NULL);
+  output_autoconf(s, checks, "autoconf-real-parent.c", "STAPCONF_REAL_PARENT", NULL);
+  output_autoconf(s, checks, "autoconf-uaccess.c", "STAPCONF_LINUX_UACCESS_H", NULL);
+  output_autoconf(s, checks, "autoconf-oneachcpu-retry.c", "STAPCONF_ONEACHCPU_RETRY", NULL);
+  output_autoconf(s, checks, "autoconf-dpath-path.c", "STAPCONF_DPATH_PATH", NULL);
   output_exportconf(s, o, "synchronize_kernel", "STAPCONF_SYNCHRONIZE_KERNEL");
   output_exportconf(s, o, "synchronize_rcu", "STAPCONF_SYNCHRONIZE_RCU");
   output_exportconf(s, o, "synchronize_sched", "STAPCONF_SYNCHRONIZE_SCHED");
-  output_autoconf(s, o, "autoconf-task-uid.c", "STAPCONF_TASK_UID", NULL);
-  output_autoconf(s, o, "autoconf-from_kuid_munged.c", "STAPCONF_FROM_KUID_MUNGED", NULL);
+  output_autoconf(s, checks, "autoconf-task-uid.c", "STAPCONF_TASK_UID", NULL);
+  output_autoconf(s, checks, "autoconf-from_kuid_munged.c", "STAPCONF_FROM_KUID_MUNGED", NULL);
   output_exportconf(s, o, "get_mm_exe_file", "STAPCONF_GET_MM_EXE_FILE");
   output_dual_exportconf(s, o, "alloc_vm_area", "free_vm_area", "STAPCONF_VM_AREA");
-  output_autoconf(s, o, "autoconf-procfs-owner.c", "STAPCONF_PROCFS_OWNER", NULL);
-  output_autoconf(s, o, "autoconf-alloc-percpu-align.c", "STAPCONF_ALLOC_PERCPU_ALIGN", NULL);
-  output_autoconf(s, o, "autoconf-x86-fs.c", "STAPCONF_X86_FS", NULL);
-  output_autoconf(s, o, "autoconf-x86-xfs.c", "STAPCONF_X86_XFS", NULL);
-  output_autoconf(s, o, "autoconf-x86-gs.c", "STAPCONF_X86_GS", NULL);
-  output_autoconf(s, o, "autoconf-grsecurity.c", "STAPCONF_GRSECURITY", NULL);
-  output_autoconf(s, o, "autoconf-trace-printk.c", "STAPCONF_TRACE_PRINTK", NULL);
-  output_autoconf(s, o, "autoconf-regset.c", "STAPCONF_REGSET", NULL);
-  output_autoconf(s, o, "autoconf-utrace-regset.c", "STAPCONF_UTRACE_REGSET", NULL);
-  output_autoconf(s, o, "autoconf-uprobe-get-pc.c", "STAPCONF_UPROBE_GET_PC", NULL);
-  output_autoconf(s, o, "autoconf-hlist-4args.c", "STAPCONF_HLIST_4ARGS", NULL);
+  output_autoconf(s, checks, "autoconf-procfs-owner.c", "STAPCONF_PROCFS_OWNER", NULL);
+  output_autoconf(s, checks, "autoconf-alloc-percpu-align.c", "STAPCONF_ALLOC_PERCPU_ALIGN", NULL);
+  output_autoconf(s, checks, "autoconf-x86-fs.c", "STAPCONF_X86_FS", NULL);
+  output_autoconf(s, checks, "autoconf-x86-xfs.c", "STAPCONF_X86_XFS", NULL);
+  output_autoconf(s, checks, "autoconf-x86-gs.c", "STAPCONF_X86_GS", NULL);
+  output_autoconf(s, checks, "autoconf-grsecurity.c", "STAPCONF_GRSECURITY", NULL);
+  output_autoconf(s, checks, "autoconf-trace-printk.c", "STAPCONF_TRACE_PRINTK", NULL);
+  output_autoconf(s, checks, "autoconf-regset.c", "STAPCONF_REGSET", NULL);
+  output_autoconf(s, checks, "autoconf-utrace-regset.c", "STAPCONF_UTRACE_REGSET", NULL);
+  output_autoconf(s, checks, "autoconf-uprobe-get-pc.c", "STAPCONF_UPROBE_GET_PC", NULL);
+  output_autoconf(s, checks, "autoconf-hlist-4args.c", "STAPCONF_HLIST_4ARGS", NULL);
   output_exportconf(s, o, "tsc_khz", "STAPCONF_TSC_KHZ");
   output_exportconf(s, o, "cpu_khz", "STAPCONF_CPU_KHZ");
   output_exportconf(s, o, "__module_text_address", "STAPCONF_MODULE_TEXT_ADDRESS");
   output_exportconf(s, o, "add_timer_on", "STAPCONF_ADD_TIMER_ON");
 
   output_dual_exportconf(s, o, "probe_kernel_read", "probe_kernel_write", "STAPCONF_PROBE_KERNEL");
-  output_autoconf(s, o, "autoconf-hw_breakpoint_context.c",
+  output_autoconf(s, checks, "autoconf-hw_breakpoint_context.c",
 		  "STAPCONF_HW_BREAKPOINT_CONTEXT", NULL);
-  output_autoconf(s, o, "autoconf-save-stack-trace.c",
+  output_autoconf(s, checks, "autoconf-save-stack-trace.c",
                   "STAPCONF_KERNEL_STACKTRACE", NULL);
-  output_autoconf(s, o, "autoconf-save-stack-trace-no-bp.c",
+  output_autoconf(s, checks, "autoconf-save-stack-trace-no-bp.c",
                   "STAPCONF_KERNEL_STACKTRACE_NO_BP", NULL);
-  output_autoconf(s, o, "autoconf-asm-syscall.c",
+  output_autoconf(s, checks, "autoconf-asm-syscall.c",
 		  "STAPCONF_ASM_SYSCALL_H", NULL);
-  output_autoconf(s, o, "autoconf-ring_buffer-flags.c", "STAPCONF_RING_BUFFER_FLAGS", NULL);
-  output_autoconf(s, o, "autoconf-ring_buffer_lost_events.c", "STAPCONF_RING_BUFFER_LOST_EVENTS", NULL);
-  output_autoconf(s, o, "autoconf-ring_buffer_read_prepare.c", "STAPCONF_RING_BUFFER_READ_PREPARE", NULL);
-  output_autoconf(s, o, "autoconf-kallsyms-on-each-symbol.c", "STAPCONF_KALLSYMS_ON_EACH_SYMBOL", NULL);
-  output_autoconf(s, o, "autoconf-walk-stack.c", "STAPCONF_WALK_STACK", NULL);
-  output_autoconf(s, o, "autoconf-stacktrace_ops-warning.c",
+  output_autoconf(s, checks, "autoconf-ring_buffer-flags.c", "STAPCONF_RING_BUFFER_FLAGS", NULL);
+  output_autoconf(s, checks, "autoconf-ring_buffer_lost_events.c", "STAPCONF_RING_BUFFER_LOST_EVENTS", NULL);
+  output_autoconf(s, checks, "autoconf-ring_buffer_read_prepare.c", "STAPCONF_RING_BUFFER_READ_PREPARE", NULL);
+  output_autoconf(s, checks, "autoconf-kallsyms-on-each-symbol.c", "STAPCONF_KALLSYMS_ON_EACH_SYMBOL", NULL);
+  output_autoconf(s, checks, "autoconf-walk-stack.c", "STAPCONF_WALK_STACK", NULL);
+  output_autoconf(s, checks, "autoconf-stacktrace_ops-warning.c",
                   "STAPCONF_STACKTRACE_OPS_WARNING", NULL);
-  output_autoconf(s, o, "autoconf-stacktrace_ops-int-address.c",
+  output_autoconf(s, checks, "autoconf-stacktrace_ops-int-address.c",
                   "STAPCONF_STACKTRACE_OPS_INT_ADDRESS", NULL);
-  output_autoconf(s, o, "autoconf-mm-context-vdso.c", "STAPCONF_MM_CONTEXT_VDSO", NULL);
-  output_autoconf(s, o, "autoconf-mm-context-vdso-base.c", "STAPCONF_MM_CONTEXT_VDSO_BASE", NULL);
-  output_autoconf(s, o, "autoconf-blk-types.c", "STAPCONF_BLK_TYPES", NULL);
-  output_autoconf(s, o, "autoconf-perf-structpid.c", "STAPCONF_PERF_STRUCTPID", NULL);
-  output_autoconf(s, o, "perf_event_counter_context.c",
+  output_autoconf(s, checks, "autoconf-mm-context-vdso.c", "STAPCONF_MM_CONTEXT_VDSO", NULL);
+  output_autoconf(s, checks, "autoconf-mm-context-vdso-base.c", "STAPCONF_MM_CONTEXT_VDSO_BASE", NULL);
+  output_autoconf(s, checks, "autoconf-blk-types.c", "STAPCONF_BLK_TYPES", NULL);
+  output_autoconf(s, checks, "autoconf-perf-structpid.c", "STAPCONF_PERF_STRUCTPID", NULL);
+  output_autoconf(s, checks, "perf_event_counter_context.c",
 		  "STAPCONF_PERF_COUNTER_CONTEXT", NULL);
-  output_autoconf(s, o, "perf_probe_handler_nmi.c",
+  output_autoconf(s, checks, "perf_probe_handler_nmi.c",
 		  "STAPCONF_PERF_HANDLER_NMI", NULL);
   output_exportconf(s, o, "path_lookup", "STAPCONF_PATH_LOOKUP");
   output_exportconf(s, o, "kern_path_parent", "STAPCONF_KERN_PATH_PARENT");
@@ -387,23 +408,23 @@ compile_pass (systemtap_session& s)
   output_exportconf(s, o, "kern_path", "STAPCONF_KERN_PATH");
   output_exportconf(s, o, "proc_create_data", "STAPCONF_PROC_CREATE_DATA");
   output_exportconf(s, o, "PDE_DATA", "STAPCONF_PDE_DATA");
-  output_autoconf(s, o, "autoconf-module-sect-attrs.c", "STAPCONF_MODULE_SECT_ATTRS", NULL);
-
-  output_autoconf(s, o, "autoconf-utrace-via-tracepoints.c", "STAPCONF_UTRACE_VIA_TRACEPOINTS", NULL);
-  output_autoconf(s, o, "autoconf-task_work-struct.c", "STAPCONF_TASK_WORK_STRUCT", NULL);
-  output_autoconf(s, o, "autoconf-vm-area-pte.c", "STAPCONF_VM_AREA_PTE", NULL);
-  output_autoconf(s, o, "autoconf-relay-umode_t.c", "STAPCONF_RELAY_UMODE_T", NULL);
-  output_autoconf(s, o, "autoconf-relay_buf-per_cpu_ptr.c", "STAPCONF_RELAY_BUF_PER_CPU_PTR", NULL);
-  output_autoconf(s, o, "autoconf-fs_supers-hlist.c", "STAPCONF_FS_SUPERS_HLIST", NULL);
-  output_autoconf(s, o, "autoconf-compat_sigaction.c", "STAPCONF_COMPAT_SIGACTION", NULL);
-  output_autoconf(s, o, "autoconf-netfilter.c", "STAPCONF_NETFILTER_V313", NULL);
-  output_autoconf(s, o, "autoconf-netfilter-313b.c", "STAPCONF_NETFILTER_V313B", NULL);
-  output_autoconf(s, o, "autoconf-netfilter-4_1.c", "STAPCONF_NETFILTER_V41", NULL);
-  output_autoconf(s, o, "autoconf-netfilter-4_4.c", "STAPCONF_NETFILTER_V44", NULL);
-  output_autoconf(s, o, "autoconf-smpcall-5args.c", "STAPCONF_SMPCALL_5ARGS", NULL);
-  output_autoconf(s, o, "autoconf-smpcall-4args.c", "STAPCONF_SMPCALL_4ARGS", NULL);
-  output_autoconf(s, o, "autoconf-sched-mm.c", "STAPCONF_SCHED_MM_H", NULL);
-  output_autoconf(s, o, "autoconf-sched-task_stack.c", "STAPCONF_SCHED_TASK_STACK_H", NULL);
+  output_autoconf(s, checks, "autoconf-module-sect-attrs.c", "STAPCONF_MODULE_SECT_ATTRS", NULL);
+
+  output_autoconf(s, checks, "autoconf-utrace-via-tracepoints.c", "STAPCONF_UTRACE_VIA_TRACEPOINTS", NULL);
+  output_autoconf(s, checks, "autoconf-task_work-struct.c", "STAPCONF_TASK_WORK_STRUCT", NULL);
+  output_autoconf(s, checks, "autoconf-vm-area-pte.c", "STAPCONF_VM_AREA_PTE", NULL);
+  output_autoconf(s, checks, "autoconf-relay-umode_t.c", "STAPCONF_RELAY_UMODE_T", NULL);
+  output_autoconf(s, checks, "autoconf-relay_buf-per_cpu_ptr.c", "STAPCONF_RELAY_BUF_PER_CPU_PTR", NULL);
+  output_autoconf(s, checks, "autoconf-fs_supers-hlist.c", "STAPCONF_FS_SUPERS_HLIST", NULL);
+  output_autoconf(s, checks, "autoconf-compat_sigaction.c", "STAPCONF_COMPAT_SIGACTION", NULL);
+  output_autoconf(s, checks, "autoconf-netfilter.c", "STAPCONF_NETFILTER_V313", NULL);
+  output_autoconf(s, checks, "autoconf-netfilter-313b.c", "STAPCONF_NETFILTER_V313B", NULL);
+  output_autoconf(s, checks, "autoconf-netfilter-4_1.c", "STAPCONF_NETFILTER_V41", NULL);
+  output_autoconf(s, checks, "autoconf-netfilter-4_4.c", "STAPCONF_NETFILTER_V44", NULL);
+  output_autoconf(s, checks, "autoconf-smpcall-5args.c", "STAPCONF_SMPCALL_5ARGS", NULL);
+  output_autoconf(s, checks, "autoconf-smpcall-4args.c", "STAPCONF_SMPCALL_4ARGS", NULL);
+  output_autoconf(s, checks, "autoconf-sched-mm.c", "STAPCONF_SCHED_MM_H", NULL);
+  output_autoconf(s, checks, "autoconf-sched-task_stack.c", "STAPCONF_SCHED_TASK_STACK_H", NULL);
 
   // used by tapset/timestamp_monotonic.stp
   output_exportconf(s, o, "cpu_clock", "STAPCONF_CPU_CLOCK");
@@ -414,8 +435,8 @@ compile_pass (systemtap_session& s)
 			   "STAPCONF_UPROBE_REGISTER_EXPORTED");
   output_either_exportconf(s, o, "uprobe_unregister", "unregister_uprobe",
 			   "STAPCONF_UPROBE_UNREGISTER_EXPORTED");
-  output_autoconf(s, o, "autoconf-old-inode-uprobes.c", "STAPCONF_OLD_INODE_UPROBES", NULL);
-  output_autoconf(s, o, "autoconf-inode-uretprobes.c", "STAPCONF_INODE_URETPROBES", NULL);
+  output_autoconf(s, checks, "autoconf-old-inode-uprobes.c", "STAPCONF_OLD_INODE_UPROBES", NULL);
+  output_autoconf(s, checks, "autoconf-inode-uretprobes.c", "STAPCONF_INODE_URETPROBES", NULL);
 
   // used by tapsets.cxx inode uprobe generated code
   output_exportconf(s, o, "uprobe_get_swbp_addr", "STAPCONF_UPROBE_GET_SWBP_ADDR_EXPORTED");
@@ -431,9 +452,9 @@ compile_pass (systemtap_session& s)
   output_exportconf(s, o, "signal_wake_up", "STAPCONF_SIGNAL_WAKE_UP_EXPORTED");
   output_exportconf(s, o, "__lock_task_sighand", "STAPCONF___LOCK_TASK_SIGHAND_EXPORTED");
 
-  output_autoconf(s, o, "autoconf-pagefault_disable.c", "STAPCONF_PAGEFAULT_DISABLE", NULL);
+  output_autoconf(s, checks, "autoconf-pagefault_disable.c", "STAPCONF_PAGEFAULT_DISABLE", NULL);
   output_exportconf(s, o, "kallsyms_lookup_name", "STAPCONF_KALLSYMS");
-  output_autoconf(s, o, "autoconf-uidgid.c", "STAPCONF_LINUX_UIDGID_H", NULL);
+  output_autoconf(s, checks, "autoconf-uidgid.c", "STAPCONF_LINUX_UIDGID_H", NULL);
   output_exportconf(s, o, "sigset_from_compat", "STAPCONF_SIGSET_FROM_COMPAT_EXPORTED");
   output_exportconf(s, o, "vzalloc", "STAPCONF_VZALLOC");
   output_exportconf(s, o, "vzalloc_node", "STAPCONF_VZALLOC_NODE");
@@ -442,21 +463,30 @@ compile_pass (systemtap_session& s)
   // RHBZ1233912 - s390 temporary workaround for non-atomic udelay()
   output_exportconf(s, o, "udelay_simple", "STAPCONF_UDELAY_SIMPLE");
 
-  output_autoconf(s, o, "autoconf-tracepoint-strings.c", "STAPCONF_TRACEPOINT_STRINGS", NULL);
-  output_autoconf(s, o, "autoconf-timerfd.c", "STAPCONF_TIMERFD_H", NULL);
+  output_autoconf(s, checks, "autoconf-tracepoint-strings.c", "STAPCONF_TRACEPOINT_STRINGS", NULL);
+  output_autoconf(s, checks, "autoconf-timerfd.c", "STAPCONF_TIMERFD_H", NULL);
 
-  output_autoconf(s, o, "autoconf-module_layout.c",
+  output_autoconf(s, checks, "autoconf-module_layout.c",
 		  "STAPCONF_MODULE_LAYOUT", NULL);
-  output_autoconf(s, o, "autoconf-mod_kallsyms.c",
+  output_autoconf(s, checks, "autoconf-mod_kallsyms.c",
 		  "STAPCONF_MOD_KALLSYMS", NULL);
   output_exportconf(s, o, "get_user_pages_remote", "STAPCONF_GET_USER_PAGES_REMOTE");
-  output_autoconf(s, o, "autoconf-get_user_pages_remote-flags.c",
+  output_autoconf(s, checks, "autoconf-get_user_pages_remote-flags.c",
 		  "STAPCONF_GET_USER_PAGES_REMOTE_FLAGS", NULL);
-  output_autoconf(s, o, "autoconf-get_user_pages_remote-flags_locked.c",
+  output_autoconf(s, checks, "autoconf-get_user_pages_remote-flags_locked.c",
 		  "STAPCONF_GET_USER_PAGES_REMOTE_FLAGS_LOCKED", NULL);
-  output_autoconf(s, o, "autoconf-uapi-linux-sched-types.c",
+  output_autoconf(s, checks, "autoconf-uapi-linux-sched-types.c",
 		  "STAPCONF_UAPI_LINUX_SCHED_TYPES", NULL);
 
+  // Append the autoconf results after the export checks above.  A
+  // stapconf header copied in from the cache has no prerequisites, so
+  // none of the tests run.
+  o << "\t@cat /dev/null $^ >> $@" << endl;
+  o << checks.str();
+  o << "ifeq ($(wildcard $(STAPCONF_HEADER)),)" << endl;
+  o << "$(STAPCONF_HEADER): $(STAPCONF_CHECKS)" << endl;
+  o << "endif" << endl;
+
   o << module_cflags << " += -include $(STAPCONF_HEADER)" << endl;
 
   for (unsigned i=0; i<s.c_macros.size(); i++)
@@ -504,6 +534,98 @@ compile_pass (systemtap_session& s)
   // o << "CFLAGS := $(subst -Os,-O2,$(CFLAGS)) -fminimal-toc" << endl;
   o << "obj-m := " << s.module_name << ".o" << endl;
 
+  // Have the main source start from a precompiled header of the kernel
+  // headers, built on the first run for this kernel and stapconf and
+  // kept in the cache.  If gcc finds it unusable, it reads the plain
+  // header instead, and says so with -vv.
+  string pch_header, pch_cached;
+  bool pch_reused = false;
+  if (s.use_cache)
+    {
+      phase_timer t (s.timings, "cache.runtime_pch");
+      ostringstream headers;
+      for (const char **h = runtime_pch_headers; *h; h++)
+        headers << "#include <" << *h << ">" << endl;
+      pch_cached = find_runtime_pch_hash (s, headers.str());
+      if (!pch_cached.empty())
+        {
+          pch_header = s.tmpdir + "/" + s.module_name + "_pch.h";
+          ofstream ph (pch_header.c_str());
+          ph << headers.str();
+          ph.close();
+          if (ph.fail())
+            pch_header.clear();
+          else if (!s.poison_cache && file_exists (pch_cached)
+                   && copy_file (pch_cached, pch_header + ".gch", s.verbose > 2))
+            {
+              cache_hit (pch_cached);
+              pch_reused = true;
+              if (s.verbose > 1)
+                clog << _("Pass 4: using cached ") << pch_cached << endl;
+            }
+        }
+    }
+  if (!pch_header.empty())
+    {
+      string objname = s.translated_source.substr(s.translated_source.rfind('/')+1);
+      objname[objname.size()-1] = 'o';
+      string targets = "$(obj)/" + objname + " " + pch_header + ".gch";
+
+      // gcc only takes a .gch built with the same macros, but kbuild
+      // defines KBUILD_BASENAME and KBUILD_MODNAME after the object and
+      // the module, whose stap_<hash> name differs for every script.  The
+      // runtime doesn't use them, so give the main object and the .gch
+      // fixed ones.  The .gch must also get the flags of a module object,
+      // which kbuild only gives the objects it knows to be part of one.
+      o << targets << ": basename_flags := -DKBUILD_BASENAME='\"stap_runtime\"'" << endl;
+      o << targets << ": modname_flags := -DKBUILD_MODNAME='\"stap_runtime\"'"
+        << " -D__KBUILD_MODNAME=kmod_stap_runtime" << endl;
+      o << targets << ": modfile_flags := -DKBUILD_MODFILE='\"stap_runtime\"'" << endl;
+      o << pch_header << ".gch: part-of-module := y" << endl;
+
+      o << "CFLAGS_" << objname << " += -include " << pch_header << endl;
+      if (s.verbose > 1)
+        o << "CFLAGS_" << objname
+          << " += $(call cc-option,-Winvalid-pch -Wno-error=invalid-pch)" << endl;
+      if (!pch_reused)
+        {
+          o << pch_header << ".gch: " << pch_header
+            << " | $(STAPCONF_HEADER)" << endl;
+          o << "\t@" << superverbose << " $(CC) $(c_flags) -x c-header -o $@.tmp $< "
+            << redirecterrors << " && mv $@.tmp $@ || rm -f $@.tmp" << endl;
+        }
+    }
+
+  // Reuse the objects of any auxiliary sources that an earlier build
+  // already compiled with the same flags.  They are linked in under a
+  // name with no matching source, so kbuild has no rule to rebuild them,
+  // while the source itself stays in the tmpdir for inspection.
+  vector<string> cached_objects (s.auxiliary_outputs.size());
+  vector<bool> reused_objects (s.auxiliary_outputs.size(), false);
+  if (s.use_cache)
+    {
+      phase_timer t (s.timings, "cache.objects");
+      unsigned reused = 0;
+      for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
+        {
+          string srcname = s.auxiliary_outputs[i]->filename;
+          cached_objects[i] = find_object_hash (s, srcname);
+          if (s.poison_cache || cached_objects[i].empty()
+              || !file_exists (cached_objects[i]))
+            continue;
+          string objname = srcname.substr(0, srcname.size()-2) + "_cached.o";
+          if (copy_file (cached_objects[i], objname, s.verbose > 2))
+            {
+              cache_hit (cached_objects[i]);
+              reused_objects[i] = true;
+              reused++;
+            }
+        }
+      if (s.verbose > 1 && reused)
+        clog << _F("Pass 4: reusing %u of %zu auxiliary objects from cache.",
+                   reused, s.auxiliary_outputs.size()) << endl;
+    }
+
   // print out all the auxiliary source (->object) file names
   o << s.module_name << "-y := ";
   for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
@@ -513,7 +635,10 @@ compile_pass (systemtap_session& s)
       assert (srcname != "" && srcname.rfind('/') != string::npos);
       string objname = srcname.substr(srcname.rfind('/')+1); // basename
       assert (objname != "" && objname[objname.size()-1] == 'c');
-      objname[objname.size()-1] = 'o'; // now objname
+      if (reused_objects[i])
+        objname.replace(objname.size()-2, 2, "_cached.o");
+      else
+        objname[objname.size()-1] = 'o'; // now objname
       o << " " + objname;
     }
   // and once again, for the translated_source file.  It can't simply
@@ -536,15 +661,21 @@ compile_pass (systemtap_session& s)
       assert (srcname != "" && srcname.rfind('/') != string::npos);
       string objname = srcname.substr(srcname.rfind('/')+1); // basename
       assert (objname != "" && objname[objname.size()-1] == 'c');
-      objname[objname.size()-1] = 'o'; // now objname
+      if (reused_objects[i])
+        objname.replace(objname.size()-2, 2, "_cached.o");
+      else
+        objname[objname.size()-1] = 'o'; // now objname
       o << " " + objname;
     }
   o << endl;
 
   // add all stapconf dependencies
   o << s.translated_source << ": $(STAPCONF_HEADER)" << endl;
+  if (!pch_header.empty())
+    o << s.translated_source << ": " << pch_header << ".gch" << endl;
   for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
-    o << s.auxiliary_outputs[i]->filename << ": $(STAPCONF_HEADER)" << endl;  
+    if (!reused_objects[i])
+      o << s.auxiliary_outputs[i]->filename << ": $(STAPCONF_HEADER)" << endl;
 
 
   o.close ();
@@ -563,10 +694,37 @@ compile_pass (systemtap_session& s)
     }
 
   // Run make
-  vector<string> make_cmd = make_make_cmd(s, s.tmpdir);
-  rc = run_make_cmd(s, make_cmd);
+  {
+    phase_timer timer (s.timings, "pass4.kbuild");
+    vector<string> make_cmd = make_make_cmd(s, s.tmpdir);
+    rc = run_make_cmd(s, make_cmd);
+  }
   if (rc)
-    s.set_try_server ();
+    {
+      s.set_try_server ();
+      return rc;
+    }
+
+  // Save the freshly compiled auxiliary objects and precompiled header
+  // for the next build.
+  if (!pch_header.empty() && !pch_reused && file_exists (pch_header + ".gch"))
+    {
+      phase_timer t (s.timings, "cache.runtime_pch");
+      copy_file (pch_header + ".gch", pch_cached, s.verbose > 2);
+    }
+  if (s.use_cache)
+    {
+      phase_timer t (s.timings, "cache.objects");
+      for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
+        {
+          if (reused_objects[i] || cached_objects[i].empty())
+            continue;
+          string objname = s.auxiliary_outputs[i]->filename;
+          objname[objname.size()-1] = 'o';
+          if (file_exists (objname))
+            copy_file (objname, cached_objects[i], s.verbose > 2);
+        }
+    }
   return rc;
 }
 
@@ -629,8 +787,10 @@ make_uprobes (systemtap_session& s)
   osrc.close();
 
   // make the module
+  phase_timer timer (s.timings, "pass4.uprobes");
   vector<string> make_cmd = make_make_cmd(s, dir);
   int rc = run_make_cmd(s, make_cmd);
+  timer.stop ();
   if (!rc && !copy_file(dir + "/Module.symvers",
                         s.tmpdir + "/Module.symvers"))
     rc = -1;
@@ -666,6 +826,7 @@ get_cached_uprobes(systemtap_session& s)
       if (get_file_size(cacheko) > 0 && copy_file(cacheko, tmpko) &&
           get_file_size(cachesyms) > 0 && copy_file(cachesyms, tmpsyms))
         {
+          cache_hit(cacheko);
           s.uprobes_path = tmpko;
           return true;
         }
@@ -840,6 +1001,8 @@ make_run_command (systemtap_session& s, const string& remotedir,
 map<string,string>
 make_tracequeries(systemtap_session& s, const map<string,string>& contents)
 {
+  phase_timer timer (s.timings, "tracequery");
+  timer.add (contents.size());
   static unsigned tick = 0;
   string basename("tracequery_kmod_" + lex_cast(++tick));
   map<string,string> objs;
@@ -998,21 +1161,20 @@ make_typequery_umod(systemtap_session& s, const vector<string>& headers, string&
 }
 
 
-int
-make_typequery(systemtap_session& s, string& module)
+// Split a "kernel<a.h><b.h>" or "<a.h><b.h>" module name into its headers
+static bool
+parse_typequery_headers(systemtap_session& s, const string& module,
+                        vector<string>& headers)
 {
-  int rc;
-  string new_module;
-  vector<string> headers;
   bool kernel = startswith(module, "kernel");
 
   for (size_t end, i = kernel ? 6 : 0; i < module.size(); i = end + 1)
     {
       if (module[i] != '<')
-        return -1;
+        return false;
       end = module.find('>', ++i);
       if (end == string::npos)
-        return -1;
+        return false;
       string header = module.substr(i, end - i);
       vector<string> matches;
       if (regexp_match(header, "^[a-zA-Z0-9/_.+-]+$", matches))
@@ -1020,7 +1182,88 @@ make_typequery(systemtap_session& s, string& module)
       else
         headers.push_back(header);
     }
-  if (headers.empty())
+  return !headers.empty();
+}
+
+
+// Build the tiny kernel modules for several typequeries at once, as
+// separate modules of a single kbuild run, so that their compiles
+// overlap.  Return a (module-name -> ko-filename) map of the ones that
+// got built.  make runs with -k, so a header that fails to compile
+// doesn't stop the others; the caller falls back to make_typequery for
+// whatever is missing, which reports the error.
+map<string,string>
+make_typequeries(systemtap_session& s, const vector<string>& modules)
+{
+  phase_timer timer (s.timings, "typequery");
+  timer.add (modules.size());
+  static unsigned tick = 0;
+  string basename("typequery_kmods_" + lex_cast(++tick));
+  map<string,string> kos;
+
+  // create a subdirectory for the modules
+  string dir(s.tmpdir + "/" + basename);
+  if (create_dir(dir.c_str()) != 0)
+    return kos;
+
+  // create a simple Makefile
+  string makefile(dir + "/Makefile");
+  ofstream omf(makefile.c_str());
+  omf << "EXTRA_CFLAGS := -g -fno-eliminate-unused-debug-types" << endl;
+
+  // RHBZ 655231: later rhel6 kernels' module-signing kbuild logic breaks out-of-tree modules
+  omf << "CONFIG_MODULE_SIG := n" << endl;
+
+  omf << "obj-m := " << endl;
+  map<string,string> targets;
+  for (unsigned i = 0; i < modules.size(); i++)
+    {
+      vector<string> headers;
+      if (!startswith(modules[i], "kernel")
+          || !parse_typequery_headers(s, modules[i], headers))
+        continue;
+
+      // NB: -include, as in make_typequery_kmod
+      string sbasename = basename + "_" + lex_cast(i);
+      omf << "CFLAGS_" << sbasename << ".o :=";
+      for (size_t j = 0; j < headers.size(); ++j)
+        omf << " -include " << lex_cast_qstring(headers[j]);
+      omf << endl;
+      omf << "obj-m += " + sbasename + ".o" << endl;
+
+      // create our empty source file
+      string source(dir + "/" + sbasename + ".c");
+      ofstream osrc(source.c_str());
+      osrc.close();
+
+      targets[modules[i]] = dir + "/" + sbasename + ".ko";
+    }
+  omf.close();
+
+  // make the modules; -k so that one bad header doesn't stop the rest,
+  // and failures are left for make_typequery to report
+  vector<string> make_cmd = make_make_cmd(s, dir);
+  make_cmd.push_back("-k");
+  bool quiet = (s.verbose < 4);
+  run_make_cmd(s, make_cmd, quiet, quiet);
+
+  for (map<string,string>::iterator it = targets.begin(); it != targets.end(); ++it)
+    if (file_exists(it->second))
+      kos.insert(*it);
+  return kos;
+}
+
+
+int
+make_typequery(systemtap_session& s, string& module)
+{
+  phase_timer timer (s.timings, "typequery");
+  int rc;
+  string new_module;
+  vector<string> headers;
+  bool kernel = startswith(module, "kernel");
+
+  if (!parse_typequery_headers(s, module, headers))
     return -1;
 
   if (kernel)
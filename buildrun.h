@@ -19,6 +19,7 @@ std::vector<std::string> make_run_command (systemtap_session& s,
                                            const std::string& version=VERSION);
 
 std::map<std::string,std::string> make_tracequeries(systemtap_session& s, const std::map<std::string,std::string>& contents);
+std::map<std::string,std::string> make_typequeries(systemtap_session& s, const std::vector<std::string>& modules);
 int make_typequery(systemtap_session& s, std::string& module);
 
 #endif // BUILDRUN_H
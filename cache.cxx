@@ -18,10 +18,13 @@
 #include <cassert>
 #include <sstream>
 #include <vector>
+#include <thread>
+#include <system_error>
 
 extern "C" {
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <glob.h>
 #include <regex.h>
@@ -48,6 +51,17 @@ struct cache_ent_info {
   void unlink() const;
 };
 
+static void clean_cache_in_background(systemtap_session& s);
+
+
+// Record a hit on a cache file.  clean_cache goes by the newest mtime of
+// each entry's files, so this keeps it from removing the entry first.
+void
+cache_hit(const string& path)
+{
+  utime(path.c_str(), NULL);
+}
+
 
 void
 add_stapconf_to_cache(systemtap_session& s)
@@ -73,11 +87,19 @@ add_script_to_cache(systemtap_session& s)
 
   // PR10543: clean the cache *before* we try putting something new into it.
   // We don't want to risk having the brand new contents being erased again.
-  clean_cache(s);
+  // The cleaning finishes in the background; see wait_for_clean_cache().
+  clean_cache_in_background(s);
 
+  // Each file is published with a rename, and the module goes last, so
+  // that concurrent runs which find the module also find the rest.
   string module_src_path = s.tmpdir + "/" + s.module_filename();
-  PROBE2(stap, cache__add__module, module_src_path.c_str(), s.hash_path.c_str());
-  if (!copy_file(module_src_path, s.hash_path, verbose))
+  string c_dest_path = s.hash_path;
+  if (endswith(c_dest_path, ".ko") || endswith(c_dest_path, ".so"))
+    c_dest_path.resize(c_dest_path.size() - 3);
+  c_dest_path += ".c";
+
+  PROBE2(stap, cache__add__source, s.translated_source.c_str(), c_dest_path.c_str());
+  if (!copy_file(s.translated_source, c_dest_path, verbose))
     {
       s.use_script_cache = false;
       return;
@@ -86,19 +108,18 @@ add_script_to_cache(systemtap_session& s)
   if (file_exists (module_src_path + ".sgn"))
     copy_file(module_src_path + ".sgn", s.hash_path + ".sgn", verbose);
 
-  string c_dest_path = s.hash_path;
-  if (endswith(c_dest_path, ".ko") || endswith(c_dest_path, ".so"))
-    c_dest_path.resize(c_dest_path.size() - 3);
-  c_dest_path += ".c";
-
-  PROBE2(stap, cache__add__source, s.translated_source.c_str(), c_dest_path.c_str());
-  if (!copy_file(s.translated_source, c_dest_path, verbose))
+  PROBE2(stap, cache__add__module, module_src_path.c_str(), s.hash_path.c_str());
+  if (!copy_file(module_src_path, s.hash_path, verbose))
     {
-      // NB: this is not so severe as to prevent reuse of the .ko
-      // already copied.
-      //
-      // s.use_script_cache = false;
+      s.use_script_cache = false;
+      return;
     }
+
+  // Point the canonical form of this script at the module, so that
+  // merely cosmetic edits of the script can reuse it.  It is not an
+  // error if this fails.
+  if (!s.canonical_hash_path.empty())
+    write_file_atomically(s.canonical_hash_path, s.hash_path + "\n");
 }
 
 
@@ -129,6 +150,7 @@ get_stapconf_from_cache(systemtap_session& s)
 
   // We're done with this file handle.
   close(fd_stapconf);
+  cache_hit(s.stapconf_path);
 
   if (s.verbose > 1)
     clog << _("Pass 4: using cached ") << s.stapconf_path << endl;
@@ -200,6 +222,8 @@ get_script_from_cache(systemtap_session& s)
   close(fd_module);
   close(fd_c);
 
+  cache_hit(s.hash_path);
+
   // To preserve semantics (since this will happen if we're not
   // caching), display the C source if the last pass is 3.
   if (s.last_pass == 3)
@@ -228,167 +252,233 @@ get_script_from_cache(systemtap_session& s)
 }
 
 
-void
-clean_cache(systemtap_session& s)
+// On a miss of the exact script hash, try the module that was built
+// for another script with the same canonical form.
+bool
+get_script_from_canonical_cache(systemtap_session& s)
 {
-  if (s.cache_path != "")
+  if (s.poison_cache || s.canonical_hash_path.empty())
+    return false;
+
+  ifstream link(s.canonical_hash_path.c_str());
+  string target;
+  if (!getline(link, target) || target.empty())
+    return false;
+
+  // NB: the link may outlive its module, in which case
+  // get_script_from_cache() below simply misses.
+  string module_name = target.substr(target.rfind('/') + 1);
+  string ext = s.module_filename().substr(s.module_name.size());
+  if (module_name.size() <= ext.size() || !endswith(module_name, ext.c_str()))
+    return false;
+  module_name.resize(module_name.size() - ext.size());
+
+  string saved_module_name = s.module_name;
+  string saved_hash_path = s.hash_path;
+  string saved_translated_source = s.translated_source;
+
+  s.module_name = module_name;
+  s.hash_path = target;
+  s.translated_source = string(s.tmpdir) + "/" + s.module_name + "_src.c";
+  if (get_script_from_cache(s))
     {
-      /* Get cache size limit from file in the stap cache dir */
-      string cache_max_filename = s.cache_path + "/";
-      cache_max_filename += SYSTEMTAP_CACHE_MAX_FILENAME;
-      ifstream cache_max_file(cache_max_filename.c_str(), ios::in);
-      unsigned long cache_mb_max;
+      cache_hit(s.canonical_hash_path);
+      if (s.verbose > 1)
+        clog << _F("Pass 2: script matches cached module %s in canonical form",
+                   target.c_str()) << endl;
+      return true;
+    }
 
-      if (cache_max_file.is_open())
-        {
-          cache_max_file >> cache_mb_max;
-          cache_max_file.close();
-        }
-      else
-        {
-          //file doesnt exist, create a default size
-          ofstream default_cache_max(cache_max_filename.c_str(), ios::out);
-          default_cache_max << SYSTEMTAP_CACHE_DEFAULT_MB << endl;
-          cache_mb_max = SYSTEMTAP_CACHE_DEFAULT_MB;
-
-          if (s.verbose > 1)
-            clog << _F("Cache limit file %s/%s missing, creating default.",
-                       s.cache_path.c_str(), SYSTEMTAP_CACHE_MAX_FILENAME) << endl;
-        }
-
-      /* Get cache clean interval from file in the stap cache dir */
-      string cache_clean_interval_filename = s.cache_path + "/";
-      cache_clean_interval_filename += SYSTEMTAP_CACHE_CLEAN_INTERVAL_FILENAME;
-      ifstream cache_clean_interval_file(cache_clean_interval_filename.c_str(), ios::in);
-      unsigned long cache_clean_interval;
-
-      if (cache_clean_interval_file.is_open())
-        {
-          cache_clean_interval_file >> cache_clean_interval;
-          cache_clean_interval_file.close();
-        }
-      else
-        {
-          //file doesnt exist, create a default interval
-          ofstream default_cache_clean_interval(cache_clean_interval_filename.c_str(), ios::out);
-          default_cache_clean_interval << SYSTEMTAP_CACHE_CLEAN_DEFAULT_INTERVAL_S << endl;
-          cache_clean_interval = SYSTEMTAP_CACHE_CLEAN_DEFAULT_INTERVAL_S;
-
-          if (s.verbose > 1)
-            clog << _F("Cache clean interval file %s missing, creating default.",
-                       cache_clean_interval_filename.c_str())<< endl;
-        }
-
-      /* Check the cache cleaning interval */
-      struct stat sb;
-      if(stat(cache_clean_interval_filename.c_str(), &sb) < 0)
-        {
-          const char* e = strerror (errno);
-          cerr << _F("clean_cache stat error: %s", e) << endl;
-          return;
-        }
-
-      struct timeval current_time;
-      gettimeofday(&current_time, NULL);
-      if(difftime(current_time.tv_sec, sb.st_mtime) < cache_clean_interval)
-        {
-          //interval not passed, don't continue
-          if (s.verbose > 1)
-            clog << _F("Cache cleaning skipped, interval not reached %lu s / %lu s.",
-                       (current_time.tv_sec-sb.st_mtime), cache_clean_interval)  << endl;
-          return;
-        }
+  s.module_name = saved_module_name;
+  s.hash_path = saved_hash_path;
+  s.translated_source = saved_translated_source;
+  return false;
+}
+
+
+// Evict the least recently used entries of the cache at CACHE_PATH
+// until it is under its size limit.  Concurrent runs sharing the cache
+// don't wait on each other here: whoever holds the lock does the work,
+// and everyone else skips it.
+static void
+clean_cache_dir(const string& cache_path, unsigned verbose, ostream& log)
+{
+  /* Get cache size limit from file in the stap cache dir */
+  string cache_max_filename = cache_path + "/";
+  cache_max_filename += SYSTEMTAP_CACHE_MAX_FILENAME;
+  ifstream cache_max_file(cache_max_filename.c_str(), ios::in);
+  unsigned long cache_mb_max;
+
+  if (cache_max_file.is_open())
+    {
+      cache_max_file >> cache_mb_max;
+      cache_max_file.close();
+    }
+  else
+    {
+      //file doesnt exist, create a default size
+      ofstream default_cache_max(cache_max_filename.c_str(), ios::out);
+      default_cache_max << SYSTEMTAP_CACHE_DEFAULT_MB << endl;
+      cache_mb_max = SYSTEMTAP_CACHE_DEFAULT_MB;
+
+      if (verbose > 1)
+        log << _F("Cache limit file %s/%s missing, creating default.",
+                  cache_path.c_str(), SYSTEMTAP_CACHE_MAX_FILENAME) << endl;
+    }
+
+  /* Get cache clean interval from file in the stap cache dir */
+  string cache_clean_interval_filename = cache_path + "/";
+  cache_clean_interval_filename += SYSTEMTAP_CACHE_CLEAN_INTERVAL_FILENAME;
+  ifstream cache_clean_interval_file(cache_clean_interval_filename.c_str(), ios::in);
+  unsigned long cache_clean_interval;
+
+  if (cache_clean_interval_file.is_open())
+    {
+      cache_clean_interval_file >> cache_clean_interval;
+      cache_clean_interval_file.close();
+    }
+  else
+    {
+      //file doesnt exist, create a default interval
+      ofstream default_cache_clean_interval(cache_clean_interval_filename.c_str(), ios::out);
+      default_cache_clean_interval << SYSTEMTAP_CACHE_CLEAN_DEFAULT_INTERVAL_S << endl;
+      cache_clean_interval = SYSTEMTAP_CACHE_CLEAN_DEFAULT_INTERVAL_S;
+
+      if (verbose > 1)
+        log << _F("Cache clean interval file %s missing, creating default.",
+                  cache_clean_interval_filename.c_str())<< endl;
+    }
+
+  // Only one run cleans at a time; the others carry on right away.
+  int lock_fd = open(cache_clean_interval_filename.c_str(), O_RDONLY);
+  if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0)
+    {
+      if (lock_fd >= 0)
+        close(lock_fd);
+      if (verbose > 1)
+        log << _("Cache cleaning skipped, already in progress.") << endl;
+      return;
+    }
+  // NB: closing the descriptor drops the lock, on any return below
+  struct lock_closer { int fd; ~lock_closer() { close(fd); } } closer = { lock_fd };
+
+  /* Check the cache cleaning interval */
+  struct stat sb;
+  if(stat(cache_clean_interval_filename.c_str(), &sb) < 0)
+    {
+      const char* e = strerror (errno);
+      log << _F("clean_cache stat error: %s", e) << endl;
+      return;
+    }
+
+  struct timeval current_time;
+  gettimeofday(&current_time, NULL);
+  if(difftime(current_time.tv_sec, sb.st_mtime) < cache_clean_interval)
+    {
+      //interval not passed, don't continue
+      if (verbose > 1)
+        log << _F("Cache cleaning skipped, interval not reached %lu s / %lu s.",
+                  (current_time.tv_sec-sb.st_mtime), cache_clean_interval)  << endl;
+      return;
+    }
+  else
+    {
+      //interval reached, continue
+      if (verbose > 1)
+        log << _F("Cleaning cache, interval reached %lu s > %lu s.",
+                  (current_time.tv_sec-sb.st_mtime), cache_clean_interval)  << endl;
+    }
+
+  // glob for all files that look like hashes
+  glob_t cache_glob;
+  ostringstream glob_pattern;
+  glob_pattern << cache_path << "/*/*";
+  for (unsigned int i = 0; i < 32; i++)
+    glob_pattern << "[[:xdigit:]]";
+  glob_pattern << "*";
+  int rc = glob(glob_pattern.str().c_str(), 0, NULL, &cache_glob);
+  if (rc) {
+    log << _F("clean_cache glob error rc=%d", rc) << endl;
+    return;
+  }
+
+  regex_t hash_len_re;
+  rc = regcomp (&hash_len_re, "([[:xdigit:]]{32}_[[:digit:]]+)", REG_EXTENDED);
+  if (rc) {
+    log << _F("clean_cache regcomp error rc=%d", rc) << endl;
+    globfree(&cache_glob);
+    return;
+  }
+
+  // group all files with the same HASH_LEN
+  map<string, vector<string> > cache_groups;
+  for (size_t i = 0; i < cache_glob.gl_pathc; i++)
+    {
+      const char* path = cache_glob.gl_pathv[i];
+      regmatch_t hash_len;
+      rc = regexec(&hash_len_re, path, 1, &hash_len, 0);
+      if (rc || hash_len.rm_so == -1 || hash_len.rm_eo == -1)
+        cache_groups[path].push_back(path); // ungrouped
       else
-        {
-          //interval reached, continue
-          if (s.verbose > 1)
-            clog << _F("Cleaning cache, interval reached %lu s > %lu s.",
-                       (current_time.tv_sec-sb.st_mtime), cache_clean_interval)  << endl;
-        }
-
-      // glob for all files that look like hashes
-      glob_t cache_glob;
-      ostringstream glob_pattern;
-      glob_pattern << s.cache_path << "/*/*";
-      for (unsigned int i = 0; i < 32; i++)
-        glob_pattern << "[[:xdigit:]]";
-      glob_pattern << "*";
-      int rc = glob(glob_pattern.str().c_str(), 0, NULL, &cache_glob);
-      if (rc) {
-        cerr << _F("clean_cache glob error rc=%d", rc) << endl;
-        return;
-      }
+        cache_groups[string(path + hash_len.rm_so,
+                            hash_len.rm_eo - hash_len.rm_so)]
+          .push_back(path);
+    }
+  regfree(&hash_len_re);
+  globfree(&cache_glob);
 
-      regex_t hash_len_re;
-      rc = regcomp (&hash_len_re, "([[:xdigit:]]{32}_[[:digit:]]+)", REG_EXTENDED);
-      if (rc) {
-        cerr << _F("clean_cache regcomp error rc=%d", rc) << endl;
-        globfree(&cache_glob);
-        return;
-      }
 
-      // group all files with the same HASH_LEN
-      map<string, vector<string> > cache_groups;
-      for (size_t i = 0; i < cache_glob.gl_pathc; i++)
-        {
-          const char* path = cache_glob.gl_pathv[i];
-          regmatch_t hash_len;
-          rc = regexec(&hash_len_re, path, 1, &hash_len, 0);
-          if (rc || hash_len.rm_so == -1 || hash_len.rm_eo == -1)
-            cache_groups[path].push_back(path); // ungrouped
-          else
-            cache_groups[string(path + hash_len.rm_so,
-                                hash_len.rm_eo - hash_len.rm_so)]
-              .push_back(path);
-        }
-      regfree(&hash_len_re);
-      globfree(&cache_glob);
-
-
-      // create each cache entry and accumulate the sum
-      off_t cache_size_b = 0;
-      set<cache_ent_info> cache_contents;
-      for (map<string, vector<string> >::const_iterator it = cache_groups.begin();
-           it != cache_groups.end(); ++it)
-        {
-          cache_ent_info cur_info(it->second);
-          if (cache_contents.insert(cur_info).second)
-            cache_size_b += cur_info.size;
-        }
+  // create each cache entry and accumulate the sum
+  off_t cache_size_b = 0;
+  set<cache_ent_info> cache_contents;
+  for (map<string, vector<string> >::const_iterator it = cache_groups.begin();
+       it != cache_groups.end(); ++it)
+    {
+      cache_ent_info cur_info(it->second);
+      if (cache_contents.insert(cur_info).second)
+        cache_size_b += cur_info.size;
+    }
 
-      unsigned long r_cache_size = cache_size_b;
-      vector<const cache_ent_info*> removed;
+  unsigned long r_cache_size = cache_size_b;
+  vector<const cache_ent_info*> removed;
 
-      //unlink .ko and .c until the cache size is under the limit
-      for (set<cache_ent_info>::iterator i = cache_contents.begin();
-           i != cache_contents.end(); ++i)
-        {
-          if (r_cache_size < cache_mb_max * 1024 * 1024) //convert cache_mb_max to bytes
-            break;
-
-          //remove this (*i) cache_entry, add to removed list
-          for (size_t j = 0; j < i->paths.size(); ++j)
-            PROBE1(stap, cache__clean, i->paths[j].c_str());
-          i->unlink();
-          r_cache_size -= i->size;
-          removed.push_back(&*i);
-        }
-
-      if (s.verbose > 1 && !removed.empty())
-        {
-          clog << _("Cache cleaning successful, removed entries: ") << endl;
-          for (size_t i = 0; i < removed.size(); ++i)
-            for (size_t j = 0; j < removed[i]->paths.size(); ++j)
-              clog << "  " << removed[i]->paths[j] << endl;
-        }
+  //unlink .ko and .c until the cache size is under the limit
+  for (set<cache_ent_info>::iterator i = cache_contents.begin();
+       i != cache_contents.end(); ++i)
+    {
+      if (r_cache_size < cache_mb_max * 1024 * 1024) //convert cache_mb_max to bytes
+        break;
+
+      //remove this (*i) cache_entry, add to removed list
+      for (size_t j = 0; j < i->paths.size(); ++j)
+        PROBE1(stap, cache__clean, i->paths[j].c_str());
+      i->unlink();
+      r_cache_size -= i->size;
+      removed.push_back(&*i);
+    }
 
-      if(utime(cache_clean_interval_filename.c_str(), NULL)<0)
-        {
-          const char* e = strerror (errno);
-          cerr << _F("clean_cache utime error: %s", e) << endl;
-          return;
-        }
+  if (verbose > 1 && !removed.empty())
+    {
+      log << _("Cache cleaning successful, removed entries: ") << endl;
+      for (size_t i = 0; i < removed.size(); ++i)
+        for (size_t j = 0; j < removed[i]->paths.size(); ++j)
+          log << "  " << removed[i]->paths[j] << endl;
+    }
+
+  if(utime(cache_clean_interval_filename.c_str(), NULL)<0)
+    {
+      const char* e = strerror (errno);
+      log << _F("clean_cache utime error: %s", e) << endl;
+      return;
     }
+}
+
+
+void
+clean_cache(systemtap_session& s)
+{
+  if (s.cache_path != "")
+    clean_cache_dir(s.cache_path, s.verbose, clog);
   else
     {
       if (s.verbose > 1)
@@ -397,6 +487,50 @@ clean_cache(systemtap_session& s)
 }
 
 
+// The cleaner that add_script_to_cache() leaves running, so that the
+// eviction doesn't hold up the compile.  Its messages are kept until
+// it is joined, so that they don't land in the middle of pass 5.
+struct background_cleaner
+{
+  thread worker;
+  ostringstream log;
+  ~background_cleaner() { if (worker.joinable()) worker.join(); }
+};
+static background_cleaner cache_cleaner;
+
+
+static void
+clean_cache_in_background(systemtap_session& s)
+{
+  if (s.cache_path == "" || cache_cleaner.worker.joinable())
+    return;
+
+  string cache_path = s.cache_path;
+  unsigned verbose = s.verbose;
+  try
+    {
+      cache_cleaner.worker = thread([=]{
+        clean_cache_dir(cache_path, verbose, cache_cleaner.log);
+      });
+    }
+  catch (const system_error&)
+    {
+      clean_cache_dir(cache_path, verbose, clog);
+    }
+}
+
+
+void
+wait_for_clean_cache()
+{
+  if (!cache_cleaner.worker.joinable())
+    return;
+  cache_cleaner.worker.join();
+  clog << cache_cleaner.log.str();
+  cache_cleaner.log.str("");
+}
+
+
 cache_ent_info::cache_ent_info(const vector<string>& paths):
   paths(paths), size(0), mtime(0)
 {
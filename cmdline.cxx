@@ -59,5 +59,7 @@ struct option stap_long_options[] = {
   { "target-namespaces",           required_argument, NULL, LONG_OPT_TARGET_NAMESPACES },
   { "monitor",                     optional_argument, NULL, LONG_OPT_MONITOR },
   { "interactive",                 no_argument,       NULL, LONG_OPT_INTERACTIVE},
+  { "timing",                      required_argument, NULL, LONG_OPT_TIMING },
+  { "cache-fingerprint",           required_argument, NULL, LONG_OPT_CACHE_FINGERPRINT },
   { NULL, 0, NULL, 0 }
 };
@@ -21,6 +21,7 @@
 #include "buildrun.h"
 #include "dwarf_wrappers.h"
 #include "hash.h"
+#include "cache.h"
 #include "rpm_finder.h"
 #include "setupdwfl.h"
 
@@ -36,6 +37,7 @@
 #include <cstdarg>
 #include <cassert>
 #include <iomanip>
+#include <fstream>
 #include <cerrno>
 
 extern "C" {
@@ -50,6 +52,9 @@ extern "C" {
 #include <fnmatch.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "loc2c.h"
 #define __STDC_FORMAT_MACROS
@@ -118,6 +123,13 @@ dwflpp::dwflpp(systemtap_session & session, const vector<string>& names,
 
 dwflpp::~dwflpp()
 {
+  for (auto i = unsaved_function_indexes.begin();
+       i != unsaved_function_indexes.end(); ++i)
+    save_function_index(i->first, i->second.first, i->second.second);
+  for (auto i = unsaved_prologue_caches.begin();
+       i != unsaved_prologue_caches.end(); ++i)
+    save_prologue_cache(i->first, i->second);
+
   delete_map(module_cu_cache);
   delete_map(cu_function_cache);
   delete_map(mod_function_cache);
@@ -128,6 +140,7 @@ dwflpp::~dwflpp()
   for (auto i = cu_lines_cache.begin(); i != cu_lines_cache.end(); ++i)
     delete_map(*i->second);
   delete_map(cu_lines_cache);
+  delete_map(cu_addr_lines_cache);
 
   delete_map(cu_entry_pc_cache);
 
@@ -339,6 +352,7 @@ dwflpp::function_scope_matches(const vector<string>& scopes)
 void
 dwflpp::setup_kernel(const string& name, systemtap_session & s, bool debuginfo_needed)
 {
+  phase_timer timer (sess.timings, "dwarf.setup");
   if (! sess.module_cache)
     sess.module_cache = new module_cache ();
 
@@ -374,6 +388,7 @@ dwflpp::setup_kernel(const string& name, systemtap_session & s, bool debuginfo_n
 void
 dwflpp::setup_kernel(const vector<string> &names, bool debuginfo_needed)
 {
+  phase_timer timer (sess.timings, "dwarf.setup");
   if (! sess.module_cache)
     sess.module_cache = new module_cache ();
 
@@ -401,6 +416,7 @@ dwflpp::setup_kernel(const vector<string> &names, bool debuginfo_needed)
 void
 dwflpp::setup_user(const vector<string>& modules, bool debuginfo_needed)
 {
+  phase_timer timer (sess.timings, "dwarf.setup");
   if (! sess.module_cache)
     sess.module_cache = new module_cache ();
 
@@ -414,6 +430,300 @@ dwflpp::setup_user(const vector<string>& modules, bool debuginfo_needed)
   build_user_blacklist();
 }
 
+// Read in the DWARF of each module, with its list of CUs and the
+// functions of each CU, ahead of the queries that will want them.
+// This touches nothing but this dwflpp's own Dwfl and caches and
+// reports nothing, so that the prefetches of distinct dwflpps may run
+// concurrently.  The function lists are only parked, and turn into
+// cache entries wherever a query would have read them itself, so that
+// the symbol tables get updated just the same.
+void
+dwflpp::prefetch()
+{
+  phase_timer timer (sess.timings, "dwarf.prefetch");
+  dwfl_getmodules (dwfl, prefetch_module_callback, this, 0);
+}
+
+
+int
+dwflpp::prefetch_module_callback (Dwfl_Module* mod, void**, const char*,
+                                  Dwarf_Addr, void* arg)
+{
+  dwflpp* dw = static_cast<dwflpp*>(arg);
+  Dwarf_Addr bias;
+  Dwarf* dwarf = dwfl_module_getdwarf (mod, &bias);
+  if (pending_interrupts)
+    return DWARF_CB_ABORT;
+  if (!dwarf || dw->module_cu_cache.find (dwarf) != dw->module_cu_cache.end())
+    return DWARF_CB_OK;
+
+  // Same as iterate_over_cus, but only published once complete.
+  vector<Dwarf_Die>* v = new vector<Dwarf_Die>;
+  Dwarf_Off off = 0;
+  size_t cuhl;
+  Dwarf_Off noff;
+  while (dwarf_nextcu (dwarf, off, &noff, &cuhl, NULL, NULL, NULL) == 0)
+    {
+      Dwarf_Die die_mem;
+      Dwarf_Die *die;
+      die = dwarf_offdie (dwarf, off + cuhl, &die_mem);
+      /* Skip partial units. */
+      if (dwarf_tag (die) == DW_TAG_compile_unit)
+        v->push_back (*die); /* copy */
+      off = noff;
+    }
+  dw->module_cu_cache[dwarf] = v;
+
+  // NB: only the paths that find_function_indexes() already looked up.
+  auto path = dw->function_index_paths.find (mod);
+  if (path != dw->function_index_paths.end())
+    dw->load_function_index (dwarf, path->second, *v);
+
+  for (auto cu = v->begin(); cu != v->end(); ++cu)
+    {
+      if (pending_interrupts)
+        return DWARF_CB_ABORT;
+      if (dw->cu_function_lists.find (cu->addr) != dw->cu_function_lists.end())
+        continue;
+      vector<pair<const char*, Dwarf_Die> > funcs;
+      dwarf_getfuncs (&*cu, function_list_callback, &funcs, 0);
+      dw->cu_function_lists[cu->addr].swap (funcs);
+    }
+  return DWARF_CB_OK;
+}
+
+
+int
+dwflpp::function_list_callback (Dwarf_Die* func, void* arg)
+{
+  // NB: just like cu_function_caching_callback
+  const char *name = dwarf_diename(func);
+  if (!name)
+    return DWARF_CB_OK;
+
+  static_cast<vector<pair<const char*, Dwarf_Die> >*>(arg)
+    ->push_back(make_pair(name, *func));
+  return DWARF_CB_OK;
+}
+
+
+void
+dwflpp::find_function_indexes()
+{
+  auto callback = [](Dwfl_Module* mod, void**, const char*,
+                     Dwarf_Addr, void* arg) -> int
+    {
+      static_cast<dwflpp*>(arg)->function_index_path (mod);
+      return DWARF_CB_OK;
+    };
+  if (sess.use_cache)
+    dwfl_getmodules (dwfl, callback, this, 0);
+}
+
+
+// The function index of a module is kept in the cache under its
+// build-id, so that later runs can skip the scan of all of its DIEs for
+// the functions of each CU.
+const string&
+dwflpp::function_index_path(Dwfl_Module* mod)
+{
+  auto it = function_index_paths.find (mod);
+  if (it != function_index_paths.end())
+    return it->second;
+
+  string& path = function_index_paths[mod];
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int len = sess.use_cache ? dwfl_module_build_id (mod, &bits, &vaddr) : 0;
+  if (len > 0)
+    {
+      ostringstream id;
+      id << hex << setfill('0');
+      for (int i = 0; i < len; i++)
+        id << setw(2) << (unsigned) bits[i];
+      path = find_dwarf_index_hash (sess, id.str());
+    }
+  return path;
+}
+
+
+// The index file is an array of 64-bit words: a magic number and the
+// number of compile units, then for each unit its DIE offset, the number
+// of its functions and their DIE offsets in dwarf_getfuncs order.
+static const uint64_t function_index_magic = 0x3149464450415453ULL;
+
+void
+dwflpp::load_function_index(Dwarf* dwarf, const string& path,
+                            const vector<Dwarf_Die>& cus)
+{
+  if (path.empty())
+    return;
+
+  phase_timer timer (sess.timings, "dwarf.index");
+  int fd = sess.poison_cache ? -1 : open (path.c_str(), O_RDONLY);
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fd >= 0)
+    {
+      if (fstat (fd, &st) == 0 && st.st_size > 0)
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close (fd);
+    }
+  if (map == MAP_FAILED)
+    {
+      unsaved_function_indexes[dwarf] = make_pair (path, cus.size());
+      return;
+    }
+
+  // Every entry must still name a function of this very DWARF.
+  const uint64_t *w = (const uint64_t *) map;
+  size_t n = st.st_size / sizeof(uint64_t);
+  size_t i = 2;
+  unordered_map<void*, vector<pair<const char*, Dwarf_Die> > > lists;
+  bool ok = (n >= 2 && st.st_size % sizeof(uint64_t) == 0
+             && w[0] == function_index_magic && w[1] == cus.size());
+  for (size_t c = 0; ok && c < cus.size(); c++)
+    {
+      Dwarf_Die cu = cus[c];
+      ok = (n - i >= 2 && w[i] == dwarf_dieoffset (&cu)
+            && w[i + 1] <= n - i - 2);
+      if (!ok)
+        break;
+
+      size_t end = i + 2 + w[i + 1];
+      vector<pair<const char*, Dwarf_Die> >& funcs = lists[cu.addr];
+      funcs.reserve (end - i - 2);
+      for (i += 2; ok && i < end; i++)
+        {
+          Dwarf_Die die;
+          const char *name = NULL;
+          ok = (dwarf_offdie (dwarf, w[i], &die)
+                && dwarf_tag (&die) == DW_TAG_subprogram
+                && (name = dwarf_diename (&die)));
+          if (ok)
+            funcs.push_back (make_pair (name, die));
+        }
+    }
+  munmap (map, st.st_size);
+
+  if (!ok || i != n)
+    {
+      if (sess.verbose > 1)
+        clog << _F("Ignoring corrupt function index file \"%s\"", path.c_str()) << endl;
+      unsaved_function_indexes[dwarf] = make_pair (path, cus.size());
+      return;
+    }
+
+  for (auto it = lists.begin(); it != lists.end(); ++it)
+    cu_function_lists[it->first].swap (it->second);
+  cache_hit (path);
+}
+
+
+void
+dwflpp::save_function_index(Dwarf* dwarf, const string& path, size_t ncus)
+{
+  // Only complete lists are saved, which is whenever some query went
+  // through all of the module's functions.
+  auto v = module_cu_cache.find (dwarf);
+  if (v == module_cu_cache.end() || v->second->size() < ncus)
+    return;
+
+  vector<uint64_t> words;
+  words.push_back (function_index_magic);
+  words.push_back (ncus);
+  for (size_t c = 0; c < ncus; c++)
+    {
+      Dwarf_Die& cu = (*v->second)[c];
+      auto funcs = cu_function_lists.find (cu.addr);
+      if (funcs == cu_function_lists.end())
+        return;
+
+      words.push_back (dwarf_dieoffset (&cu));
+      words.push_back (funcs->second.size());
+      for (auto f = funcs->second.begin(); f != funcs->second.end(); ++f)
+        {
+          // The functions of units imported from a dwz file can't be
+          // found again by their offset alone.
+          Dwarf_Off off = dwarf_dieoffset (&f->second);
+          Dwarf_Die die;
+          if (!dwarf_offdie (dwarf, off, &die) || die.addr != f->second.addr
+              || dwarf_tag (&die) != DW_TAG_subprogram)
+            return;
+          words.push_back (off);
+        }
+    }
+
+  phase_timer timer (sess.timings, "dwarf.index");
+  string data ((const char *) words.data(), words.size() * sizeof(uint64_t));
+  if (!write_file_atomically (path, data) && sess.verbose > 1)
+    clog << _F("Failed to save function index file \"%s\": %s",
+               path.c_str (), strerror (errno)) << endl;
+}
+
+
+// The prologue file of a module sits next to its function index, as an
+// array of 64-bit words: a magic number, then for each function its DIE
+// offset, entrypc and post-prologue address.
+static const uint64_t prologue_cache_magic = 0x3150464450415453ULL;
+
+dwflpp::prologue_cache_t&
+dwflpp::get_prologue_cache()
+{
+  assert(module_dwarf);
+
+  auto it = prologue_caches.find (module_dwarf);
+  if (it != prologue_caches.end())
+    return it->second;
+
+  prologue_cache_t& pc = prologue_caches[module_dwarf];
+  const string& path = function_index_path (module);
+  if (path.empty() || sess.poison_cache)
+    return pc;
+
+  phase_timer timer (sess.timings, "dwarf.index");
+  ifstream in ((path + ".prologue").c_str(), ios::binary);
+  vector<uint64_t> words;
+  uint64_t w;
+  while (in.read ((char *) &w, sizeof(w)))
+    words.push_back (w);
+
+  // Entries name DIEs by offset alone, so only trust a whole file.
+  if (words.empty() || words[0] != prologue_cache_magic
+      || (words.size() - 1) % 3 != 0 || !in.eof())
+    return pc;
+  for (size_t i = 1; i < words.size(); i += 3)
+    pc[make_pair (words[i], words[i + 1])] = words[i + 2];
+  cache_hit (path + ".prologue");
+  return pc;
+}
+
+
+void
+dwflpp::save_prologue_cache(Dwarf* dwarf, const string& path)
+{
+  auto it = prologue_caches.find (dwarf);
+  if (it == prologue_caches.end() || path.empty())
+    return;
+
+  vector<uint64_t> words;
+  words.push_back (prologue_cache_magic);
+  for (auto e = it->second.begin(); e != it->second.end(); ++e)
+    {
+      words.push_back (e->first.first);
+      words.push_back (e->first.second);
+      words.push_back (e->second);
+    }
+
+  phase_timer timer (sess.timings, "dwarf.index");
+  string file = path + ".prologue";
+  string data ((const char *) words.data(), words.size() * sizeof(uint64_t));
+  if (!write_file_atomically (file, data) && sess.verbose > 1)
+    clog << _F("Failed to save prologue file \"%s\": %s",
+               file.c_str (), strerror (errno)) << endl;
+}
+
+
 template<> void
 dwflpp::iterate_over_modules<void>(int (*callback)(Dwfl_Module*,
                                                    void**,
@@ -422,6 +732,7 @@ dwflpp::iterate_over_modules<void>(int (*callback)(Dwfl_Module*,
                                                    void*),
                                    void *data)
 {
+  phase_timer timer (sess.timings, "dwarf.modules");
   dwfl_getmodules (dwfl, callback, data, 0);
 
   // Don't complain if we exited dwfl_getmodules early.
@@ -440,6 +751,7 @@ dwflpp::iterate_over_cus<void>(int (*callback)(Dwarf_Die*, void*),
                                void *data,
                                bool want_types)
 {
+  phase_timer timer (sess.timings, "dwarf.cus");
   get_module_dwarf(false);
   Dwarf *dw = module_dwarf;
   if (!dw) return;
@@ -464,6 +776,8 @@ dwflpp::iterate_over_cus<void>(int (*callback)(Dwarf_Die*, void*),
             v->push_back (*die); /* copy */
           off = noff;
         }
+
+      load_function_index (dw, function_index_path (module), *v);
     }
 
   if (want_types && module_tus_read.find(dw) == module_tus_read.end())
@@ -490,6 +804,7 @@ dwflpp::iterate_over_cus<void>(int (*callback)(Dwarf_Die*, void*),
 
   for (auto i = v->begin(); i != v->end(); ++i)
     {
+      timer.add ();
       int rc = (*callback)(&*i, data);
       assert_no_interrupts();
       if (rc != DWARF_CB_OK)
@@ -970,15 +1285,139 @@ dwflpp::cu_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v)
 
 
 int
-dwflpp::mod_function_caching_callback (Dwarf_Die* cu, cu_function_cache_t *v)
+dwflpp::mod_function_caching_callback (Dwarf_Die* cu,
+                                       pair<dwflpp*, cu_function_cache_t*> *data)
 {
-  // need to cast callback to func which accepts void*
-  dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
-                  v, 0);
+  data->first->scan_module_functions (data->first->module_dwarf);
+  data->first->cache_cu_functions (cu, data->second);
   return DWARF_CB_OK;
 }
 
 
+// Read the function lists of all of the module's CUs at once, split
+// among up to sess.jobs threads.  libdw keeps per-Dwarf state (the
+// abbreviation tables and such) that isn't safe to share, so each
+// thread reads through a Dwarf of its own over the same Elf, which
+// the main thread opens and closes.  They only pass back DIE offsets,
+// which are turned into our own DIEs afterward, CU by CU in order, so
+// that the lists come out the same as the serial dwarf_getfuncs.
+void
+dwflpp::scan_module_functions (Dwarf* dwarf)
+{
+#if _ELFUTILS_PREREQ (0, 170)
+  if (sess.jobs < 2)
+    return;
+  auto cuit = module_cu_cache.find (dwarf);
+  if (cuit == module_cu_cache.end() || !cuit->second)
+    return;
+  if (!module_functions_scanned.insert (dwarf).second)
+    return;
+
+  // The DIEs of a dwz alternate file would need a second set of handles;
+  // leave those modules to the serial scan.
+  if (dwarf_getalt (dwarf) != NULL)
+    return;
+
+  vector<Dwarf_Off> cus;
+  for (auto cu = cuit->second->begin(); cu != cuit->second->end(); ++cu)
+    if (dwarf_tag (&*cu) == DW_TAG_compile_unit
+        && cu_function_lists.find (cu->addr) == cu_function_lists.end())
+      cus.push_back (dwarf_dieoffset (&*cu));
+
+  // Not worth the threads for a handful of CUs
+  unsigned nthreads = min ((size_t) sess.jobs, cus.size() / 8);
+  if (nthreads < 2)
+    return;
+
+  phase_timer timer (sess.timings, "dwarf.functions");
+  timer.add (cus.size());
+
+  vector<Dwarf*> dwarfs;
+  for (unsigned i = 0; i < nthreads; ++i)
+    {
+      Dwarf* d = dwarf_begin_elf (dwarf_getelf (dwarf), DWARF_C_READ, NULL);
+      if (!d)
+        break;
+      dwarfs.push_back (d);
+    }
+
+  typedef vector<pair<const char*, Dwarf_Off> > offset_list;
+  vector<offset_list> lists (cus.size());
+  auto callback = [](Dwarf_Die* func, void* arg) -> int
+    {
+      // NB: just like function_list_callback; the names point into
+      // the Elf's own data, so they outlive this Dwarf.
+      const char *name = dwarf_diename(func);
+      if (name)
+        static_cast<offset_list*>(arg)
+          ->push_back(make_pair(name, dwarf_dieoffset(func)));
+      return DWARF_CB_OK;
+    };
+  if (!dwarfs.empty())
+    parallel_for (cus.size(), dwarfs.size(), [&](size_t i, unsigned t)
+      {
+        if (pending_interrupts)
+          return false;
+        Dwarf_Die cu_mem;
+        Dwarf_Die *cu = dwarf_offdie (dwarfs[t], cus[i], &cu_mem);
+        if (cu)
+          dwarf_getfuncs (cu, callback, &lists[i], 0);
+        return true;
+      });
+  for (size_t i = 0; i < dwarfs.size(); ++i)
+    dwarf_end (dwarfs[i]);
+  assert_no_interrupts();
+
+  // Without any Dwarf of its own, leave it all to the serial scan.
+  if (dwarfs.empty())
+    return;
+
+  for (size_t i = 0; i < cus.size(); ++i)
+    {
+      Dwarf_Die cu_mem;
+      Dwarf_Die *cu = dwarf_offdie (dwarf, cus[i], &cu_mem);
+      if (!cu)
+        continue;
+      vector<pair<const char*, Dwarf_Die> > funcs;
+      funcs.reserve (lists[i].size());
+      for (auto f = lists[i].begin(); f != lists[i].end(); ++f)
+        {
+          Dwarf_Die die;
+          if (dwarf_offdie (dwarf, f->second, &die))
+            funcs.push_back (make_pair (f->first, die));
+        }
+      cu_function_lists[cu->addr].swap (funcs);
+    }
+#endif
+}
+
+
+void
+dwflpp::cache_cu_functions (Dwarf_Die* cu, cu_function_cache_t *v)
+{
+  auto it = cu_function_lists.find (cu->addr);
+  if (it == cu_function_lists.end())
+    {
+      if (unsaved_function_indexes.find (module_dwarf)
+          == unsaved_function_indexes.end())
+        {
+          // need to cast callback to func which accepts void*
+          dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
+                          v, 0);
+          return;
+        }
+
+      // Keep the list for the module's function index too.
+      it = cu_function_lists.insert (make_pair (cu->addr,
+                                                vector<pair<const char*, Dwarf_Die> >())).first;
+      dwarf_getfuncs (cu, function_list_callback, &it->second, 0);
+    }
+
+  for (auto f = it->second.begin(); f != it->second.end(); ++f)
+    v->insert(make_pair(f->first, f->second));
+}
+
+
 template<> int
 dwflpp::iterate_over_functions<void>(int (*callback)(Dwarf_Die*, void*),
                                      void *data, const string& function)
@@ -990,11 +1429,13 @@ dwflpp::iterate_over_functions<void>(int (*callback)(Dwarf_Die*, void*),
   cu_function_cache_t *v = cu_function_cache[cu->addr];
   if (v == 0)
     {
+      // A wildcard will likely visit every CU of the module
+      if (name_has_wildcard (function))
+        scan_module_functions (module_dwarf);
+
       v = new cu_function_cache_t;
       cu_function_cache[cu->addr] = v;
-      // need to cast callback to func which accepts void*
-      dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
-                      v, 0);
+      cache_cu_functions (cu, v);
       if (sess.verbose > 4)
         clog << _F("function cache %s:%s size %zu", module_name.c_str(),
                    cu_name().c_str(), v->size()) << endl;
@@ -1080,7 +1521,8 @@ dwflpp::iterate_single_function<void>(int (*callback)(Dwarf_Die*, void*),
     {
       v = new cu_function_cache_t;
       mod_function_cache[module_dwarf] = v;
-      iterate_over_cus (mod_function_caching_callback, v, false);
+      pair<dwflpp*, cu_function_cache_t*> data (this, v);
+      iterate_over_cus (mod_function_caching_callback, &data, false);
       if (sess.verbose > 4)
         clog << _F("module function cache %s size %zu", module_name.c_str(),
                    v->size()) << endl;
@@ -1542,7 +1984,9 @@ lineno_equal_range(lines_t* v, int lineno)
   return equal_range(v->begin(), v->end(), (Dwarf_Line*)NULL, lc);
 }
 
-// Interface to CU lines cache sorted by lineno
+// Interface to CU lines cache sorted by lineno.  The first lookup in a CU
+// splits all of its lines by srcfile in one pass, so that statement probes
+// on many files of the CU don't each rescan its whole line table.
 lines_t*
 dwflpp::get_cu_lines_sorted_by_lineno(const char *srcfile)
 {
@@ -1553,44 +1997,91 @@ dwflpp::get_cu_lines_sorted_by_lineno(const char *srcfile)
     {
       srcfile_lines = new srcfile_lines_cache_t();
       cu_lines_cache[cu] = srcfile_lines;
-    }
 
-  lines_t *lines = (*srcfile_lines)[srcfile];
-  if (!lines)
-    {
       size_t nlines_cu = 0;
       Dwarf_Lines *lines_cu = NULL;
       DWARF_ASSERT("dwarf_getsrclines",
                    dwarf_getsrclines(cu, &lines_cu, &nlines_cu));
 
-      lines = new lines_t();
-      (*srcfile_lines)[srcfile] = lines;
-
+      // NB: the names come from the CU's file table, so each srcfile has
+      // just the one pointer; only go by the string once per pointer.
+      unordered_map<const char*, lines_t*> by_name;
       for (size_t i = 0; i < nlines_cu; i++)
         {
           Dwarf_Line *line = dwarf_onesrcline(lines_cu, i);
           const char *linesrc = DWARF_LINESRC(line);
-          if (strcmp(srcfile, linesrc))
-            continue;
+          lines_t *&lines = by_name[linesrc];
+          if (!lines)
+            {
+              lines = (*srcfile_lines)[linesrc];
+              if (!lines)
+                lines = (*srcfile_lines)[linesrc] = new lines_t();
+            }
           lines->push_back(line);
         }
 
-      if (lines->size() > 1)
-        sort(lines->begin(), lines->end(), compare_lines);
-
-      if (sess.verbose > 3)
+      for (auto it = srcfile_lines->begin(); it != srcfile_lines->end(); ++it)
         {
-          clog << _F("found the following lines for %s:", srcfile) << endl;
-          for (auto i  = lines->begin(); i != lines->end(); ++i)
-            cout << DWARF_LINENO(*i) << " = " << hex
-                 << DWARF_LINEADDR(*i) << dec << endl;
+          lines_t *lines = it->second;
+          if (lines->size() > 1)
+            sort(lines->begin(), lines->end(), compare_lines);
+
+          if (sess.verbose > 3)
+            {
+              clog << _F("found the following lines for %s:", it->first.c_str()) << endl;
+              for (auto i  = lines->begin(); i != lines->end(); ++i)
+                cout << DWARF_LINENO(*i) << " = " << hex
+                     << DWARF_LINEADDR(*i) << dec << endl;
+            }
         }
     }
+
+  lines_t *&lines = (*srcfile_lines)[srcfile];
+  if (!lines)
+    lines = new lines_t();
+  return lines;
+}
+
+static bool
+compare_line_addrs(Dwarf_Line* a, Dwarf_Line* b)
+{
+  return DWARF_LINEADDR(a) < DWARF_LINEADDR(b);
+}
+
+static bool
+line_addr_less(Dwarf_Line* line, Dwarf_Addr addr)
+{
+  return DWARF_LINEADDR(line) < addr;
+}
+
+// Interface to CU lines cache sorted by addr, for the functions that have
+// no line record at their entrypc.
+lines_t*
+dwflpp::get_cu_lines_sorted_by_addr()
+{
+  assert(cu);
+
+  lines_t *&lines = cu_addr_lines_cache[cu];
+  if (!lines)
+    {
+      size_t nlines_cu = 0;
+      Dwarf_Lines *lines_cu = NULL;
+      DWARF_ASSERT("dwarf_getsrclines",
+                   dwarf_getsrclines(cu, &lines_cu, &nlines_cu));
+
+      lines = new lines_t();
+      lines->reserve(nlines_cu);
+      for (size_t i = 0; i < nlines_cu; i++)
+        lines->push_back(dwarf_onesrcline(lines_cu, i));
+
+      // NB: stable, so that lines at one addr stay in line table order
+      stable_sort(lines->begin(), lines->end(), compare_line_addrs);
+    }
   return lines;
 }
 
 static Dwarf_Line*
-get_func_first_line(Dwarf_Die *cu, base_func_info& func)
+get_func_first_line(Dwarf_Die *cu, lines_t *addr_lines, base_func_info& func)
 {
   // dwarf_getsrc_die() uses binary search to find the Dwarf_Line, but will
   // return the wrong line if not found.
@@ -1598,22 +2089,22 @@ get_func_first_line(Dwarf_Die *cu, base_func_info& func)
   if (line && DWARF_LINEADDR(line) == func.entrypc)
     return line;
 
-  // Line not found (or line at wrong addr). We have to resort to a slower
-  // linear method. We won't find an exact match (probably this is an inlined
-  // instance), so just settle on the first Dwarf_Line with lowest addr which
-  // falls in the die.
-  size_t nlines = 0;
-  Dwarf_Lines *lines = NULL;
-  DWARF_ASSERT("dwarf_getsrclines",
-               dwarf_getsrclines(cu, &lines, &nlines));
-
-  for (size_t i = 0; i < nlines; i++)
+  // Line not found (or line at wrong addr). We won't find an exact match
+  // (probably this is an inlined instance), so just settle on the first
+  // Dwarf_Line with lowest addr which falls in the die, by looking up each
+  // of its address ranges in the CU's lines sorted by addr.
+  Dwarf_Line *first = NULL;
+  Dwarf_Addr base, lo, hi;
+  ptrdiff_t offset = 0;
+  while ((offset = dwarf_ranges(&func.die, offset, &base, &lo, &hi)) > 0)
     {
-      line = dwarf_onesrcline(lines, i);
-      if (dwarf_haspc(&func.die, DWARF_LINEADDR(line)))
-        return line;
+      auto it = lower_bound(addr_lines->begin(), addr_lines->end(),
+                            lo, line_addr_less);
+      if (it != addr_lines->end() && DWARF_LINEADDR(*it) < hi
+          && (!first || DWARF_LINEADDR(*it) < DWARF_LINEADDR(first)))
+        first = *it;
     }
-  return NULL;
+  return first;
 }
 
 static lines_t
@@ -1629,10 +2120,11 @@ collect_lines_in_die(lines_range_t range, Dwarf_Die *die)
 static void
 add_matching_lines_in_func(Dwarf_Die *cu,
                            lines_t *cu_lines,
+                           lines_t *addr_lines,
                            base_func_info& func,
                            lines_t& matching_lines)
 {
-  Dwarf_Line *start_line = get_func_first_line(cu, func);
+  Dwarf_Line *start_line = get_func_first_line(cu, addr_lines, func);
   if (!start_line)
     return;
 
@@ -1665,17 +2157,17 @@ dwflpp::collect_all_lines(char const * srcfile,
 {
   // This is where we handle WILDCARD lineno types.
   lines_t *cu_lines = get_cu_lines_sorted_by_lineno(srcfile);
+  lines_t *addr_lines = get_cu_lines_sorted_by_addr();
   for (auto func = funcs.begin(); func != funcs.end(); ++func)
-    add_matching_lines_in_func(cu, cu_lines, *func, matching_lines);
+    add_matching_lines_in_func(cu, cu_lines, addr_lines, *func, matching_lines);
 }
 
 
 static void
-add_matching_line_in_die(lines_t *cu_lines,
+add_matching_line_in_die(lines_range_t lineno_range,
                          lines_t& matching_lines,
-                         Dwarf_Die *die, int lineno)
+                         Dwarf_Die *die)
 {
-  lines_range_t lineno_range = lineno_equal_range(cu_lines, lineno);
   lines_t lines_in_die = collect_lines_in_die(lineno_range, die);
   if (lines_in_die.empty())
     return;
@@ -1706,10 +2198,22 @@ dwflpp::collect_lines_for_single_lineno(char const * srcfile,
    * confident from what lineno we adjust.
    */
   lines_t *cu_lines = get_cu_lines_sorted_by_lineno(srcfile);
+
+  // An absolute lineno is the same for every function, so only look it up
+  // once; ranges of linenos mostly hit ones with no LRs at all.
+  lines_range_t lineno_range;
+  if (!is_relative)
+    {
+      lineno_range = lineno_equal_range(cu_lines, lineno);
+      if (lineno_range.first == lineno_range.second)
+        return;
+    }
+
   for (auto func = funcs.begin(); func != funcs.end(); ++func)
-    add_matching_line_in_die(cu_lines, matching_lines, &func->die,
-                             is_relative ? lineno + func->decl_line
-                                         : lineno);
+    add_matching_line_in_die(is_relative
+                             ? lineno_equal_range(cu_lines, lineno + func->decl_line)
+                             : lineno_range,
+                             matching_lines, &func->die);
 }
 
 static bool
@@ -1869,17 +2373,17 @@ dwflpp::iterate_over_srcfile_lines<void>(char const * srcfile,
           if (collected_linenos.find(*it) != collected_linenos.end())
             continue;
 
-          // remember end iterator so we can tell if things were found later
-          auto itend = matching_lines.end();
+          // remember the count so we can tell if things were found later
+          size_t nmatching = matching_lines.size();
 
           collect_lines_for_single_lineno(srcfile, *it, false, /* is_relative */
                                           current_funcs, matching_lines);
           // add to set if we found LRs
-          if (itend != matching_lines.end())
+          if (nmatching != matching_lines.size())
             collected_linenos.insert(*it);
 
           // if we didn't find anything and .nearest is given, then try nearest
-          if (itend == matching_lines.end() && has_nearest)
+          if (nmatching == matching_lines.size() && has_nearest)
             {
               int nearest_lineno = get_nearest_lineno(srcfile, *it,
                                                       current_funcs);
@@ -2298,6 +2802,45 @@ dwflpp::resolve_prologue_endings (func_info_map_t & funcs)
   assert(module);
   assert(cu);
 
+  // Take whatever an earlier probe point or run already found.  DIEs of
+  // a dwz file can't be told apart by their offset alone, so those are
+  // left out (with a zero offset in their key).
+  prologue_cache_t *pc = module_dwarf ? &get_prologue_cache() : NULL;
+  vector<pair<Dwarf_Off, Dwarf_Addr> > keys (funcs.size());
+  vector<bool> cached (funcs.size(), false);
+  bool uncached = false;
+  for (size_t i = 0; i < funcs.size(); i++)
+    {
+      Dwarf_Die die;
+      Dwarf_Off off = dwarf_dieoffset (&funcs[i].die);
+      if (pc && dwarf_offdie (module_dwarf, off, &die)
+          && die.addr == funcs[i].die.addr)
+        {
+          keys[i] = make_pair (off, funcs[i].entrypc);
+          auto it = pc->find (keys[i]);
+          if (it != pc->end())
+            {
+              if (it->second)
+                funcs[i].prologue_end = it->second;
+              cached[i] = true;
+              continue;
+            }
+        }
+      uncached = true;
+    }
+  if (!uncached)
+    return;
+
+  auto remember = [&](size_t i, Dwarf_Addr prologue_end)
+    {
+      if (!pc || !keys[i].first)
+        return;
+      (*pc)[keys[i]] = prologue_end;
+      const string& path = function_index_path (module);
+      if (!path.empty())
+        unsaved_prologue_caches[module_dwarf] = path;
+    };
+
   size_t nlines = 0;
   Dwarf_Lines *lines = NULL;
 
@@ -2352,6 +2895,10 @@ dwflpp::resolve_prologue_endings (func_info_map_t & funcs)
 
   for(auto it = funcs.begin(); it != funcs.end(); it++)
     {
+      size_t fi = it - funcs.begin();
+      if (cached[fi])
+        continue;
+
 #if 0 /* someday */
       Dwarf_Addr* bkpts = 0;
       int n = dwarf_entry_breakpoints (& it->die, & bkpts);
@@ -2382,6 +2929,7 @@ dwflpp::resolve_prologue_endings (func_info_map_t & funcs)
                        it->name.to_string().c_str());
           // This is probably an inlined function.  We'll end up using
           // its lowpc as a probe address.
+          remember(fi, 0);
           continue;
         }
 
@@ -2392,6 +2940,7 @@ dwflpp::resolve_prologue_endings (func_info_map_t & funcs)
                        it->name.to_string().c_str());
           // This is probably an inlined function.  We'll skip this instance;
           // it is messed up. 
+          remember(fi, 0);
           continue;
         }
 
@@ -2464,6 +3013,7 @@ dwflpp::resolve_prologue_endings (func_info_map_t & funcs)
         }
 
       it->prologue_end = postprologue_addr;
+      remember(fi, postprologue_addr);
 
       if (sess.verbose>2)
         {
@@ -92,6 +92,9 @@ typedef std::unordered_map<std::string, lines_t*> srcfile_lines_cache_t;
 // cu die -> (srcfile -> Dwarf_Line[])
 typedef std::unordered_map<void*, srcfile_lines_cache_t*> cu_lines_cache_t;
 
+// cu die -> Dwarf_Line[] (sorted by addr)
+typedef std::unordered_map<void*, lines_t*> cu_addr_lines_cache_t;
+
 // cu die -> {entry pcs}
 typedef std::unordered_set<Dwarf_Addr> entry_pc_cache_t;
 typedef std::unordered_map<void*, entry_pc_cache_t*> cu_entry_pc_cache_t;
@@ -216,6 +219,14 @@ struct dwflpp
 
   void get_module_dwarf(bool required = false, bool report = true);
 
+  // Read DWARF ahead of any query; safe to run concurrently with the
+  // prefetch of another dwflpp.
+  void prefetch();
+
+  // Look up the cached function index of each module, which prefetch()
+  // can then use in place of its scan.  Not concurrent-safe.
+  void find_function_indexes();
+
   void focus_on_module(Dwfl_Module * m, module_info * mi);
   void focus_on_cu(Dwarf_Die * c);
   void focus_on_function(Dwarf_Die * f);
@@ -507,6 +518,38 @@ private:
   mod_cu_function_cache_t cu_function_cache;
   mod_function_cache_t mod_function_cache;
 
+  // Functions of each CU in dwarf_getfuncs order, as read by prefetch(),
+  // loaded from the module's function index, or kept for saving one
+  std::unordered_map<void*, std::vector<std::pair<const char*, Dwarf_Die> > >
+    cu_function_lists;
+  void cache_cu_functions(Dwarf_Die* cu, cu_function_cache_t* v);
+
+  // Modules whose function lists were read by scan_module_functions()
+  std::set<Dwarf*> module_functions_scanned;
+  void scan_module_functions(Dwarf* dwarf);
+
+  // The function index files of each module, and those still to be
+  // written along with their number of compile units
+  std::unordered_map<Dwfl_Module*, std::string> function_index_paths;
+  std::unordered_map<Dwarf*, std::pair<std::string, size_t> >
+    unsaved_function_indexes;
+  const std::string& function_index_path(Dwfl_Module* mod);
+  void load_function_index(Dwarf* dwarf, const std::string& path,
+                           const std::vector<Dwarf_Die>& cus);
+  void save_function_index(Dwarf* dwarf, const std::string& path, size_t ncus);
+
+  // Post-prologue addresses of each module's functions, by DIE offset
+  // and entrypc, or 0 where none was found; kept next to the function
+  // index, and saved again if any were added
+  typedef std::map<std::pair<Dwarf_Off, Dwarf_Addr>, Dwarf_Addr> prologue_cache_t;
+  std::unordered_map<Dwarf*, prologue_cache_t> prologue_caches;
+  std::unordered_map<Dwarf*, std::string> unsaved_prologue_caches;
+  prologue_cache_t& get_prologue_cache();
+  void save_prologue_cache(Dwarf* dwarf, const std::string& path);
+  static int prefetch_module_callback (Dwfl_Module*, void**, const char*,
+                                       Dwarf_Addr, void* arg);
+  static int function_list_callback (Dwarf_Die* func, void* arg);
+
   std::set<void*> cu_inl_function_cache_done; // CUs that are already cached
   cu_inl_function_cache_t cu_inl_function_cache;
   void cache_inline_instances (Dwarf_Die* die);
@@ -515,9 +558,12 @@ private:
   void cache_die_parents(cu_die_parent_cache_t* parents, Dwarf_Die* die);
   cu_die_parent_cache_t *get_die_parents();
 
-  // Cache for cu lines sorted by lineno
+  // Cache for cu lines sorted by lineno, split by srcfile
   cu_lines_cache_t cu_lines_cache;
 
+  // Cache for cu lines sorted by addr
+  cu_addr_lines_cache_t cu_addr_lines_cache;
+
   // Cache for all entry_pc in each cu
   cu_entry_pc_cache_t cu_entry_pc_cache;
   bool check_cu_entry_pc(Dwarf_Die *cu, Dwarf_Addr pc);
@@ -573,10 +619,12 @@ private:
                                       (void*)data);
     }
 
-  static int mod_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v);
+  static int mod_function_caching_callback (Dwarf_Die* cu,
+                                            std::pair<dwflpp*, cu_function_cache_t*> *data);
   static int cu_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v);
 
   lines_t* get_cu_lines_sorted_by_lineno(const char *srcfile);
+  lines_t* get_cu_lines_sorted_by_addr();
 
   void collect_lines_for_single_lineno(char const * srcfile,
                                        int lineno,
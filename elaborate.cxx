@@ -691,6 +691,8 @@ match_node::suggest_functors(systemtap_session& s, string functor)
         ftor.erase(ftor.find('('));
       functors.insert(ftor);
     }
+  if (this == s.pattern_root && s.library_index)
+    s.library_index->collect_aliases(functors);
   return levenshtein_suggest(functor, functors, 5); // print top 5
 }
 
@@ -1013,6 +1015,17 @@ derive_probes (systemtap_session& s,
       if (s.verbose > 4)
         clog << "derive-probes " << *loc << endl;
 
+      // Bring in any library aliases this might refer to.  A "**" in the
+      // first component can span several, so only its prefix counts.
+      if (s.library_index)
+        {
+          string first = loc->components[0]->functor;
+          size_t dglob = first.find("**");
+          if (dglob != string::npos)
+            first = first.substr(0, dglob) + "*";
+          s.library_index->load_aliases (s, first);
+        }
+
       try
         {
           unsigned num_atbegin = dps.size();
@@ -1810,6 +1823,7 @@ build_no_more (systemtap_session& s)
 static int
 semantic_pass_symbols (systemtap_session& s)
 {
+  phase_timer timer (s.timings, "pass2.symbols");
   symresolution_info sym (s);
 
   // If we're listing functions, then we need to include all the files. Probe
@@ -1884,7 +1898,10 @@ semantic_pass_symbols (systemtap_session& s)
 
           // much magic happens here: probe alias expansion, wildcard
           // matching, low-level derived_probe construction.
+          phase_timer derive_timer (s.timings, "pass2.derive_probes");
           derive_probes (s, p, dps);
+          derive_timer.add (dps.size());
+          derive_timer.stop ();
 
           for (unsigned j=0; j<dps.size(); j++)
             {
@@ -1971,7 +1988,7 @@ void add_global_var_display (systemtap_session& s)
   // dump mode at all, since it'll never be used.
   if (s.dump_mode) return;
 
-  varuse_collecting_visitor vut(s);
+  varuse_collecting_visitor vut(s, true);
 
   for (unsigned i=0; i<s.probes.size(); i++)
     {
@@ -1993,8 +2010,9 @@ void add_global_var_display (systemtap_session& s)
       // declared only within tapsets. (RHBZ 468139), but rather
       // only within the end-user script.
 
-      bool tapset_global = false;
-      for (size_t m=0; m < s.library_files.size(); m++)
+      bool tapset_global = (s.library_index &&
+                            s.library_index->defines_global(l->name));
+      for (size_t m=0; !tapset_global && m < s.library_files.size(); m++)
 	{
 	  for (size_t n=0; n < s.library_files[m]->globals.size(); n++)
 	    {
@@ -2787,6 +2805,8 @@ symresolution_info::find_var (interned_string name, int arity, const token* tok)
   }
 
   // search library globals
+  if (session.library_index)
+    session.library_index->load_globals (session, gname);
   for (unsigned i=0; i<session.library_files.size(); i++)
     {
       stapfile* f = session.library_files[i];
@@ -2831,6 +2851,9 @@ symresolution_info::find_functions (const string& name, unsigned arity, const to
         last = fd;
     }
 
+  if (session.library_index)
+    session.library_index->load_functions (session, name);
+
   // functions scanned by the parser are overloaded
   unsigned alternatives = session.overload_count[name];
   for (unsigned alt = 0; alt < alternatives; alt++)
@@ -2926,6 +2949,8 @@ symresolution_info::collect_functions(void)
         if (! f->functions[j]->name.starts_with("__private_"))
           funcs.insert(f->functions[j]->unmangled_name);
     }
+  if (session.library_index)
+    session.library_index->collect_functions(funcs);
 
   return funcs;
 }
@@ -2934,11 +2959,220 @@ symresolution_info::collect_functions(void)
 // optimization
 
 
+// The body-rewriting optimizations below look at one probe or function
+// body at a time.  Once they have all been through a body without
+// changing it, going through it again can only find something new if
+// one of its inputs changed: the body itself, the bodies of the
+// functions it (transitively) calls, whose side-effects are consulted,
+// or whether the variables it assigns are read anywhere at all.  The
+// worklist tracks which bodies may still be rewritten, so that later
+// iterations of the relaxation loop only cost as much as what changed
+// in the previous one.  Bodies are identified by the address of their
+// probe's or function's body pointer.
+
+struct opt_body_refs: public traversing_visitor
+{
+  set<functiondecl*> calls;
+  set<vardecl*> vars;
+  bool defined_p; // still has an unresolved @defined
+
+  opt_body_refs(): defined_p(false) {}
+
+  void visit_functioncall (functioncall* e)
+  {
+    calls.insert (e->referents.begin(), e->referents.end());
+    traversing_visitor::visit_functioncall (e);
+  }
+  void visit_symbol (symbol* e) { vars.insert (e->referent); }
+  void visit_defined_op (defined_op* e)
+  {
+    defined_p = true;
+    traversing_visitor::visit_defined_op (e);
+  }
+};
+
+class opt_worklist
+{
+public:
+  opt_worklist (systemtap_session& s):
+    session (s), everything (true), outer_relaxed_p (true) {}
+
+  // Should this body be visited by the current pass?  If so, relaxed_p
+  // is reset, so that finish() can tell whether the visit changed it.
+  bool start (statement*& body, bool& relaxed_p);
+  void finish (statement*& body, bool& relaxed_p);
+
+  // Whether the iteration was relaxed before the current body started.
+  bool outer_relaxed () const { return outer_relaxed_p; }
+
+  // Only visit this body once per iteration, in non-rewriting passes.
+  bool wants (statement*& body) const
+  { return everything || current.find (&body) != current.end(); }
+
+  // The set of variables read anywhere, as of this iteration.
+  void note_reads (const set<vardecl*>& read);
+
+  void next_iteration ();
+
+private:
+  struct body_refs
+  {
+    functiondecl* owner;
+    set<functiondecl*> calls;
+    set<vardecl*> vars;
+    bool defined_p;
+    body_refs(): owner(0), defined_p(false) {}
+  };
+
+  systemtap_session& session;
+  bool everything; // first iteration: visit all, no index needed yet
+  bool outer_relaxed_p;
+  set<statement**> current, next;
+  set<vardecl*> last_read;
+
+  map<statement**, body_refs> bodies;
+  map<functiondecl*, set<statement**> > callers;
+  map<vardecl*, set<statement**> > users;
+
+  void index (statement** body, functiondecl* owner);
+  void touch_callers (functiondecl* fd);
+};
+
+
+bool
+opt_worklist::start (statement*& body, bool& relaxed_p)
+{
+  if (!wants (body))
+    return false;
+  outer_relaxed_p = relaxed_p;
+  relaxed_p = true;
+  return true;
+}
+
+
+void
+opt_worklist::finish (statement*& body, bool& relaxed_p)
+{
+  if (!relaxed_p)
+    {
+      next.insert (&body);
+      if (!everything)
+        {
+          // The first iteration revisits everything, and index() will
+          // pick up the new shape of the body when it is over.
+          body_refs& br = bodies[&body];
+          index (&body, br.owner);
+          if (br.owner)
+            touch_callers (br.owner);
+        }
+    }
+  relaxed_p = relaxed_p && outer_relaxed_p;
+  outer_relaxed_p = true;
+}
+
+
+void
+opt_worklist::index (statement** body, functiondecl* owner)
+{
+  body_refs& br = bodies[body];
+  for (set<functiondecl*>::iterator it = br.calls.begin(); it != br.calls.end(); ++it)
+    callers[*it].erase (body);
+  for (set<vardecl*>::iterator it = br.vars.begin(); it != br.vars.end(); ++it)
+    users[*it].erase (body);
+
+  opt_body_refs obr;
+  (*body)->visit (& obr);
+  br.owner = owner;
+  br.calls.swap (obr.calls);
+  br.vars.swap (obr.vars);
+  br.defined_p = obr.defined_p;
+
+  for (set<functiondecl*>::iterator it = br.calls.begin(); it != br.calls.end(); ++it)
+    callers[*it].insert (body);
+  for (set<vardecl*>::iterator it = br.vars.begin(); it != br.vars.end(); ++it)
+    users[*it].insert (body);
+}
+
+
+// A function body changed, so its (transitive) callers may have become
+// rewritable too, both later in this iteration and in the next one.
+void
+opt_worklist::touch_callers (functiondecl* fd)
+{
+  vector<functiondecl*> todo (1, fd);
+  set<functiondecl*> done (todo.begin(), todo.end());
+  while (!todo.empty())
+    {
+      set<statement**>& cs = callers[todo.back()];
+      todo.pop_back();
+      for (set<statement**>::iterator it = cs.begin(); it != cs.end(); ++it)
+        {
+          current.insert (*it);
+          next.insert (*it);
+          functiondecl* owner = bodies[*it].owner;
+          if (owner && done.insert (owner).second)
+            todo.push_back (owner);
+        }
+    }
+}
+
+
+void
+opt_worklist::note_reads (const set<vardecl*>& read)
+{
+  if (!everything)
+    {
+      // Assignments to a variable that stopped (or started) being read
+      // anywhere may now be treated differently.
+      vector<vardecl*> flipped;
+      set_symmetric_difference (read.begin(), read.end(),
+                                last_read.begin(), last_read.end(),
+                                back_inserter (flipped));
+      for (unsigned i = 0; i < flipped.size(); i++)
+        {
+          set<statement**>& us = users[flipped[i]];
+          current.insert (us.begin(), us.end());
+        }
+    }
+  last_read = read;
+}
+
+
+void
+opt_worklist::next_iteration ()
+{
+  if (everything)
+    {
+      everything = false;
+      for (unsigned i = 0; i < session.probes.size(); i++)
+        index (& session.probes[i]->body, 0);
+      for (map<string,functiondecl*>::iterator it = session.functions.begin();
+           it != session.functions.end(); it++)
+        index (& it->second->body, it->second);
+
+      set<statement**> changed (next);
+      for (set<statement**>::iterator it = changed.begin(); it != changed.end(); ++it)
+        if (bodies[*it].owner)
+          touch_callers (bodies[*it].owner);
+    }
+
+  current.clear ();
+  current.swap (next);
+
+  // Leftover @defined()s are collapsed one at a time, whenever an
+  // iteration has not changed anything else, so keep visiting them.
+  for (map<statement**, body_refs>::iterator it = bodies.begin(); it != bodies.end(); ++it)
+    if (it->second.defined_p)
+      current.insert (it->first);
+}
+
+
 // Do away with functiondecls that are never (transitively) called
 // from probes.
 void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
 {
-  functioncall_traversing_visitor ftv;
+  phase_timer timer (s.timings, "pass2.opt1");
+  functioncall_traversing_visitor ftv (true);
   for (unsigned i=0; i<s.probes.size(); i++)
     {
       s.probes[i]->body->visit (& ftv);
@@ -2977,7 +3211,8 @@ void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
 // written nor read.
 void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterations)
 {
-  varuse_collecting_visitor vut(s);
+  phase_timer timer (s.timings, "pass2.opt2");
+  varuse_collecting_visitor vut(s, true);
 
   for (unsigned i=0; i<s.probes.size(); i++)
     {
@@ -3231,7 +3466,7 @@ dead_assignment_remover::visit_assignment (assignment* e)
 		break;
 	      }
 
-          varuse_collecting_visitor lvut(session);
+          varuse_collecting_visitor lvut(session, true);
           e->left->visit (& lvut);
           if (lvut.side_effect_free () && !is_global // XXX: use _wrt() once we track focal_vars
               && !leftvar->synthetic) // don't elide assignment to synthetic $context variables
@@ -3280,23 +3515,35 @@ dead_assignment_remover::visit_try_block (try_block *s)
 // rewrite "(foo = expr)" as "(expr)".  This makes foo a candidate to
 // be optimized away as an unused variable, and expr a candidate to be
 // removed as a side-effect-free statement expression.  Wahoo!
-void semantic_pass_opt3 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt3 (systemtap_session& s, bool& relaxed_p, opt_worklist& wl)
 {
+  phase_timer timer (s.timings, "pass2.opt3");
   // Recompute the varuse data, which will probably match the opt2
   // copy of the computation, except for those totally unused
   // variables that opt2 removed.
-  varuse_collecting_visitor vut(s);
+  varuse_collecting_visitor vut(s, true);
   for (unsigned i=0; i<s.probes.size(); i++)
     s.probes[i]->body->visit (& vut); // includes reachable functions too
+  wl.note_reads (vut.read);
 
   dead_assignment_remover dar (s, relaxed_p, vut);
   // This instance may be reused for multiple probe/function body trims.
 
   for (unsigned i=0; i<s.probes.size(); i++)
-    dar.replace (s.probes[i]->body);
+    if (wl.start (s.probes[i]->body, relaxed_p))
+      {
+        timer.add ();
+        dar.replace (s.probes[i]->body);
+        wl.finish (s.probes[i]->body, relaxed_p);
+      }
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    dar.replace (it->second->body);
+    if (wl.start (it->second->body, relaxed_p))
+      {
+        timer.add ();
+        dar.replace (it->second->body);
+        wl.finish (it->second->body, relaxed_p);
+      }
   // The rewrite operation is performed within the visitor.
 
   // XXX: we could also zap write-only globals here
@@ -3406,7 +3653,7 @@ dead_stmtexpr_remover::visit_if_statement (if_statement *s)
         {
           // We may be able to elide this statement, if the condition
           // expression is side-effect-free.
-          varuse_collecting_visitor vct(session);
+          varuse_collecting_visitor vct(session, true);
           s->condition->visit(& vct);
           if (vct.side_effect_free ())
             {
@@ -3472,7 +3719,7 @@ dead_stmtexpr_remover::visit_for_loop (for_loop *s)
     {
       // We may be able to elide this statement, if the condition
       // expression is side-effect-free.
-      varuse_collecting_visitor vct(session);
+      varuse_collecting_visitor vct(session, true);
       if (s->init) s->init->visit(& vct);
       s->cond->visit(& vct);
       if (s->incr) s->incr->visit(& vct);
@@ -3508,7 +3755,7 @@ dead_stmtexpr_remover::visit_expr_statement (expr_statement *s)
   // NB.  While we don't share nodes in the parse tree, let's not
   // deallocate *s anyway, just in case...
 
-  varuse_collecting_visitor vut(session);
+  varuse_collecting_visitor vut(session, true);
   s->value->visit (& vut);
 
   if (vut.side_effect_free_wrt (focal_vars))
@@ -3531,8 +3778,9 @@ dead_stmtexpr_remover::visit_expr_statement (expr_statement *s)
 }
 
 
-void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p, opt_worklist& wl)
 {
+  phase_timer timer (s.timings, "pass2.opt4");
   // Finally, let's remove some statement-expressions that have no
   // side-effect.  These should be exactly those whose private varuse
   // visitors come back with an empty "written" and "embedded" lists.
@@ -3545,6 +3793,9 @@ void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
       assert_no_interrupts();
 
       derived_probe* p = s.probes[i];
+      if (!wl.start (p->body, relaxed_p))
+        continue;
+      timer.add ();
 
       duv.focal_vars.clear ();
       duv.focal_vars.insert (s.globals.begin(),
@@ -3563,12 +3814,17 @@ void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
 
           // XXX: possible duplicate warnings; see below
         }
+      wl.finish (p->body, relaxed_p);
     }
   for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
     {
       assert_no_interrupts();
 
       functiondecl* fn = it->second;
+      if (!wl.start (fn->body, relaxed_p))
+        continue;
+      timer.add ();
+
       duv.focal_vars.clear ();
       duv.focal_vars.insert (fn->locals.begin(),
                              fn->locals.end());
@@ -3592,6 +3848,7 @@ void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
           // only after the relaxation iterations.
           // XXX: or else see bug #6469.
         }
+      wl.finish (fn->body, relaxed_p);
     }
 }
 
@@ -3878,7 +4135,7 @@ void_statement_reducer::visit_functioncall (functioncall* e)
   bool side_effect_free = true;
   for (unsigned i = 0; i < e->referents.size(); i++)
     {
-      varuse_collecting_visitor vut(session);
+      varuse_collecting_visitor vut(session, true);
       vut.seen.insert (e->referents[i]);
       vut.current_function = e->referents[i];
       e->referents[i]->body->visit (& vut);
@@ -4030,8 +4287,9 @@ void_statement_reducer::visit_defined_op (defined_op* e)
   provide (e);
 }
 
-void semantic_pass_opt5 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt5 (systemtap_session& s, bool& relaxed_p, opt_worklist& wl)
 {
+  phase_timer timer (s.timings, "pass2.opt5");
   // Let's simplify statements with unused computed values.
 
   void_statement_reducer vuv (s, relaxed_p);
@@ -4040,10 +4298,20 @@ void semantic_pass_opt5 (systemtap_session& s, bool& relaxed_p)
   vuv.focal_vars.insert (s.globals.begin(), s.globals.end());
 
   for (unsigned i=0; i<s.probes.size(); i++)
-    vuv.replace (s.probes[i]->body);
+    if (wl.start (s.probes[i]->body, relaxed_p))
+      {
+        timer.add ();
+        vuv.replace (s.probes[i]->body);
+        wl.finish (s.probes[i]->body, relaxed_p);
+      }
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    vuv.replace (it->second->body);
+    if (wl.start (it->second->body, relaxed_p))
+      {
+        timer.add ();
+        vuv.replace (it->second->body);
+        wl.finish (it->second->body, relaxed_p);
+      }
 }
 
 
@@ -4210,7 +4478,7 @@ const_folder::visit_binary_expression (binary_expression* e)
                       (right->value ==-1 && (e->op == "%" || e->op == "|")))))
     {
       expression* other = left ? e->right : e->left;
-      varuse_collecting_visitor vu(session);
+      varuse_collecting_visitor vu(session, true);
       other->visit(&vu);
       if (!vu.side_effect_free())
         {
@@ -4332,7 +4600,7 @@ const_folder::visit_logical_or_expr (logical_or_expr* e)
       // immediately.  Otherwise, we can only eliminate the LHS if it's pure.
       if (right)
         {
-          varuse_collecting_visitor vu(session);
+          varuse_collecting_visitor vu(session, true);
           e->left->visit(&vu);
           if (!vu.side_effect_free())
             {
@@ -4379,7 +4647,7 @@ const_folder::visit_logical_and_expr (logical_and_expr* e)
       // immediately.  Otherwise, we can only eliminate the LHS if it's pure.
       if (right)
         {
-          varuse_collecting_visitor vu(session);
+          varuse_collecting_visitor vu(session, true);
           e->left->visit(&vu);
           if (!vu.side_effect_free())
             {
@@ -4438,7 +4706,7 @@ const_folder::visit_comparison (comparison* e)
                             (e->op == "<=" || e->op == ">")))))
     {
       expression* other = left_num ? e->right : e->left;
-      varuse_collecting_visitor vu(session);
+      varuse_collecting_visitor vu(session, true);
       other->visit(&vu);
       if (!vu.side_effect_free())
         provide (e);
@@ -4561,7 +4829,8 @@ const_folder::visit_defined_op (defined_op* e)
     }
   else
   */
-  if (collapse_defines_p && relaxed_p)
+  if (collapse_defines_p && relaxed_p
+      && (!outer_relaxed_p || *outer_relaxed_p))
     {
       if (session.verbose>2)
         clog << _("Collapsing untouched @defined check ") << *e->tok << endl;
@@ -4624,8 +4893,10 @@ const_folder::visit_target_symbol (target_symbol* e)
 }
 
 static int initial_typeres_pass(systemtap_session& s);
-static int semantic_pass_const_fold (systemtap_session& s, bool& relaxed_p)
+static int semantic_pass_const_fold (systemtap_session& s, bool& relaxed_p,
+                                     opt_worklist& wl)
 {
+  phase_timer timer (s.timings, "pass2.const_fold");
   // attempt an initial type resolution pass to see if there are any type
   // mismatches before we starting whisking away vars that get switched out
   // with a const.
@@ -4642,11 +4913,28 @@ static int semantic_pass_const_fold (systemtap_session& s, bool& relaxed_p)
   const_folder cf (s, relaxed_p, true /* collapse remaining @defined()->0 now */ );
   // This instance may be reused for multiple probe/function body trims.
 
+  // @defined()s may only be collapsed once nothing else in this whole
+  // iteration changed, not just in the current body.
+  bool outer_relaxed_p = true;
+  cf.outer_relaxed_p = &outer_relaxed_p;
+
   for (unsigned i=0; i<s.probes.size(); i++)
-    cf.replace (s.probes[i]->body);
+    if (wl.start (s.probes[i]->body, relaxed_p))
+      {
+        timer.add ();
+        outer_relaxed_p = wl.outer_relaxed ();
+        cf.replace (s.probes[i]->body);
+        wl.finish (s.probes[i]->body, relaxed_p);
+      }
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    cf.replace (it->second->body);
+    if (wl.start (it->second->body, relaxed_p))
+      {
+        timer.add ();
+        outer_relaxed_p = wl.outer_relaxed ();
+        cf.replace (it->second->body);
+        wl.finish (it->second->body, relaxed_p);
+      }
   return 0;
 }
 
@@ -4690,18 +4978,30 @@ void dead_control_remover::visit_block (block* b)
 }
 
 
-static void semantic_pass_dead_control (systemtap_session& s, bool& relaxed_p)
+static void semantic_pass_dead_control (systemtap_session& s, bool& relaxed_p,
+                                        opt_worklist& wl)
 {
+  phase_timer timer (s.timings, "pass2.dead_control");
   // Let's remove code that follow unconditional control statements
 
   dead_control_remover dc (s, relaxed_p);
 
   for (unsigned i=0; i<s.probes.size(); i++)
-    s.probes[i]->body->visit(&dc);
+    if (wl.start (s.probes[i]->body, relaxed_p))
+      {
+        timer.add ();
+        s.probes[i]->body->visit(&dc);
+        wl.finish (s.probes[i]->body, relaxed_p);
+      }
 
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    it->second->body->visit(&dc);
+    if (wl.start (it->second->body, relaxed_p))
+      {
+        timer.add ();
+        it->second->body->visit(&dc);
+        wl.finish (it->second->body, relaxed_p);
+      }
 }
 
 
@@ -4772,29 +5072,41 @@ void dead_overload_remover::visit_functioncall(functioncall *e)
     }
 }
 
-static void semantic_pass_overload(systemtap_session& s, bool& relaxed_p)
+static void semantic_pass_overload(systemtap_session& s, bool& relaxed_p,
+                                   opt_worklist& wl)
 {
+  phase_timer timer (s.timings, "pass2.overload");
   set<functiondecl*> function_next;
   function_next_check fnc;
 
+  // NB: has_next is sticky, and optimizations only ever remove
+  // statements, so unchanged functions need not be rechecked.
   for (auto it = s.functions.begin(); it != s.functions.end(); ++it)
     {
       functiondecl* fn = it->second;
+      if (!wl.wants (fn->body))
+        continue;
       fnc.current_function = fn;
       fn->body->visit(&fnc);
     }
 
   for (auto it = s.probes.begin(); it != s.probes.end(); ++it)
-    {
-      dead_overload_remover ovr(s, relaxed_p);
-      (*it)->body->visit(&ovr);
-    }
+    if (wl.start ((*it)->body, relaxed_p))
+      {
+        timer.add ();
+        dead_overload_remover ovr(s, relaxed_p);
+        (*it)->body->visit(&ovr);
+        wl.finish ((*it)->body, relaxed_p);
+      }
 
   for (auto it = s.functions.begin(); it != s.functions.end(); ++it)
-    {
-      dead_overload_remover ovr(s, relaxed_p);
-      it->second->body->visit(&ovr);
-    }
+    if (wl.start (it->second->body, relaxed_p))
+      {
+        timer.add ();
+        dead_overload_remover ovr(s, relaxed_p);
+        it->second->body->visit(&ovr);
+        wl.finish (it->second->body, relaxed_p);
+      }
 }
 
 
@@ -4802,9 +5114,11 @@ struct duplicate_function_remover: public functioncall_traversing_visitor
 {
   systemtap_session& s;
   map<functiondecl*, functiondecl*>& duplicate_function_map;
+  set<functiondecl*> changed_functions;
 
   duplicate_function_remover(systemtap_session& sess,
 			     map<functiondecl*, functiondecl*>&dfm):
+    functioncall_traversing_visitor(true),
     s(sess), duplicate_function_map(dfm) {};
 
   void visit_functioncall (functioncall* e);
@@ -4829,6 +5143,8 @@ duplicate_function_remover::visit_functioncall (functioncall *e)
           e->tok = duplicate_function_map[referent]->tok;
           e->function = duplicate_function_map[referent]->name;
           e->referents[i] = duplicate_function_map[referent];
+          if (current_function)
+            changed_functions.insert (current_function);
         }
     }
 }
@@ -4853,8 +5169,10 @@ get_functionsig (functiondecl* f)
   return str;
 }
 
-void semantic_pass_opt6 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt6 (systemtap_session& s, bool& relaxed_p,
+                         map<functiondecl*, string>& functionsigs)
 {
+  phase_timer timer (s.timings, "pass2.opt6");
   // Walk through all the functions, looking for duplicates.
   map<string, functiondecl*> functionsig_map;
   map<functiondecl*, functiondecl*> duplicate_function_map;
@@ -4864,7 +5182,13 @@ void semantic_pass_opt6 (systemtap_session& s, bool& relaxed_p)
   for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
     {
       functiondecl *fd = it->second;
-      string functionsig = get_functionsig(fd);
+
+      // Signatures are kept across iterations, until a call within
+      // the function gets redirected below.
+      map<functiondecl*, string>::iterator sig = functionsigs.find(fd);
+      if (sig == functionsigs.end())
+        sig = functionsigs.insert(make_pair(fd, get_functionsig(fd))).first;
+      const string& functionsig = sig->second;
 
       if (functionsig_map.count(functionsig) == 0)
 	{
@@ -4897,6 +5221,10 @@ void semantic_pass_opt6 (systemtap_session& s, bool& relaxed_p)
 
       for (unsigned i=0; i < s.probes.size(); i++)
 	s.probes[i]->body->visit(&dfr);
+
+      for (set<functiondecl*>::iterator it = dfr.changed_functions.begin();
+           it != dfr.changed_functions.end(); it++)
+        functionsigs.erase (*it);
     }
 }
 
@@ -5210,6 +5538,7 @@ void stable_functioncall_visitor::visit_functioncall (functioncall* e)
 // top-level loops and put into if/try blocks.
 void semantic_pass_opt7(systemtap_session& s)
 {
+  phase_timer timer (s.timings, "pass2.opt7");
   set<string> stable_fcs;
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); ++it)
@@ -5252,6 +5581,7 @@ void semantic_pass_opt7(systemtap_session& s)
 static int
 semantic_pass_optimize1 (systemtap_session& s)
 {
+  phase_timer timer (s.timings, "pass2.optimize1");
   // In this pass, we attempt to rewrite probe/function bodies to
   // eliminate some blatantly unnecessary code.  This is run before
   // type inference, but after symbol resolution and derived_probe
@@ -5264,6 +5594,10 @@ semantic_pass_optimize1 (systemtap_session& s)
   // it below.
   save_and_restore<bool> suppress_warnings(& s.suppress_warnings);
 
+  // Only the bodies that changed, or whose callees or variables did,
+  // are revisited in later iterations.
+  opt_worklist wl (s);
+
   bool relaxed_p = false;
   unsigned iterations = 0;
   while (! relaxed_p)
@@ -5271,6 +5605,8 @@ semantic_pass_optimize1 (systemtap_session& s)
       assert_no_interrupts();
 
       relaxed_p = true; // until proven otherwise
+      if (iterations > 0)
+        wl.next_iteration ();
 
       // If the verbosity is high enough, always print warnings (overrides -w),
       // or if not, always suppress warnings for every itteration after the first.
@@ -5283,9 +5619,9 @@ semantic_pass_optimize1 (systemtap_session& s)
         {
           semantic_pass_opt1 (s, relaxed_p);
           semantic_pass_opt2 (s, relaxed_p, iterations); // produce some warnings only on iteration=0
-          semantic_pass_opt3 (s, relaxed_p);
-          semantic_pass_opt4 (s, relaxed_p);
-          semantic_pass_opt5 (s, relaxed_p);
+          semantic_pass_opt3 (s, relaxed_p, wl);
+          semantic_pass_opt4 (s, relaxed_p, wl);
+          semantic_pass_opt5 (s, relaxed_p, wl);
         }
 
       // For listing mode, we need const-folding regardless of optimization so
@@ -5293,13 +5629,13 @@ semantic_pass_optimize1 (systemtap_session& s)
       // We also want it in case variables are used in if/case expressions,
       // so enable always.  PR11366
       // rc is incremented if there is an error that got reported.
-      rc += semantic_pass_const_fold (s, relaxed_p);
+      rc += semantic_pass_const_fold (s, relaxed_p, wl);
 
       if (!s.unoptimized)
-        semantic_pass_dead_control (s, relaxed_p);
+        semantic_pass_dead_control (s, relaxed_p, wl);
 
       if (!s.unoptimized)
-        semantic_pass_overload (s, relaxed_p);
+        semantic_pass_overload (s, relaxed_p, wl);
 
       iterations ++;
     }
@@ -5311,6 +5647,7 @@ semantic_pass_optimize1 (systemtap_session& s)
 static int
 semantic_pass_optimize2 (systemtap_session& s)
 {
+  phase_timer timer (s.timings, "pass2.optimize2");
   // This is run after type inference.  We run an outer "relaxation"
   // loop that repeats the optimizations until none of them find
   // anything to remove.
@@ -5323,6 +5660,7 @@ semantic_pass_optimize2 (systemtap_session& s)
 
   bool relaxed_p = false;
   unsigned iterations = 0;
+  map<functiondecl*, string> functionsigs;
   while (! relaxed_p)
     {
       assert_no_interrupts();
@@ -5336,7 +5674,7 @@ semantic_pass_optimize2 (systemtap_session& s)
         s.suppress_warnings = true;
 
       if (!s.unoptimized)
-        semantic_pass_opt6 (s, relaxed_p);
+        semantic_pass_opt6 (s, relaxed_p, functionsigs);
 
       iterations++;
     }
@@ -5530,6 +5868,7 @@ static int initial_typeres_pass(systemtap_session& s)
 static int
 semantic_pass_types (systemtap_session& s)
 {
+  phase_timer timer (s.timings, "pass2.types");
   int rc = 0;
 
   // next pass: type inference
@@ -5681,7 +6020,10 @@ semantic_pass_types (systemtap_session& s)
                 cf.replace (it->second->body);
 
               if (! s.unoptimized)
-                semantic_pass_dead_control (s, relaxed_p);
+                {
+                  opt_worklist wl (s);
+                  semantic_pass_dead_control (s, relaxed_p, wl);
+                }
 
               if (! relaxed_p)
                 ti.mismatch_complexity = 0; // reset for next pass
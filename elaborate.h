@@ -457,10 +457,11 @@ struct const_folder: public update_visitor
   systemtap_session& session;
   bool& relaxed_p;
   bool collapse_defines_p;
+  const bool* outer_relaxed_p; // if set, @defined collapsing also waits on it
   
   const_folder(systemtap_session& s, bool& r, bool collapse_defines = false):
     session(s), relaxed_p(r), collapse_defines_p(collapse_defines),
-    last_number(0), last_string(0), last_target_symbol(0) {}
+    outer_relaxed_p(0), last_number(0), last_string(0), last_target_symbol(0) {}
 
   literal_number* last_number;
   literal_number* get_number(expression*& e);
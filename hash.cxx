@@ -17,6 +17,8 @@
 #include "config.h"
 #include "session.h"
 #include "hash.h"
+#include "parse.h"
+#include "staptree.h"
 #include "util.h"
 
 #include <cstdlib>
@@ -25,10 +27,12 @@
 #include <sstream>
 #include <iomanip>
 #include <cerrno>
+#include <mutex>
 
 extern "C" {
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <unistd.h>
 #include "mdfour.h"
 }
@@ -36,15 +40,176 @@ extern "C" {
 using namespace std;
 
 
+// With --cache-fingerprint=content, files are fingerprinted by the digest
+// of their contents rather than by their size and mtime.  The digests are
+// remembered, along with the stat data they were computed for, in a file
+// at the top of the cache, so that an unchanged file is only read once.
+class fingerprint_memo
+{
+private:
+  struct entry
+  {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    string digest;
+  };
+
+  string path;
+  map<string, entry> entries;
+  bool dirty;
+  mutex lock;
+
+  string file_digest(const string& file, const struct stat& st);
+
+public:
+  fingerprint_memo(const string& path);
+  string digest(const string& file);
+  void save();
+};
+
+
+fingerprint_memo::fingerprint_memo(const string& path):
+  path(path), dirty(false)
+{
+  if (path.empty())
+    return;
+
+  ifstream in(path.c_str());
+  string line;
+  while (getline(in, line))
+    {
+      istringstream ls(line);
+      entry e;
+      string file;
+      if (ls >> e.dev >> e.ino >> e.size >> e.mtime_sec >> e.mtime_nsec >> e.digest
+          && ls.get() == ' ' && getline(ls, file) && !file.empty())
+        entries[file] = e;
+    }
+}
+
+
+string
+fingerprint_memo::file_digest(const string& file, const struct stat& st)
+{
+  auto it = entries.find(file);
+  if (it != entries.end()
+      && it->second.dev == st.st_dev && it->second.ino == st.st_ino
+      && it->second.size == st.st_size
+      && it->second.mtime_sec == st.st_mtim.tv_sec
+      && it->second.mtime_nsec == st.st_mtim.tv_nsec)
+    return it->second.digest;
+
+  struct mdfour md4;
+  mdfour_begin(&md4);
+  ifstream in(file.c_str(), ios::binary);
+  char buf[65536];
+  while (in.read(buf, sizeof(buf)) || in.gcount() > 0)
+    mdfour_update(&md4, (const unsigned char *)buf, in.gcount());
+  if (in.bad())
+    return "-";
+  mdfour_update(&md4, NULL, 0);
+  unsigned char sum[16];
+  mdfour_result(&md4, sum);
+
+  ostringstream d;
+  d << hex << setfill('0');
+  for (int i=0; i<16; i++)
+    d << setw(2) << (unsigned)sum[i];
+
+  entry& e = entries[file];
+  e.dev = st.st_dev;
+  e.ino = st.st_ino;
+  e.size = st.st_size;
+  e.mtime_sec = st.st_mtim.tv_sec;
+  e.mtime_nsec = st.st_mtim.tv_nsec;
+  e.digest = d.str();
+  dirty = true;
+  return e.digest;
+}
+
+
+// A file is represented by the digest of its contents, and a directory
+// by the names and digests of the regular files directly in it, the same
+// depth that the stat fingerprint of a directory reaches.
+string
+fingerprint_memo::digest(const string& file)
+{
+  lock_guard<mutex> guard(lock);
+
+  struct stat st;
+  if (stat(file.c_str(), &st) != 0)
+    return "-";
+  if (S_ISREG(st.st_mode))
+    return file_digest(file, st);
+  if (!S_ISDIR(st.st_mode))
+    return "-";
+
+  set<string> names;
+  DIR *dir = opendir(file.c_str());
+  if (!dir)
+    return "-";
+  while (struct dirent *de = readdir(dir))
+    names.insert(de->d_name);
+  closedir(dir);
+
+  ostringstream listing;
+  for (auto it = names.begin(); it != names.end(); ++it)
+    {
+      string entry_path = file + "/" + *it;
+      struct stat est;
+      if (stat(entry_path.c_str(), &est) == 0 && S_ISREG(est.st_mode))
+        listing << *it << " " << file_digest(entry_path, est) << "\n";
+    }
+
+  struct mdfour md4;
+  string l = listing.str();
+  mdfour_begin(&md4);
+  mdfour_update(&md4, (const unsigned char *)l.data(), l.size());
+  mdfour_update(&md4, NULL, 0);
+  unsigned char sum[16];
+  mdfour_result(&md4, sum);
+
+  ostringstream d;
+  d << hex << setfill('0');
+  for (int i=0; i<16; i++)
+    d << setw(2) << (unsigned)sum[i];
+  return d.str();
+}
+
+
+void
+fingerprint_memo::save()
+{
+  lock_guard<mutex> guard(lock);
+  if (!dirty || path.empty())
+    return;
+  dirty = false;
+
+  // Concurrent runs may each save their own view; the last one wins,
+  // which at worst costs another run a reread.
+  ostringstream out;
+  for (auto it = entries.begin(); it != entries.end(); ++it)
+    out << it->second.dev << " " << it->second.ino << " "
+        << it->second.size << " " << it->second.mtime_sec << " "
+        << it->second.mtime_nsec << " " << it->second.digest << " "
+        << it->first << "\n";
+  write_file_atomically(path, out.str());
+}
+
+
 class stap_hash
 {
 private:
   struct mdfour md4;
   std::ostringstream parm_stream;
+  fingerprint_memo *memo; // content fingerprints, if wanted
 
 public:
-  stap_hash() { start(); }
-  stap_hash(const stap_hash &base) { md4 = base.md4; parm_stream << base.parm_stream.str(); }
+  stap_hash(fingerprint_memo *memo = NULL): memo(memo) { start(); }
+  stap_hash(const stap_hash &base): memo(base.memo) { md4 = base.md4; parm_stream << base.parm_stream.str(); }
 
   void start();
 
@@ -86,6 +251,13 @@ stap_hash::add(const std::string& d, const T& x)
 void
 stap_hash::add_path(const std::string& description, const std::string& path)
 {
+  if (memo)
+    {
+      add(description + "Path: ", path);
+      add(description + "Digest: ", memo->digest(path));
+      return;
+    }
+
   struct stat st;
   memset (&st, 0, sizeof(st));
 
@@ -130,19 +302,35 @@ void create_hash_log(const string &type_str, const string &parms, const string &
   log_file.close();
 }
 
-static const stap_hash&
-get_base_hash (systemtap_session& s)
+
+static fingerprint_memo *
+get_fingerprint_memo (systemtap_session& s)
 {
-  if (s.base_hash)
-    return *s.base_hash;
+  if (!s.content_fingerprints)
+    return NULL;
+
+  // NB: pass-1 parses tapsets in several threads
+  static mutex memo_lock;
+  lock_guard<mutex> guard(memo_lock);
+  if (!s.fingerprints)
+    s.fingerprints = new fingerprint_memo(s.cache_path.empty() ? ""
+                                          : s.cache_path + "/fingerprints");
+  return s.fingerprints;
+}
 
-  s.base_hash = new stap_hash();
-  stap_hash& h = *s.base_hash;
 
-  // Hash systemtap version
-  h.add("Systemtap version: ", s.version_string());
+static void
+save_fingerprint_memo (systemtap_session& s)
+{
+  if (s.fingerprints)
+    s.fingerprints->save();
+}
 
-  // Hash kernel release and arch.
+
+// Hash the kernel release, arch and build tree
+static void
+add_kernel_hash (stap_hash& h, systemtap_session& s)
+{
   h.add("Kernel Release: ", s.kernel_release);
   h.add_path("Kernel Build Tree ", s.kernel_build_tree);
   h.add("Architecture: ", s.architecture);
@@ -154,6 +342,22 @@ get_base_hash (systemtap_session& s)
   h.add_path("Kernel Build Tree compile.h ", s.kernel_build_tree + "/include/linux/compile.h");
   h.add_path("Kernel Build Tree version.h ", s.kernel_build_tree + "/include/linux/version.h");
   h.add_path("Kernel Build Tree utsrelease.h ", s.kernel_build_tree + "/include/linux/utsrelease.h");
+}
+
+
+static const stap_hash&
+get_base_hash (systemtap_session& s)
+{
+  if (s.base_hash)
+    return *s.base_hash;
+
+  s.base_hash = new stap_hash(get_fingerprint_memo(s));
+  stap_hash& h = *s.base_hash;
+
+  // Hash systemtap version
+  h.add("Systemtap version: ", s.version_string());
+
+  add_kernel_hash(h, s);
 
   // Hash runtime path (that gets added in as "-R path").
   h.add_path("Runtime ", s.runtime_path);
@@ -174,6 +378,7 @@ get_base_hash (systemtap_session& s)
   // /proc/self/exe (and we resolve it ourselves to help valgrind).
   h.add_path("Systemtap ", get_self_path());
 
+  save_fingerprint_memo(s);
   return h;
 }
 
@@ -209,11 +414,107 @@ create_hashdir (systemtap_session& s, const string& result, string& hashdir)
 }
 
 
-void
-find_script_hash (systemtap_session& s, const string& script)
+static const stap_hash&
+get_tapset_base_hash (systemtap_session& s)
 {
-  stap_hash h(get_base_hash(s));
+  // NB: pass-1 parses tapsets in several threads
+  static mutex tapset_hash_lock;
+  lock_guard<mutex> guard(tapset_hash_lock);
+
+  if (s.tapset_hash)
+    return *s.tapset_hash;
+
+  s.tapset_hash = new stap_hash(get_base_hash(s));
+  stap_hash& h = *s.tapset_hash;
+
+  // Hash everything that the preprocessor may consult while expanding
+  // conditionals; see eval_pp_conditional.
+  h.add("Kernel Base Release: ", s.kernel_base_release);
+  h.add("Compatible (--compatible): ", s.compatible);
+  h.add("Privilege (--privilege): ", s.privilege);
+  h.add("Guru Mode (-g): ", s.guru_mode);
+  h.add("Runtime Mode: ", int(s.runtime_mode));
+
+  // The kernel config is folded into a digest of its own, so that its
+  // thousands of entries don't bloat the parameter log that every copy
+  // of this hash drags along.
+  stap_hash kc;
+  for (auto it = s.kernel_config.begin(); it != s.kernel_config.end(); ++it)
+    if (!it->second.empty()) // NB: eval_pp_conditional may add empty entries
+      kc.add("", it->first.to_string() + "=" + it->second.to_string());
+  string kc_result;
+  kc.result(kc_result);
+  h.add("Kernel Config: ", kc_result);
+
+  // Library macros (.stpm files) may expand into any tapset.
+  map<string, stapfile*> macro_files;
+  for (auto it = s.library_macros.begin(); it != s.library_macros.end(); ++it)
+    {
+      stapfile* f = it->second->tok->location.file;
+      macro_files[f->name] = f;
+    }
+  stap_hash lm;
+  for (auto it = macro_files.begin(); it != macro_files.end(); ++it)
+    {
+      lm.add("Macro File: ", it->first);
+      lm.add("Macro File Contents: ", string(it->second->file_contents));
+    }
+  string lm_result;
+  lm.result(lm_result);
+  h.add("Library Macros: ", lm_result);
+
+  return h;
+}
+
+
+string
+find_tapset_hash (systemtap_session& s, const string& contents,
+                  bool check_compatible)
+{
+  stap_hash h(get_tapset_base_hash(s));
+
+  h.add("Check Compatible: ", check_compatible);
+  h.add("Contents: ", contents);
+
+  // NB: no hash log here; there would be one for every tapset file.
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  return hashdir + "/tapset_" + result + ".tok";
+}
+
+
+string
+find_tapset_index_hash (systemtap_session& s,
+                        const vector<pair<string, unsigned> >& files)
+{
+  stap_hash h(get_tapset_base_hash(s));
+
+  for (size_t i = 0; i < files.size(); i++)
+    {
+      h.add_path("Tapset ", files[i].first);
+      h.add("Tapset Flags: ", files[i].second);
+    }
+
+  string result, hashdir;
+  h.result(result);
+  save_fingerprint_memo(s);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("tapset_index_hash"), h.get_parms(), result,
+                  hashdir + "/tapset_" + result + "_hash.log");
+  return hashdir + "/tapset_" + result + ".idx";
+}
+
 
+// Hash the options that change the generated module, but not the
+// script itself.
+static void
+add_script_options (stap_hash& h, systemtap_session& s)
+{
   // Hash getuid.  This really shouldn't be necessary (since who you
   // are doesn't change the generated output), but the hash gets used
   // as the module name.  If two different users try to run the same
@@ -253,6 +554,14 @@ find_script_hash (systemtap_session& s, const string& script)
       it != s.build_ids.end();
       it++)
     h.add("Build ID: ", *it);
+}
+
+
+void
+find_script_hash (systemtap_session& s, const string& script)
+{
+  stap_hash h(get_base_hash(s));
+  add_script_options(h, s);
 
   // Add in pass 2 script output.
   h.add("Script:\n", script);
@@ -260,6 +569,7 @@ find_script_hash (systemtap_session& s, const string& script)
   // Get the directory path to store our cached script
   string result, hashdir;
   h.result(result);
+  save_fingerprint_memo(s);
   if (!create_hashdir(s, result, hashdir))
     return;
 
@@ -287,6 +597,28 @@ find_script_hash (systemtap_session& s, const string& script)
 }
 
 
+// Like find_script_hash, but over the canonical form of the pass 2
+// output.  Returns the path of the link file that names the cached
+// module built from any script with this canonical form.
+string
+find_script_canonical_hash (systemtap_session& s, const string& script)
+{
+  stap_hash h(get_base_hash(s));
+  add_script_options(h, s);
+  h.add("Canonical script:\n", script);
+
+  string result, hashdir;
+  h.result(result);
+  save_fingerprint_memo(s);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("canonical_script_hash"), h.get_parms(), result,
+                  hashdir + "/stap_" + result + "_canon_hash.log");
+  return hashdir + "/stap_" + result + ".canon";
+}
+
+
 void
 find_stapconf_hash (systemtap_session& s)
 {
@@ -310,20 +642,34 @@ find_stapconf_hash (systemtap_session& s)
 
 
 string
-find_tracequery_hash (systemtap_session& s, const string& header)
+find_tracequery_hash (systemtap_session& s, const string& header,
+                      const string& source)
 {
-  stap_hash h(get_base_hash(s));
+  // NB: not get_base_hash; a tracequery depends only on the kernel and
+  // on the query source we generate for it, not on the runtime or on
+  // this particular stap binary.  That keeps the results of a large
+  // kernel.trace("*") valid across systemtap rebuilds.
+  stap_hash h(get_fingerprint_memo(s));
+  h.add("Systemtap version: ", s.version_string());
+  add_kernel_hash(h, s);
+  h.add_path("Compiler ", find_executable("gcc"));
 
   // Add the tracepoint header to the computed hash
   h.add_path("Header ", header);
 
+  // Add the query source, which names the extra decls it pulls in
+  h.add("Source: ", source);
+
   // Add any custom kbuild flags
   for (unsigned i = 0; i < s.kbuildflags.size(); i++)
     h.add("Kbuildflags: ", s.kbuildflags[i]);
+  for (unsigned i = 0; i < s.kernel_extra_cflags.size(); i++)
+    h.add("Kernel extra cflags: ", s.kernel_extra_cflags[i]);
 
   // Get the directory path to store our cached module
   string result, hashdir;
   h.result(result);
+  save_fingerprint_memo(s);
   if (!create_hashdir(s, result, hashdir))
     return ""; // XXX: as opposed to throwing an exception?
 
@@ -379,6 +725,7 @@ find_uprobes_hash (systemtap_session& s)
   // Get the directory path to store our cached module
   string result, hashdir;
   h.result(result);
+  save_fingerprint_memo(s);
   if (!create_hashdir(s, result, hashdir))
     return "";
 
@@ -387,4 +734,121 @@ find_uprobes_hash (systemtap_session& s)
   return hashdir + "/uprobes_" + result;
 }
 
+
+// Hash everything besides the kernel that compile_pass puts on the
+// compiler command line
+static void
+add_module_cflags (stap_hash& h, systemtap_session& s)
+{
+  h.add("Kernel Source Tree: ", s.kernel_source_tree);
+  for (unsigned i = 0; i < s.kernel_extra_cflags.size(); i++)
+    h.add("Kernel Extra Cflags: ", s.kernel_extra_cflags[i]);
+  for (unsigned i = 0; i < s.kbuildflags.size(); i++)
+    h.add("Kbuildflags: ", s.kbuildflags[i]);
+  for (unsigned i = 0; i < s.c_macros.size(); i++)
+    h.add("Macros: ", s.c_macros[i]);
+}
+
+
+string
+find_object_hash (systemtap_session& s, const string& source)
+{
+  stap_hash h(get_base_hash(s));
+  add_module_cflags(h, s);
+
+  ifstream f (source.c_str());
+  ostringstream contents;
+  contents << f.rdbuf();
+  if (f.fail())
+    return "";
+  h.add("Source: ", contents.str());
+
+  // NB: no hash log here; there would be one for every object.
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  return hashdir + "/object_" + result + ".o";
+}
+
+
+string
+find_runtime_pch_hash (systemtap_session& s, const string& header)
+{
+  stap_hash h(get_base_hash(s));
+  add_module_cflags(h, s);
+
+  // The stapconf header is included ahead of the precompiled one, so
+  // tie them together.  Its name carries the stapconf hash.
+  h.add("Stapconf: ", s.stapconf_name);
+  h.add("Header: ", header);
+
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("runtime_pch_hash"), h.get_parms(), result,
+                  hashdir + "/runtime_" + result + "_hash.log");
+  return hashdir + "/runtime_" + result + ".h.gch";
+}
+
+
+string
+find_dwarf_index_hash (systemtap_session& s, const string& build_id)
+{
+  // NB: not get_base_hash; the build-id already pins down the module
+  // and its debuginfo, whichever kernel or runtime the session is for.
+  stap_hash h(get_fingerprint_memo(s));
+  h.add("Systemtap version: ", s.version_string());
+  h.add_path("Systemtap ", get_self_path());
+  h.add("Build ID: ", build_id);
+
+  string result, hashdir;
+  h.result(result);
+  save_fingerprint_memo(s);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("dwarf_index_hash"), h.get_parms(), result,
+                  hashdir + "/dwarf_" + result + "_hash.log");
+  return hashdir + "/dwarf_" + result + ".idx";
+}
+
+string
+find_symbol_data_hash (systemtap_session& s, const string& build_id,
+                       const string& name, const string& path,
+                       const string& debuginfo,
+                       unsigned long base, unsigned index)
+{
+  stap_hash h(get_base_hash(s));
+
+  // The module itself; the name and path end up in the emitted tables
+  h.add("Build ID: ", build_id);
+  h.add("Module Name: ", name);
+  h.add("Module Path: ", path);
+  if (debuginfo.empty())
+    h.add("Debuginfo: ", "none");
+  else
+    h.add_path("Debuginfo ", debuginfo);
+  h.add("Sysroot: ", s.sysroot);
+  h.add("Base: ", base);
+  h.add("Module Index: ", index);
+
+  // What the script needs of it
+  h.add("Need Symbols: ", s.need_symbols);
+  h.add("Need Unwind: ", s.need_unwind);
+  h.add("Need Lines: ", s.need_lines);
+
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("symbol_data_hash"), h.get_parms(), result,
+                  hashdir + "/symdata_" + result + "_hash.log");
+  return hashdir + "/symdata_" + result + ".c";
+}
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
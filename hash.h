@@ -5,10 +5,28 @@
 #define MODULE_NAME_LEN (64 - sizeof(unsigned long))
 
 void find_script_hash (systemtap_session& s, const std::string& script);
+std::string find_script_canonical_hash (systemtap_session& s,
+                                        const std::string& script);
 void find_stapconf_hash (systemtap_session& s);
 std::string find_tracequery_hash (systemtap_session& s,
-                                  const std::string& header);
+                                  const std::string& header,
+                                  const std::string& source);
 std::string find_typequery_hash (systemtap_session& s, const std::string& name);
 std::string find_uprobes_hash (systemtap_session& s);
+std::string find_tapset_hash (systemtap_session& s, const std::string& contents,
+                              bool check_compatible);
+std::string find_tapset_index_hash (systemtap_session& s,
+                                    const std::vector<std::pair<std::string, unsigned> >& files);
+std::string find_object_hash (systemtap_session& s, const std::string& source);
+std::string find_runtime_pch_hash (systemtap_session& s,
+                                   const std::string& header);
+std::string find_symbol_data_hash (systemtap_session& s,
+                                   const std::string& build_id,
+                                   const std::string& name,
+                                   const std::string& path,
+                                   const std::string& debuginfo,
+                                   unsigned long base, unsigned index);
+std::string find_dwarf_index_hash (systemtap_session& s,
+                                   const std::string& build_id);
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
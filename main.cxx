@@ -259,6 +259,103 @@ printscript(systemtap_session& s, ostream& o)
 }
 
 
+// Temporarily renames the formal arguments and locals of functions and
+// probes after their position, so that the script prints the same no
+// matter what the user called them.  The names aren't valid identifiers,
+// so they can't be confused with globals.  Bodies with embedded C are
+// left alone, since the C code may refer to the names.
+struct canonical_renamer: public traversing_visitor
+{
+  map<vardecl*, interned_string> names;
+  vector<symbol*> symbols;
+  bool embedded;
+
+  vector<pair<symbol*, interned_string> > renamed_symbols;
+  vector<pair<vardecl*, interned_string> > renamed_decls;
+
+  void visit_embeddedcode (embeddedcode*) { embedded = true; }
+  void visit_embedded_expr (embedded_expr*) { embedded = true; }
+  void visit_symbol (symbol* e)
+    {
+      if (e->referent && names.count(e->referent))
+        symbols.push_back(e);
+    }
+
+  void rename (const vector<vardecl*>& args, const vector<vardecl*>& locals,
+               statement* body);
+  void restore ();
+};
+
+
+void
+canonical_renamer::rename (const vector<vardecl*>& args,
+                           const vector<vardecl*>& locals,
+                           statement* body)
+{
+  names.clear();
+  symbols.clear();
+  embedded = false;
+
+  for (unsigned i=0; i<args.size(); i++)
+    names[args[i]] = "arg#" + lex_cast(i);
+  for (unsigned i=0; i<locals.size(); i++)
+    names[locals[i]] = "local#" + lex_cast(i);
+  body->visit (this);
+  if (embedded)
+    return;
+
+  for (unsigned i=0; i<symbols.size(); i++)
+    {
+      renamed_symbols.push_back(make_pair(symbols[i], symbols[i]->name));
+      symbols[i]->name = names[symbols[i]->referent];
+    }
+  for (map<vardecl*, interned_string>::iterator it = names.begin();
+       it != names.end(); ++it)
+    {
+      renamed_decls.push_back(make_pair(it->first, it->first->name));
+      it->first->name = it->second;
+    }
+}
+
+
+void
+canonical_renamer::restore ()
+{
+  // NB: in reverse, in case some node was renamed twice
+  while (!renamed_symbols.empty())
+    {
+      renamed_symbols.back().first->name = renamed_symbols.back().second;
+      renamed_symbols.pop_back();
+    }
+  while (!renamed_decls.empty())
+    {
+      renamed_decls.back().first->name = renamed_decls.back().second;
+      renamed_decls.pop_back();
+    }
+}
+
+
+// Print the canonical form of the script, for the second tier of the
+// script cache.  Beyond the pass 2 output, which already omits comments,
+// whitespace and source locations, this also drops the names of locals.
+// The order of globals and probes is kept, since it shows at run time
+// (e.g. the order of begin probes and of the globals printed at exit);
+// functions are already printed in name order.
+static void
+print_canonical_script(systemtap_session& s, ostream& o)
+{
+  canonical_renamer r;
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); it++)
+    r.rename (it->second->formal_args, it->second->locals, it->second->body);
+  for (unsigned i=0; i<s.probes.size(); i++)
+    r.rename (vector<vardecl*>(), s.probes[i]->locals, s.probes[i]->body);
+
+  printscript(s, o);
+  r.restore ();
+}
+
+
 int pending_interrupts;
 
 extern "C"
@@ -400,6 +497,43 @@ static int collect_stpm(const char* fpath, const struct stat*,
   return FTW_CONTINUE;
 }
 
+// Give the functions and probes of a library file, parsed on a worker
+// thread, the overload suffixes and ids they would have gotten from
+// parsing the files in order.
+static void
+renumber_library_file (systemtap_session& s, stapfile* f)
+{
+  for (unsigned i = 0; i < f->functions.size(); ++i)
+    {
+      functiondecl* fd = f->functions[i];
+      string name = fd->name;
+      name.erase (name.rfind ("__overload_"));
+      name += "__overload_" + lex_cast(s.overload_count[fd->unmangled_name]++);
+      fd->name = name;
+    }
+
+  vector<probe*> probes (f->probes.begin(), f->probes.end());
+  probes.insert (probes.end(), f->aliases.begin(), f->aliases.end());
+  sort (probes.begin(), probes.end(),
+        [](const probe* a, const probe* b) { return a->id < b->id; });
+  for (unsigned i = 0; i < probes.size(); ++i)
+    probes[i]->id = probe::last_probeidx++;
+}
+
+// Report the nodes allocated during a pass; see arena_allocated.
+static void
+print_node_usage (systemtap_session& s, unsigned pass)
+{
+  static size_t prev_objects, prev_bytes;
+  size_t objects, bytes;
+  arena_allocated::stats (objects, bytes);
+  if (s.verbose > 1)
+    clog << _F("Pass %u: allocated %zu nodes in %zu kb", pass,
+               objects - prev_objects, (bytes - prev_bytes) / 1024) << endl;
+  prev_objects = objects;
+  prev_bytes = bytes;
+}
+
 // Compilation passes 0 through 4
 int
 passes_0_4 (systemtap_session &s)
@@ -437,6 +571,7 @@ passes_0_4 (systemtap_session &s)
   // PASS 0: setting up
   s.verbose = s.perpass_verbose[0];
   PROBE1(stap, pass0__start, &s);
+  phase_timer pass_timer (s.timings, "pass0");
 
   // For PR1477, we used to override $PATH and $LC_ALL and other stuff
   // here.  We seem to use complete pathnames in
@@ -477,6 +612,7 @@ passes_0_4 (systemtap_session &s)
   times (& tms_before);
   struct timeval tv_before;
   gettimeofday (&tv_before, NULL);
+  pass_timer.start ("pass1");
 
   // PASS 1a: PARSING LIBRARY SCRIPTS
   PROBE1(stap, pass1a__start, &s);
@@ -636,7 +772,11 @@ passes_0_4 (systemtap_session &s)
 	    }
 	}
 
-      // Next, gather and parse the library files.
+      // Next, gather the library files.  They are parsed all at once
+      // below (possibly in parallel), and then reported on in this order.
+      struct library_dir { string dir; size_t found, first, last; };
+      vector<library_dir> library_dirs;
+      vector<pair<string, unsigned> > library_files;
       set<pair<dev_t, ino_t> > seen_library_files;
       set<string> seen_library_files_names;
 
@@ -652,7 +792,7 @@ passes_0_4 (systemtap_session &s)
               path_dir = s.include_path[i] + "/PATH";
               (void) nftw(dir.c_str(), collect_stp, 1, flags);
 
-	      unsigned prev_s_library_files = s.library_files.size();
+	      size_t first_library_file = library_files.size();
 
               for (auto it = files.begin(); it != files.end(); ++it)
 	        {
@@ -666,6 +806,12 @@ passes_0_4 (systemtap_session &s)
                   if (it->find("/PATH/") != string::npos)
                     tapset_flags |= pf_auto_path;
 
+                  // Reuse the preprocessed tokens from an earlier run, but
+                  // not when the version conditionals themselves are of
+                  // interest.
+                  if (s.use_cache && !s.systemtap_v_check)
+                    tapset_flags |= pf_cache_tokens;
+
                   assert_no_interrupts();
 
 		  struct stat tapset_file_stat;
@@ -709,9 +855,6 @@ passes_0_4 (systemtap_session &s)
 		      seen_library_files_names.insert (tail_part);
 		    }
 
-		  if (s.verbose>2)
-		    clog << _F("Processing tapset \"%s\"", it->c_str()) << endl;
-
 		  // NB: we don't need to restrict privilege only for
 		  // /usr/share/systemtap, i.e., excluding
 		  // user-specified $XDG_DATA_DIRS.  That's because
@@ -720,20 +863,81 @@ passes_0_4 (systemtap_session &s)
 		  // a trusted environment, where client-side
 		  // $XDG_DATA_DIRS are not passed.
 
-		  stapfile* f = parse (s, *it, tapset_flags);
+		  library_files.push_back (make_pair (*it, tapset_flags));
+		}
+
+	      library_dir d = { dir, files.size(), first_library_file, library_files.size() };
+	      library_dirs.push_back (d);
+	    }
+	}
+
+      // With an index of the library files from an earlier run, only the
+      // ones the script refers to need to be parsed, on demand during
+      // pass 2.  Listings of everything, interactive sessions and parse
+      // runs still take them all.
+      string index_path;
+      if (s.use_cache && !s.systemtap_v_check)
+	index_path = find_tapset_index_hash (s, library_files);
+      if (!index_path.empty() && !s.poison_cache &&
+	  !s.interactive_mode && s.last_pass > 1 &&
+	  (s.dump_mode == systemtap_session::dump_none ||
+	   s.dump_mode == systemtap_session::dump_matched_probes ||
+	   s.dump_mode == systemtap_session::dump_matched_probes_vars))
+	{
+	  phase_timer t (s.timings, "cache.tapset_index");
+	  s.library_index = tapset_index::load (s, index_path, library_files);
+	}
+
+      if (s.library_index)
+	s.library_index->reserve (s);
+      else
+	{
+	  // Parse the library files on up to s.jobs threads.  Whatever is
+	  // left over (including anything with errors or warnings to
+	  // report) is parsed serially below, so the output is the same
+	  // as if the files had all been parsed in order.
+	  phase_timer t (s.timings, "pass1.tapset_parse");
+	  vector<stapfile*> parsed_library_files;
+	  parse_library_files (s, library_files, parsed_library_files);
+	  bool library_files_ok = true;
+
+	  for (unsigned i=0; i<library_dirs.size(); i++)
+	    {
+	      const library_dir& d = library_dirs[i];
+	      unsigned prev_s_library_files = s.library_files.size();
+
+	      for (size_t j = d.first; j < d.last; ++j)
+		{
+		  const string& file = library_files[j].first;
+		  assert_no_interrupts();
+
+		  if (s.verbose>2)
+		    clog << _F("Processing tapset \"%s\"", file.c_str()) << endl;
+
+		  stapfile* f = parsed_library_files[j];
+		  if (f != 0)
+		    renumber_library_file (s, f);
+		  else
+		    f = parsed_library_files[j] = parse (s, file, library_files[j].second);
 		  if (f == 0)
-		    s.print_warning(_F("tapset \"%s\" has errors, and will be skipped", it->c_str()));
+		    {
+		      s.print_warning(_F("tapset \"%s\" has errors, and will be skipped", file.c_str()));
+		      library_files_ok = false;
+		    }
 		  else
 		    s.library_files.push_back (f);
 		}
 
 	      unsigned next_s_library_files = s.library_files.size();
-	      if (s.verbose>1 && !files.empty())
+	      if (s.verbose>1 && d.found)
 		  //TRANSLATORS: Searching through directories, 'processed' means 'examined so far'
 		clog << _F("Searched: \"%s\", found: %zu, processed: %u",
-			   dir.c_str(), files.size(),
+			   d.dir.c_str(), d.found,
 			   (next_s_library_files-prev_s_library_files)) << endl;
 	    }
+
+	  if (library_files_ok && !index_path.empty())
+	    tapset_index::save (s, index_path, parsed_library_files);
 	}
 
       if (s.num_errors())
@@ -760,6 +964,7 @@ passes_0_4 (systemtap_session &s)
       s.dump_mode == systemtap_session::dump_matched_probes ||
       s.dump_mode == systemtap_session::dump_matched_probes_vars)
     {
+      phase_timer t (s.timings, "pass1.user_parse");
       unsigned user_flags = s.guru_mode ? pf_guru : 0;
       user_flags |= pf_user_file;
       if (s.script_file == "-")
@@ -858,6 +1063,7 @@ passes_0_4 (systemtap_session &s)
   unsigned _sc_clk_tck = sysconf (_SC_CLK_TCK);
   struct timeval tv_after;
   gettimeofday (&tv_after, NULL);
+  pass_timer.stop ();
 
 #define TIMESPRINT _("in ") << \
            (tms_after.tms_cutime + tms_after.tms_utime \
@@ -878,6 +1084,7 @@ passes_0_4 (systemtap_session &s)
            << TIMESPRINT
            << endl;
     }
+  print_node_usage (s, 1);
 
   if (rc && !s.dump_mode)
     cerr << _("Pass 1: parse failed.  [man error::pass1]") << endl;
@@ -891,6 +1098,7 @@ passes_0_4 (systemtap_session &s)
 
   times (& tms_before);
   gettimeofday (&tv_before, NULL);
+  pass_timer.start ("pass2");
 
   // PASS 2: ELABORATION
   s.verbose = s.perpass_verbose[1];
@@ -927,6 +1135,7 @@ passes_0_4 (systemtap_session &s)
 
   times (& tms_after);
   gettimeofday (&tv_after, NULL);
+  pass_timer.stop ();
 
   if (s.verbose) {
     int np = s.probes.size();
@@ -941,7 +1150,13 @@ passes_0_4 (systemtap_session &s)
          << getmemusage()
          << TIMESPRINT
          << endl;
+
+    size_t hits, misses, bytes;
+    interned_string::stats (hits, misses, bytes);
+    clog << _F("Pass 2: string table: %zu hits, %zu misses, %zu kb",
+               hits, misses, bytes / 1024) << endl;
   }
+  print_node_usage (s, 2);
 
   missing_rpm_list_print(s, "-debuginfo");
 
@@ -994,10 +1209,28 @@ passes_0_4 (systemtap_session &s)
       }
 
       // Generate hash
+      pass_timer.start ("cache.script");
       find_script_hash (s, o.str());
 
       // See if we can use cached source/module.
-      if (get_script_from_cache(s))
+      bool cached = get_script_from_cache(s);
+
+      // Failing that, see if some cosmetically different version of
+      // the script was cached.  Even if not, remember the canonical
+      // hash so the module we're about to build gets linked to it.
+      if (!cached)
+        {
+          ostringstream c;
+          saved_verbose = s.verbose;
+          s.verbose = 3;
+          print_canonical_script(s, c);
+          s.verbose = saved_verbose;
+
+          s.canonical_hash_path = find_script_canonical_hash (s, c.str());
+          cached = get_script_from_canonical_cache(s);
+        }
+      pass_timer.stop ();
+      if (cached)
         {
 	  // We may still need to build uprobes, if it's not also cached.
 	  if (s.need_uprobes)
@@ -1017,6 +1250,7 @@ passes_0_4 (systemtap_session &s)
   s.verbose = s.perpass_verbose[2];
   times (& tms_before);
   gettimeofday (&tv_before, NULL);
+  pass_timer.start ("pass3");
   PROBE1(stap, pass3__start, &s);
 
   rc = translate_pass (s);
@@ -1028,6 +1262,7 @@ passes_0_4 (systemtap_session &s)
 
   times (& tms_after);
   gettimeofday (&tv_after, NULL);
+  pass_timer.stop ();
 
   if (s.verbose) 
     clog << _("Pass 3: translated to C into \"")
@@ -1036,6 +1271,7 @@ passes_0_4 (systemtap_session &s)
          << getmemusage()
          << TIMESPRINT
          << endl;
+  print_node_usage (s, 3);
 
   if (rc && ! s.try_server ())
     cerr << _("Pass 3: translation failed.  [man error::pass3]") << endl;
@@ -1049,10 +1285,12 @@ passes_0_4 (systemtap_session &s)
   s.verbose = s.perpass_verbose[3];
   times (& tms_before);
   gettimeofday (&tv_before, NULL);
+  pass_timer.start ("pass4");
   PROBE1(stap, pass4__start, &s);
 
   if (s.use_cache)
     {
+      phase_timer t (s.timings, "cache.stapconf");
       find_stapconf_hash(s);
       get_stapconf_from_cache(s);
     }
@@ -1065,6 +1303,7 @@ passes_0_4 (systemtap_session &s)
 
   times (& tms_after);
   gettimeofday (&tv_after, NULL);
+  pass_timer.stop ();
 
   if (s.verbose) clog << _("Pass 4: compiled C into \"")
                       << s.module_filename()
@@ -1124,7 +1363,9 @@ pass_5 (systemtap_session &s, vector<remote*> targets)
   // and don't take an indefinite amount of time.
   PROBE1(stap, pass5__start, &s);
   if (s.verbose) clog << _("Pass 5: starting run.") << endl;
+  phase_timer pass_timer (s.timings, "pass5");
   int rc = remote::run(targets);
+  pass_timer.stop ();
   struct tms tms_after;
   times (& tms_after);
   unsigned _sc_clk_tck = sysconf (_SC_CLK_TCK);
@@ -1165,10 +1406,32 @@ cleanup (systemtap_session &s, int rc)
   }
 
   s.report_suppression();
+  wait_for_clean_cache();
 
   PROBE1(stap, pass6__end, &s);
 }
 
+// Write out the --timing=json report of all the passes run so far.
+static void
+write_timing_report (systemtap_session &s)
+{
+  if (! s.timings)
+    return;
+
+  if (s.timing_report == "-")
+    {
+      s.timings->print_json (cerr);
+      return;
+    }
+
+  ofstream o (s.timing_report.c_str());
+  s.timings->print_json (o);
+  o.close ();
+  if (o.fail ())
+    cerr << _F("ERROR: failed to write timing report \"%s\": %s",
+               s.timing_report.c_str(), strerror(errno)) << endl;
+}
+
 static int
 passes_0_4_again_with_server (systemtap_session &s)
 {
@@ -1351,6 +1614,7 @@ main (int argc, char * const argv [])
     for (unsigned i = 0; i < targets.size(); ++i)
       delete targets[i];
     cleanup (s, rc);
+    write_timing_report (s);
 
     assert_no_interrupts();
     return (rc) ? EXIT_FAILURE : EXIT_SUCCESS;
@@ -15,6 +15,8 @@
 #include "session.h"
 #include "util.h"
 #include "stringtable.h"
+#include "hash.h"
+#include "cache.h"
 
 #include <iostream>
 
@@ -28,10 +30,17 @@
 #include <cstring>
 #include <cctype>
 #include <iterator>
+#include <tuple>
 #include <unordered_set>
+#include <unordered_map>
+#include <mutex>
 
 extern "C" {
 #include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 }
 
 using namespace std;
@@ -45,6 +54,7 @@ public:
   bool ate_whitespace; // the most recent token followed whitespace
   bool saw_tokens; // the lexer found tokens (before preprocessing occurred)
   bool check_compatible; // whether to gate features on session.compatible
+  bool uncacheable; // the tokens depend on more than the input and session
 
   token* scan ();
   lexer (istream&, const string&, systemtap_session&, bool);
@@ -54,10 +64,18 @@ public:
 
   unordered_set<interned_string> keywords;
   static unordered_set<string> atwords;
+
+  // Character classes for the bulk-scanning paths in scan(), filled by
+  // the first lexer from the same <ctype.h> tests that scan() uses.
+  static bool space_chars[256]; // isspace
+  static bool ident_chars[256]; // isalnum, '_', '$'
+  static bool string_chars[256]; // not '"', '\\' or '\n'
 private:
   inline int input_get ();
   inline int input_peek (unsigned n=0);
   void input_put (const string&, const token*);
+  void input_skip (const char* to);
+  const char* input_span (const bool* cls) const;
   string input_name;
   string input_contents; // NB: being a temporary, no need to interned_string optimize this object
   const char *input_pointer; // index into input_contents; NB: recompute if input_contents changed!
@@ -73,6 +91,64 @@ private:
 };
 
 
+// A preprocessed token stream, as handed by scan_pp() to the parser.
+// Library files are recorded into one of these on first use, and later
+// replayed from the cache, skipping the lexer and preprocessor (pass 1
+// spends most of its time there).  The only lexer state that the parser
+// consults is saved along with each token.
+class token_stream
+{
+public:
+  token_stream (): file (0), pos (0), bad (false) {}
+
+  void set_file (stapfile* f) { file = f; }
+  void record (const token* t, bool ate_whitespace, bool ate_comment);
+  const token* replay (bool& ate_whitespace, bool& ate_comment);
+
+  bool load (systemtap_session& s, const string& path);
+  void save (systemtap_session& s, const string& path) const;
+
+private:
+  enum { ts_ate_whitespace = 1, ts_ate_comment = 2 };
+
+  struct entry
+  {
+    uint32_t content; // index into strings
+    uint32_t file; // index into files; 0 is the file being parsed
+    uint32_t line;
+    uint32_t column;
+    uint32_t chain; // 1 + index into chains; 0 for none
+    uint32_t type;
+    uint32_t junk_type;
+    uint32_t flags; // ts_* bits
+    bool operator < (const entry& o) const
+    {
+      return make_tuple(content, file, line, column, chain, type, junk_type, flags)
+        < make_tuple(o.content, o.file, o.line, o.column, o.chain, o.type, o.junk_type, o.flags);
+    }
+  };
+
+  stapfile* file;
+  vector<interned_string> strings;
+  vector<stapfile*> files;
+  vector<entry> chains;
+  vector<entry> stream;
+  size_t pos;
+  bool bad; // something in the stream can't be saved
+
+  // recording state
+  unordered_map<interned_string, uint32_t> string_index;
+  map<stapfile*, uint32_t> file_index;
+  map<entry, uint32_t> chain_index;
+
+  // replaying state
+  vector<const token*> chain_tokens;
+
+  entry make_entry (const token* t);
+  token* make_token (const entry& e);
+};
+
+
 class parser
 {
 public:
@@ -132,8 +208,15 @@ private:
   // preprocessing subordinate, final pass (conditionals)
   vector<pair<const token*, pp_state_t> > pp_state;
   const token* scan_pp ();
+  const token* scan_pp_cond ();
   const token* skip_pp ();
 
+  // cached library token stream
+  bool cache_tokens;
+  bool recording_tokens;
+  bool replaying_tokens;
+  token_stream tokens;
+
   // scanning state
   const token* next ();
   const token* peek ();
@@ -248,10 +331,13 @@ parse (systemtap_session& s, const string& name, unsigned flags)
   ifstream i(name.c_str(), ios::in);
   if (i.fail())
     {
-      cerr << (file_exists(name)
-               ? _F("Input file '%s' can't be opened for reading.", name.c_str())
-               : _F("Input file '%s' is missing.", name.c_str()))
-           << endl;
+      if (s.defer_reports)
+        s.reports_deferred = true;
+      else
+        cerr << (file_exists(name)
+                 ? _F("Input file '%s' can't be opened for reading.", name.c_str())
+                 : _F("Input file '%s' is missing.", name.c_str()))
+             << endl;
       return 0;
     }
 
@@ -283,13 +369,331 @@ parse_synthetic_probe (systemtap_session &s, istream& i, const token* tok)
   return p.parse_synthetic_probe (tok);
 }
 
+// Parse the given library files on up to s.jobs threads.  The results
+// line up with the files, except that any file which would have reported
+// something (errors, warnings, ...) is left at 0, for the caller to parse
+// again serially, in order.  Probe ids are handed out in whatever order
+// the threads get to them, so the caller must also renumber the probes of
+// each file it takes; probe::last_probeidx is left as it was found.
+void
+parse_library_files (systemtap_session& s,
+                     const vector<pair<string, unsigned> >& files,
+                     vector<stapfile*>& results)
+{
+  results.assign (files.size(), 0);
+
+  unsigned nthreads = min ((size_t) s.jobs, files.size());
+  if (nthreads < 2)
+    return; // let the caller do it all
+
+  unsigned first_probeidx = probe::last_probeidx;
+
+  parallel_for (files.size(), nthreads, [&](size_t i, unsigned)
+    {
+      if (pending_interrupts)
+        return false;
+
+      s.defer_reports = true;
+      s.reports_deferred = false;
+      stapfile* f = 0;
+      try
+        {
+          f = parse (s, files[i].first, files[i].second);
+        }
+      catch (...)
+        {
+          s.reports_deferred = true; // rethrown by the serial parse
+        }
+      if (f && s.reports_deferred)
+        {
+          delete f;
+          f = 0;
+        }
+      results[i] = f;
+      s.defer_reports = s.reports_deferred = false;
+      return true;
+    });
+
+  probe::last_probeidx = first_probeidx;
+}
+
+// ------------------------------------------------------------------------
+
+static const char tapset_index_magic[] = "stapidx1";
+
+tapset_index*
+tapset_index::load (systemtap_session& s, const string& path,
+                    const vector<pair<string, unsigned> >& files)
+{
+  ifstream i (path.c_str ());
+  if (i.fail ())
+    return 0;
+
+  // The file is a series of lines, one "file NPROBES" per library file,
+  // each followed by "f NAME PRIVATE", "g NAME" and "a NAME" lines for the
+  // functions, public globals and alias prefixes it defines.
+  string magic, word;
+  size_t count = 0;
+  bool ok = (i >> magic >> count) && magic == tapset_index_magic
+    && count == files.size ();
+
+  tapset_index* index = new tapset_index;
+  while (ok && i >> word)
+    {
+      if (word == "file")
+        {
+          index->entries.push_back (file_entry ());
+          ok = (bool) (i >> index->entries.back ().probes);
+          continue;
+        }
+
+      string name;
+      if (index->entries.empty () || !(i >> name))
+        ok = false;
+      else if (word == "f")
+        {
+          bool priv;
+          ok = (bool) (i >> priv);
+          index->entries.back ().functions.push_back (make_pair (name, priv));
+        }
+      else if (word == "g")
+        index->entries.back ().globals.push_back (name);
+      else if (word == "a")
+        index->entries.back ().aliases.insert (name);
+      else
+        ok = false;
+    }
+
+  if (!ok || !i.eof () || index->entries.size () != files.size ())
+    {
+      if (s.verbose > 1)
+        clog << _F("Ignoring corrupt tapset index file \"%s\"", path.c_str ()) << endl;
+      delete index;
+      return 0;
+    }
+
+  index->files = files;
+  index->parsed.assign (files.size (), 0);
+  index->tried.assign (files.size (), false);
+  for (unsigned j = 0; j < index->entries.size (); ++j)
+    {
+      const file_entry& e = index->entries[j];
+      for (auto it = e.functions.begin (); it != e.functions.end (); ++it)
+        if (!it->second)
+          {
+            vector<unsigned>& v = index->function_files[it->first];
+            if (v.empty () || v.back () != j)
+              v.push_back (j);
+          }
+      for (auto it = e.globals.begin (); it != e.globals.end (); ++it)
+        index->global_files[*it].push_back (j);
+      for (auto it = e.aliases.begin (); it != e.aliases.end (); ++it)
+        index->alias_files[*it].push_back (j);
+    }
+
+  cache_hit (path);
+  if (s.verbose > 1)
+    clog << _F("Using tapset index \"%s\"", path.c_str ()) << endl;
+  return index;
+}
+
+
+void
+tapset_index::save (systemtap_session& s, const string& path,
+                    const vector<stapfile*>& files)
+{
+  ostringstream o;
+  o << tapset_index_magic << " " << files.size () << endl;
+  for (size_t i = 0; i < files.size (); ++i)
+    {
+      stapfile* f = files[i];
+      o << "file " << f->probes.size () + f->aliases.size () << endl;
+      for (size_t j = 0; j < f->functions.size (); ++j)
+        o << "f " << f->functions[j]->unmangled_name << " "
+          << f->functions[j]->name.starts_with ("__private_") << endl;
+      for (size_t j = 0; j < f->globals.size (); ++j)
+        if (f->globals[j]->name.starts_with ("__global_"))
+          o << "g " << f->globals[j]->name << endl;
+      set<string> aliases;
+      for (size_t j = 0; j < f->aliases.size (); ++j)
+        for (size_t k = 0; k < f->aliases[j]->alias_names.size (); ++k)
+          aliases.insert (f->aliases[j]->alias_names[k]->components[0]->functor);
+      for (auto it = aliases.begin (); it != aliases.end (); ++it)
+        o << "a " << *it << endl;
+    }
+
+  if (!write_file_atomically (path, o.str ()) && s.verbose > 1)
+    clog << _F("Failed to save tapset index file \"%s\": %s",
+               path.c_str (), strerror (errno)) << endl;
+}
+
+
+void
+tapset_index::reserve (systemtap_session& s)
+{
+  first_probeidx = probe::last_probeidx;
+  first_library_file = s.library_files.size ();
+
+  for (size_t i = 0; i < entries.size (); ++i)
+    {
+      probe::last_probeidx += entries[i].probes;
+      for (auto it = entries[i].functions.begin ();
+           it != entries[i].functions.end (); ++it)
+        s.overload_count[it->first]++;
+    }
+}
+
+
+stapfile*
+tapset_index::load_file (systemtap_session& s, unsigned i)
+{
+  if (tried[i])
+    return parsed[i];
+  tried[i] = true;
+
+  const string& file = files[i].first;
+  if (s.verbose > 2)
+    clog << _F("Processing tapset \"%s\"", file.c_str ()) << endl;
+
+  // Everything the parser counts has already been reserved; the file is
+  // renumbered below to fit into its slot.
+  map<string, unsigned> overload_count (s.overload_count);
+  unsigned last_probeidx = probe::last_probeidx;
+  vector<bool> used_args (s.used_args);
+
+  phase_timer timer (s.timings, "pass2.tapset_parse");
+  stapfile* f = parse (s, file, files[i].second);
+  timer.stop ();
+
+  s.overload_count.swap (overload_count);
+  probe::last_probeidx = last_probeidx;
+  s.used_args.swap (used_args);
+
+  if (f == 0)
+    {
+      s.print_warning (_F("tapset \"%s\" has errors, and will be skipped", file.c_str ()));
+      return 0;
+    }
+
+  unsigned probeidx = first_probeidx;
+  map<string, unsigned> overloads;
+  for (unsigned j = 0; j < i; ++j)
+    {
+      probeidx += entries[j].probes;
+      for (auto it = entries[j].functions.begin ();
+           it != entries[j].functions.end (); ++it)
+        overloads[it->first]++;
+    }
+
+  vector<probe*> probes (f->probes.begin (), f->probes.end ());
+  probes.insert (probes.end (), f->aliases.begin (), f->aliases.end ());
+  sort (probes.begin (), probes.end (),
+        [](const probe* a, const probe* b) { return a->id < b->id; });
+  for (unsigned j = 0; j < probes.size (); ++j)
+    probes[j]->id = probeidx++;
+
+  for (unsigned j = 0; j < f->functions.size (); ++j)
+    {
+      functiondecl* fd = f->functions[j];
+      string name = fd->name;
+      name.erase (name.rfind ("__overload_"));
+      name += "__overload_" + lex_cast (overloads[fd->unmangled_name]++);
+      fd->name = name;
+    }
+
+  // Keep s.library_files in the order they would otherwise be parsed.
+  parsed[i] = f;
+  s.library_files.resize (first_library_file);
+  for (unsigned j = 0; j < parsed.size (); ++j)
+    if (parsed[j])
+      s.library_files.push_back (parsed[j]);
+
+  return f;
+}
+
+
+void
+tapset_index::load_functions (systemtap_session& s, const string& name)
+{
+  auto it = function_files.find (name);
+  if (it != function_files.end ())
+    for (unsigned j = 0; j < it->second.size (); ++j)
+      load_file (s, it->second[j]);
+}
+
+
+void
+tapset_index::load_globals (systemtap_session& s, const string& name)
+{
+  auto it = global_files.find (name);
+  if (it != global_files.end ())
+    for (unsigned j = 0; j < it->second.size (); ++j)
+      load_file (s, it->second[j]);
+}
+
+
+void
+tapset_index::load_aliases (systemtap_session& s, const string& pattern)
+{
+  vector<string> prefixes;
+  if (pattern.find_first_of ("*?[") == string::npos)
+    {
+      if (alias_files.find (pattern) != alias_files.end ())
+        prefixes.push_back (pattern);
+    }
+  else
+    for (auto it = alias_files.begin (); it != alias_files.end (); ++it)
+      if (fnmatch (pattern.c_str (), it->first.c_str (), FNM_NOESCAPE) == 0)
+        prefixes.push_back (it->first);
+
+  for (unsigned i = 0; i < prefixes.size (); ++i)
+    {
+      // All of the aliases sharing a first component get registered
+      // together, in file order, as they would be otherwise.
+      if (!registered_aliases.insert (prefixes[i]).second)
+        continue;
+      const vector<unsigned>& v = alias_files[prefixes[i]];
+      for (unsigned j = 0; j < v.size (); ++j)
+        {
+          stapfile* f = load_file (s, v[j]);
+          if (f)
+            s.register_library_aliases (f, prefixes[i]);
+        }
+    }
+}
+
+
+bool
+tapset_index::defines_global (const string& name) const
+{
+  return global_files.find (name) != global_files.end ();
+}
+
+
+void
+tapset_index::collect_functions (set<string>& names) const
+{
+  for (auto it = function_files.begin (); it != function_files.end (); ++it)
+    names.insert (it->first);
+}
+
+
+void
+tapset_index::collect_aliases (set<string>& names) const
+{
+  for (auto it = alias_files.begin (); it != alias_files.end (); ++it)
+    names.insert (it->first);
+}
+
 // ------------------------------------------------------------------------
 
 parser::parser (systemtap_session& s, const string &n, istream& i, unsigned flags):
   session (s), input_name (n), input (i, input_name, s, !(flags & pf_no_compatible)),
   errs_as_warnings(flags & pf_squash_errors), privileged (flags & pf_guru),
   user_file (flags & pf_user_file), auto_path (flags & pf_auto_path),
-  context(con_unknown), systemtap_v_seen(0), last_t (0), next_t (0), num_errors (0)
+  context(con_unknown), cache_tokens (flags & pf_cache_tokens),
+  recording_tokens (false), replaying_tokens (false),
+  systemtap_v_seen(0), last_t (0), next_t (0), num_errors (0)
 {
 }
 
@@ -495,7 +899,10 @@ parser::scan_pp1 (bool ignore_macros = false)
           if (name == "define")
             throw PARSE_ERROR (_("attempt to redefine '@define'"), t);
           if (input.atwords.count(name))
-            session.print_warning (_F("macro redefines built-in operator '@%s'", name.c_str()), t);
+            {
+              session.print_warning (_F("macro redefines built-in operator '@%s'", name.c_str()), t);
+              input.uncacheable = true;
+            }
 
           macrodecl* decl = (pp1_namespace[name] = new macrodecl);
           decl->tok = t;
@@ -560,16 +967,19 @@ parser::scan_pp1 (bool ignore_macros = false)
           const string& name = t->content.substr(1); // strip initial '@'
 
           // check if name refers to a real parameter or macro
+          // NB: session.library_macros is shared with other parser
+          // threads, so it must only be read here.
           macrodecl* decl;
           pp1_activation* act = pp1_state.empty() ? 0 : pp1_state.back();
+          map<string, macrodecl*>::const_iterator lm;
           if (act && act->params.find(name) != act->params.end())
             decl = act->params[name];
           else if (!(act && act->curr_macro->context == ctx_library)
                    && pp1_namespace.find(name) != pp1_namespace.end())
             decl = pp1_namespace[name];
-          else if (session.library_macros.find(name)
+          else if ((lm = session.library_macros.find(name))
                    != session.library_macros.end())
-            decl = session.library_macros[name];
+            decl = lm->second;
           else // this is an ordinary @operator
             return t;
 
@@ -809,6 +1219,15 @@ parser::parse_library_macros ()
 // to this function.  Tokens included by any nested conditions are
 // enqueued in a private vector.
 
+// Look up a kernel config option, without adding it to s.kernel_config
+// (which is shared between parser threads).
+static string
+kernel_config_value (systemtap_session& s, interned_string name)
+{
+  map<interned_string,interned_string>::const_iterator it = s.kernel_config.find(name);
+  return it != s.kernel_config.end() ? string(it->second) : string(); // may be empty
+}
+
 bool eval_pp_conditional (systemtap_session& s,
                           const token* l, const token* op, const token* r)
 {
@@ -957,7 +1376,7 @@ bool eval_pp_conditional (systemtap_session& s,
     {
       if (r->type == tok_string)
 	{
-	  string lhs = s.kernel_config[l->content]; // may be empty
+	  string lhs = kernel_config_value (s, l->content); // may be empty
 	  string rhs = r->content;
 
 	  int nomatch = fnmatch (rhs.c_str(), lhs.c_str(), FNM_NOESCAPE); // still spooky
@@ -974,7 +1393,7 @@ bool eval_pp_conditional (systemtap_session& s,
 	}
       else if (r->type == tok_number)
 	{
-          const string& lhs_string = s.kernel_config[l->content];
+          const string& lhs_string = kernel_config_value (s, l->content);
           const char* startp = lhs_string.c_str ();
           char* endp = (char*) startp;
           errno = 0;
@@ -990,8 +1409,8 @@ bool eval_pp_conditional (systemtap_session& s,
 	{
 	  // First try to convert both to numbers,
 	  // otherwise threat both as strings.
-          const string& lhs_string = s.kernel_config[l->content];
-          const string& rhs_string = s.kernel_config[r->content];
+          const string& lhs_string = kernel_config_value (s, l->content);
+          const string& rhs_string = kernel_config_value (s, r->content);
           const char* startp = lhs_string.c_str ();
           char* endp = (char*) startp;
           errno = 0;
@@ -1040,9 +1459,24 @@ bool eval_pp_conditional (systemtap_session& s,
 }
 
 
-// Only tokens corresponding to the TRUE statement must be expanded
+// Hand the next preprocessed token to the parser, possibly by way of
+// the token stream cache.
 const token*
 parser::scan_pp ()
+{
+  if (replaying_tokens)
+    return tokens.replay (input.ate_whitespace, input.ate_comment);
+
+  const token* t = scan_pp_cond ();
+  if (recording_tokens && t)
+    tokens.record (t, input.ate_whitespace, input.ate_comment);
+  return t;
+}
+
+
+// Only tokens corresponding to the TRUE statement must be expanded
+const token*
+parser::scan_pp_cond ()
 {
   while (true)
     {
@@ -1189,6 +1623,335 @@ parser::skip_pp ()
 }
 
 
+// ------------------------------------------------------------------------
+// Token stream cache.  The file format is a simple host-endian dump of
+// the tables below; all words are uint32_t.  Since the cache key covers
+// the stap binary itself, it needs no portability or versioning beyond
+// a sanity check on load.
+
+static const char token_stream_magic[8] = { 's', 't', 'a', 'p', 't', 'o', 'k', '1' };
+
+
+token_stream::entry
+token_stream::make_entry (const token* t)
+{
+  entry e;
+
+  auto si = string_index.find (t->content);
+  if (si == string_index.end ())
+    {
+      si = string_index.insert (make_pair (t->content, strings.size ())).first;
+      strings.push_back (t->content);
+    }
+  e.content = si->second;
+
+  if (t->location.file == file)
+    e.file = 0;
+  else if (t->location.file == 0)
+    {
+      bad = true;
+      e.file = 0;
+    }
+  else
+    {
+      auto fi = file_index.find (t->location.file);
+      if (fi == file_index.end ())
+        {
+          // files[0] stands in for the file being parsed
+          if (files.empty ())
+            files.push_back (0);
+          fi = file_index.insert (make_pair (t->location.file, files.size ())).first;
+          files.push_back (t->location.file);
+        }
+      e.file = fi->second;
+    }
+
+  e.line = t->location.line;
+  e.column = t->location.column;
+  e.type = t->type;
+  e.junk_type = t->junk_type;
+  e.flags = 0;
+
+  e.chain = 0;
+  if (t->chain)
+    {
+      // NB: each expanded token gets its own copy of the invocation
+      // token, so chains are deduplicated by value, not by pointer.
+      entry c = make_entry (t->chain);
+      auto ci = chain_index.find (c);
+      if (ci == chain_index.end ())
+        {
+          chains.push_back (c);
+          ci = chain_index.insert (make_pair (c, chains.size ())).first;
+        }
+      e.chain = ci->second;
+    }
+
+  return e;
+}
+
+
+void
+token_stream::record (const token* t, bool ate_whitespace, bool ate_comment)
+{
+  entry e = make_entry (t);
+  if (ate_whitespace)
+    e.flags |= ts_ate_whitespace;
+  if (ate_comment)
+    e.flags |= ts_ate_comment;
+  stream.push_back (e);
+}
+
+
+token*
+token_stream::make_token (const entry& e)
+{
+  token* t = new token;
+  t->location.file = e.file ? files[e.file] : file;
+  t->location.line = e.line;
+  t->location.column = e.column;
+  t->content = strings[e.content];
+  t->type = (token_type) e.type;
+  t->junk_type = (token_junk_type) e.junk_type;
+  t->chain = e.chain ? chain_tokens[e.chain - 1] : 0;
+  return t;
+}
+
+
+const token*
+token_stream::replay (bool& ate_whitespace, bool& ate_comment)
+{
+  if (pos >= stream.size ())
+    {
+      ate_whitespace = ate_comment = false;
+      return 0;
+    }
+
+  const entry& e = stream[pos++];
+  ate_whitespace = e.flags & ts_ate_whitespace;
+  ate_comment = e.flags & ts_ate_comment;
+  return make_token (e);
+}
+
+
+namespace {
+// bounds-checked reader over a mapped cache file
+struct token_stream_reader
+{
+  const char* p;
+  const char* end;
+  bool ok;
+
+  token_stream_reader (const char* p, size_t size): p (p), end (p + size), ok (true) {}
+
+  const char* get (size_t n)
+  {
+    if (!ok || (size_t)(end - p) < n)
+      {
+        ok = false;
+        return 0;
+      }
+    const char* r = p;
+    p += n;
+    return r;
+  }
+
+  uint32_t get_u32 ()
+  {
+    uint32_t v = 0;
+    const char* r = get (sizeof (v));
+    if (r)
+      memcpy (&v, r, sizeof (v));
+    return v;
+  }
+};
+}
+
+
+bool
+token_stream::load (systemtap_session& s, const string& path)
+{
+  int fd = open (path.c_str (), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat (fd, &st) != 0 || st.st_size < (off_t) sizeof (token_stream_magic))
+    {
+      close (fd);
+      return false;
+    }
+
+  void* mapped = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (mapped == MAP_FAILED)
+    return false;
+
+  token_stream_reader r ((const char*) mapped, st.st_size);
+
+  // The library macro files that tokens may have been expanded from.
+  map<string, stapfile*> macro_files;
+  for (auto it = s.library_macros.begin (); it != s.library_macros.end (); ++it)
+    {
+      stapfile* f = it->second->tok->location.file;
+      macro_files[f->name] = f;
+    }
+
+  const char* magic = r.get (sizeof (token_stream_magic));
+  r.ok = magic && !memcmp (magic, token_stream_magic, sizeof (token_stream_magic));
+
+  uint32_t n = r.get_u32 ();
+  for (uint32_t i = 0; r.ok && i < n; ++i)
+    {
+      uint32_t len = r.get_u32 ();
+      const char* str = r.get (len);
+      if (str)
+        strings.push_back (interned_string (string (str, len)));
+    }
+
+  n = r.get_u32 ();
+  for (uint32_t i = 0; r.ok && i < n; ++i)
+    {
+      uint32_t name = r.get_u32 ();
+      if (i == 0) // stands in for the file being parsed
+        files.push_back (0);
+      else if (name < strings.size ())
+        {
+          auto it = macro_files.find (strings[name].to_string ());
+          if (it != macro_files.end ())
+            files.push_back (it->second);
+          else
+            r.ok = false;
+        }
+      else
+        r.ok = false;
+    }
+
+  for (unsigned table = 0; table < 2; ++table)
+    {
+      vector<entry>& entries = table ? stream : chains;
+      n = r.get_u32 ();
+      for (uint32_t i = 0; r.ok && i < n; ++i)
+        {
+          entry e;
+          e.content = r.get_u32 ();
+          e.file = r.get_u32 ();
+          e.line = r.get_u32 ();
+          e.column = r.get_u32 ();
+          e.chain = r.get_u32 ();
+          e.type = r.get_u32 ();
+          e.junk_type = r.get_u32 ();
+          e.flags = r.get_u32 ();
+
+          // NB: chains may only refer to chains recorded before them
+          if (e.content >= strings.size () || (e.file && e.file >= files.size ())
+              || e.chain > chain_tokens.size ()
+              || e.type > tok_keyword || e.junk_type > tok_junk_unclosed_embedded)
+            r.ok = false;
+          else if (table == 0)
+            chain_tokens.push_back (make_token (e));
+          else
+            entries.push_back (e);
+        }
+    }
+
+  if (r.ok && r.p != r.end)
+    r.ok = false;
+
+  munmap (mapped, st.st_size);
+
+  if (!r.ok)
+    {
+      if (s.verbose > 1 && s.defer_reports)
+        s.reports_deferred = true;
+      else if (s.verbose > 1)
+        clog << _F("Ignoring corrupt tapset token cache file \"%s\"", path.c_str ()) << endl;
+      strings.clear ();
+      files.clear ();
+      stream.clear ();
+      chain_tokens.clear (); // NB: leaked, like other chain tokens
+      return false;
+    }
+
+  cache_hit (path);
+  return true;
+}
+
+
+static inline void
+put_u32 (string& buf, uint32_t v)
+{
+  buf.append ((const char*) &v, sizeof (v));
+}
+
+
+void
+token_stream::save (systemtap_session& s, const string& path) const
+{
+  if (bad)
+    return;
+
+  string buf (token_stream_magic, sizeof (token_stream_magic));
+
+  // NB: file names are interned here too, so they need to go before
+  // the string table is written out.
+  vector<uint32_t> file_names;
+  vector<interned_string> all_strings (strings);
+  unordered_map<interned_string, uint32_t> all_string_index (string_index);
+  for (size_t i = 1; i < files.size (); ++i)
+    {
+      interned_string name = files[i]->name;
+      auto si = all_string_index.find (name);
+      if (si == all_string_index.end ())
+        {
+          si = all_string_index.insert (make_pair (name, all_strings.size ())).first;
+          all_strings.push_back (name);
+        }
+      file_names.push_back (si->second);
+    }
+
+  put_u32 (buf, all_strings.size ());
+  for (size_t i = 0; i < all_strings.size (); ++i)
+    {
+      put_u32 (buf, all_strings[i].size ());
+      buf.append (all_strings[i].data (), all_strings[i].size ());
+    }
+
+  put_u32 (buf, files.size ());
+  if (!files.empty ())
+    put_u32 (buf, 0);
+  for (size_t i = 0; i < file_names.size (); ++i)
+    put_u32 (buf, file_names[i]);
+
+  for (unsigned table = 0; table < 2; ++table)
+    {
+      const vector<entry>& entries = table ? stream : chains;
+      put_u32 (buf, entries.size ());
+      for (size_t i = 0; i < entries.size (); ++i)
+        {
+          const entry& e = entries[i];
+          put_u32 (buf, e.content);
+          put_u32 (buf, e.file);
+          put_u32 (buf, e.line);
+          put_u32 (buf, e.column);
+          put_u32 (buf, e.chain);
+          put_u32 (buf, e.type);
+          put_u32 (buf, e.junk_type);
+          put_u32 (buf, e.flags);
+        }
+    }
+
+  if (!write_file_atomically (path, buf))
+    {
+      if (s.verbose > 1 && s.defer_reports)
+        s.reports_deferred = true;
+      else if (s.verbose > 1)
+        clog << _F("Failed to save tapset token cache file \"%s\": %s",
+                   path.c_str (), strerror (errno)) << endl;
+    }
+}
+
+
 const token*
 parser::next ()
 {
@@ -1388,11 +2151,20 @@ parser::peek_kw (string const & kw)
 
 lexer::lexer (istream& input, const string& in, systemtap_session& s, bool cc):
   ate_comment(false), ate_whitespace(false), saw_tokens(false), check_compatible(cc),
+  uncacheable(false),
   input_name (in), input_pointer (0), input_end (0), cursor_suspend_count(0),
   cursor_suspend_line (1), cursor_suspend_column (1), cursor_line (1),
   cursor_column (1), session(s), current_file (0), current_token_chain (0)
 {
-  getline(input, input_contents, '\0');
+  // Slurp the input in large blocks rather than a character at a time.
+  // Like getline(..., '\0') used to, stop at any embedded NUL.
+  char buf[65536];
+  streamsize n;
+  while ((n = input.rdbuf()->sgetn (buf, sizeof(buf))) > 0)
+    input_contents.append (buf, n);
+  size_t nul = input_contents.find ('\0');
+  if (nul != string::npos)
+    input_contents.resize (nul);
 
   input_pointer = input_contents.data();
   input_end = input_contents.data() + input_contents.size();
@@ -1426,6 +2198,9 @@ lexer::lexer (istream& input, const string& in, systemtap_session& s, bool cc):
       keywords.insert("catch");
     }
 
+  // NB: the first lexer fills the shared atwords, possibly in a thread
+  static mutex atwords_lock;
+  lock_guard<mutex> guard(atwords_lock);
   if (atwords.empty())
     {
       // NB: adding new @words is mildly disruptive to existing
@@ -1452,10 +2227,20 @@ lexer::lexer (istream& input, const string& in, systemtap_session& s, bool cc):
           atwords.insert("const");
           atwords.insert("variance");
         }
+
+      for (int c = 0; c < 256; c++)
+        {
+          space_chars[c] = isspace (c);
+          ident_chars[c] = isalnum (c) || c == '_' || c == '$';
+          string_chars[c] = !(c == '\"' || c == '\\' || c == '\n');
+        }
     }
 }
 
 unordered_set<string> lexer::atwords;
+bool lexer::space_chars[256];
+bool lexer::ident_chars[256];
+bool lexer::string_chars[256];
 
 void
 lexer::set_current_file (stapfile* f)
@@ -1526,6 +2311,38 @@ lexer::input_get ()
 }
 
 
+// Advance straight to TO, updating the cursor as if each character had
+// gone through input_get.  Only valid while no input_put is pending.
+void
+lexer::input_skip (const char* to)
+{
+  assert (cursor_suspend_count == 0);
+  const char* p = input_pointer;
+  const char* last_newline = 0;
+  while ((p = (const char*) memchr (p, '\n', to - p)))
+    {
+      cursor_line ++;
+      last_newline = p++;
+    }
+  if (last_newline)
+    cursor_column = to - last_newline;
+  else
+    cursor_column += to - input_pointer;
+  input_pointer = to;
+}
+
+
+// Return the end of the run of characters in class CLS at the cursor.
+const char*
+lexer::input_span (const bool* cls) const
+{
+  const char* p = input_pointer;
+  while (p < input_end && cls[(unsigned char) *p])
+    p++;
+  return p;
+}
+
+
 void
 lexer::input_put (const string& chars, const token* t)
 {
@@ -1574,6 +2391,8 @@ skip:
   if (isspace (c))
     {
       ate_whitespace = true;
+      if (!cursor_suspend_count)
+        input_skip (input_span (space_chars));
       goto skip;
     }
 
@@ -1596,6 +2415,7 @@ skip:
           return n;
         }
       size_t num_args = session.args.size ();
+      uncacheable = true;
       input_put ((c == '$') ? lex_cast (num_args) : lex_cast_qstring (num_args), n);
       token_str.clear();
       goto skip;
@@ -1624,7 +2444,11 @@ skip:
           n->make_junk(tok_junk_invalid_arg);
           return n;
         }
-      session.used_args[idx-1] = true;
+      if (session.defer_reports) // used_args isn't safe from worker threads
+        session.reports_deferred = true;
+      else
+        session.used_args[idx-1] = true;
+      uncacheable = true;
       const string& arg = session.args[idx-1];
       input_put ((c == '$') ? arg : lex_cast_qstring (arg), n);
       token_str.clear();
@@ -1633,12 +2457,21 @@ skip:
 
   else if (isalpha (c) || c == '$' || c == '@' || c == '_')
     {
-      token_str = (char) c;
-      while (isalnum (c2) || c2 == '_' || c2 == '$')
-	{
-          input_get ();
-          token_str.push_back (c2);
-          c2 = input_peek ();
+      if (!cursor_suspend_count)
+        {
+          const char* start = input_pointer - 1;
+          input_skip (input_span (ident_chars));
+          token_str.assign (start, input_pointer);
+        }
+      else
+        {
+          token_str = (char) c;
+          while (isalnum (c2) || c2 == '_' || c2 == '$')
+            {
+              input_get ();
+              token_str.push_back (c2);
+              c2 = input_peek ();
+            }
         }
       n->content = token_str;
 
@@ -1678,6 +2511,15 @@ skip:
       n->type = tok_string;
       while (1)
 	{
+          if (!cursor_suspend_count)
+            {
+              // Take ordinary characters up to the next quote, escape
+              // or newline in one go.
+              const char* start = input_pointer;
+              input_skip (input_span (string_chars));
+              token_str.append (start, input_pointer);
+            }
+
 	  c = input_get ();
 
 	  if (c < 0 || c == '\n')
@@ -1733,20 +2575,20 @@ skip:
       // 1-1 would be parsed as tok_number(1) and tok_number(-1)
       // instead of tok_number(1) tok_operator('-') tok_number(1)
 
-      if (c == '#') // shell comment
+      if (c == '#' || (c == '/' && c2 == '/')) // shell or C++ comment
         {
-          unsigned this_line = cursor_line;
-          do { c = input_get (); }
-          while (c >= 0 && cursor_line == this_line);
-          ate_comment = true;
-          ate_whitespace = true;
-          goto skip;
-        }
-      else if ((c == '/' && c2 == '/')) // C++ comment
-        {
-          unsigned this_line = cursor_line;
-          do { c = input_get (); }
-          while (c >= 0 && cursor_line == this_line);
+          if (!cursor_suspend_count)
+            {
+              const char* eol = (const char*) memchr (input_pointer, '\n',
+                                                      input_end - input_pointer);
+              input_skip (eol ? eol + 1 : input_end);
+            }
+          else
+            {
+              unsigned this_line = cursor_line;
+              do { c = input_get (); }
+              while (c >= 0 && cursor_line == this_line);
+            }
           ate_comment = true;
           ate_whitespace = true;
           goto skip;
@@ -1754,6 +2596,16 @@ skip:
       else if (c == '/' && c2 == '*') // C comment
 	{
           (void) input_get (); // swallow '*' already in c2
+          if (!cursor_suspend_count)
+            {
+              const char* end = (const char*) memmem (input_pointer,
+                                                      input_end - input_pointer,
+                                                      "*/", 2);
+              input_skip (end ? end + 2 : input_end);
+              ate_comment = true;
+              ate_whitespace = true;
+              goto skip;
+            }
           c = input_get ();
           c2 = input_get ();
           while (c2 >= 0)
@@ -1771,6 +2623,24 @@ skip:
         {
           n->type = tok_embedded;
           (void) input_get (); // swallow '{' already in c2
+          const char* end = 0;
+          if (!cursor_suspend_count)
+            end = (const char*) memmem (input_pointer, input_end - input_pointer,
+                                        "%}", 2);
+          if (end)
+            {
+              // Any '}%' typo must start before the closing '%}'.
+              const char* typo = input_pointer;
+              while ((typo = (const char*) memmem (typo, end + 1 - typo, "}%", 2)))
+                {
+                  session.print_warning (_("possible erroneous closing '}%', use '%}'?"), n);
+                  uncacheable = true;
+                  typo++;
+                }
+              n->content = string (input_pointer, end);
+              input_skip (end + 2);
+              return n;
+            }
           c = input_get ();
           c2 = input_get ();
           while (c2 >= 0)
@@ -1781,7 +2651,10 @@ skip:
                   return n;
                 }
               if (c == '}' && c2 == '%') // possible typo
-                session.print_warning (_("possible erroneous closing '}%', use '%}'?"), n);
+                {
+                  session.print_warning (_("possible erroneous closing '}%', use '%}'?"), n);
+                  uncacheable = true;
+                }
               token_str.push_back (c);
               c = c2;
               c2 = input_get();
@@ -1896,6 +2769,20 @@ parser::parse ()
   stapfile* f = new stapfile;
   input.set_current_file (f);
 
+  string tokens_path;
+  if (cache_tokens)
+    {
+      tokens.set_file (f);
+      tokens_path = find_tapset_hash (session, f->file_contents,
+                                      input.check_compatible);
+      if (tokens_path.empty ())
+        ; // no cache after all
+      else if (!session.poison_cache && tokens.load (session, tokens_path))
+        replaying_tokens = true;
+      else
+        recording_tokens = true;
+    }
+
   bool empty = true;
 
   while (1)
@@ -1981,10 +2868,13 @@ parser::parse ()
     }
   else if (num_errors > 0)
     {
-      cerr << _NF("%d parse error.", "%d parse errors.", num_errors, num_errors) << endl;
+      if (!session.defer_reports)
+        cerr << _NF("%d parse error.", "%d parse errors.", num_errors, num_errors) << endl;
       delete f;
       f = 0;
     }
+  else if (recording_tokens && !input.uncacheable && !session.reports_deferred)
+    tokens.save (session, tokens_path);
 
   input.set_current_file(0);
   return f;
@@ -2373,7 +3263,12 @@ parser::do_parse_functiondecl (vector<functiondecl*>& functions, const token* t,
   string gname = "__global_" + string(t->content);
   string pname = "__private_" + detox_path(fname) + string(t->content);
   string name = priv ? pname : gname;
-  name += "__overload_" + lex_cast(session.overload_count[t->content]++);
+  // Worker threads leave overload_count alone; the suffix is assigned
+  // afterwards in file order, just like probe ids.
+  unsigned overload = 0;
+  if (! session.defer_reports)
+    overload = session.overload_count[t->content]++;
+  name += "__overload_" + lex_cast(overload);
 
   functiondecl *fd = new functiondecl ();
   fd->unmangled_name = t->content;
@@ -11,11 +11,14 @@
 #ifndef PARSE_H
 #define PARSE_H
 
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <stdexcept>
 #include "stringtable.h"
+#include "util.h"
 
 
 struct systemtap_session;
@@ -56,7 +59,7 @@ enum token_junk_type
   };
 
 
-struct token
+struct token: public arena_allocated
 {
   source_loc location;
   interned_string content;
@@ -68,6 +71,7 @@ struct token
   
   friend class parser;
   friend class lexer;
+  friend class token_stream;
 private:
   void make_junk (token_junk_type);
   token(): chain(0), type(tok_junk), junk_type(tok_junk_unknown) {}
@@ -105,6 +109,7 @@ enum parse_flag
     pf_squash_errors = 4,
     pf_user_file = 8,
     pf_auto_path = 16,
+    pf_cache_tokens = 32,
   };
 
 
@@ -115,6 +120,62 @@ stapfile* parse_library_macros (systemtap_session& s, const std::string& n);
 
 probe* parse_synthetic_probe (systemtap_session &s, std::istream& i, const token* tok);
 
+void parse_library_files (systemtap_session& s,
+                          const std::vector<std::pair<std::string, unsigned> >& files,
+                          std::vector<stapfile*>& results);
+
+
+// An index of what each library file defines, kept in the cache so that
+// later runs parse only the library files a script actually refers to.
+// The files are loaded on demand during elaboration, and get the same
+// probe ids and function overload numbers as if all had been parsed.
+class tapset_index
+{
+public:
+  static tapset_index* load (systemtap_session& s, const std::string& path,
+                             const std::vector<std::pair<std::string, unsigned> >& files);
+  static void save (systemtap_session& s, const std::string& path,
+                    const std::vector<stapfile*>& files);
+
+  // Account for all of the library files, before the user script is
+  // parsed, as if they had been parsed already.
+  void reserve (systemtap_session& s);
+
+  // Load the files defining the given function (by unmangled name),
+  // global (by mangled name), or probe aliases whose first component
+  // matches the given (possibly wildcarded) pattern.
+  void load_functions (systemtap_session& s, const std::string& name);
+  void load_globals (systemtap_session& s, const std::string& name);
+  void load_aliases (systemtap_session& s, const std::string& pattern);
+
+  bool defines_global (const std::string& name) const;
+  void collect_functions (std::set<std::string>& names) const;
+  void collect_aliases (std::set<std::string>& names) const;
+
+private:
+  struct file_entry
+  {
+    unsigned probes; // probes and aliases
+    std::vector<std::pair<std::string, bool> > functions; // name, private?
+    std::vector<std::string> globals; // public, mangled
+    std::set<std::string> aliases; // first components
+  };
+
+  std::vector<std::pair<std::string, unsigned> > files;
+  std::vector<file_entry> entries;
+  std::vector<stapfile*> parsed;
+  std::vector<bool> tried;
+  std::map<std::string, std::vector<unsigned> > function_files;
+  std::map<std::string, std::vector<unsigned> > global_files;
+  std::map<std::string, std::vector<unsigned> > alias_files;
+  std::set<std::string> registered_aliases;
+  unsigned first_probeidx;
+  size_t first_library_file;
+
+  tapset_index (): first_probeidx (0), first_library_file (0) {}
+  stapfile* load_file (systemtap_session& s, unsigned i);
+};
+
 #endif // PARSE_H
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
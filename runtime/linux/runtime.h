@@ -161,18 +161,6 @@ static struct
 
 #define _stp_seq_inc() (atomic_inc_return(&_stp_seq.seq))
 
-/* dwarf unwinder only tested so far on arm, i386, x86_64, ppc64 and s390x.
-   Only define STP_USE_DWARF_UNWINDER when STP_NEED_UNWIND_DATA,
-   as set through a pragma:unwind in one of the [u]context-unwind.stp
-   functions. */
-#if (defined(__arm__) || defined(__i386__) || defined(__x86_64__) || defined(__powerpc64__)) || defined (__s390x__) || defined(__aarch64__) || defined(__mips__)
-#ifdef STP_NEED_UNWIND_DATA
-#ifndef STP_USE_DWARF_UNWINDER
-#define STP_USE_DWARF_UNWINDER
-#endif
-#endif
-#endif
-
 // PR13489, inode-uprobes sometimes lacks the necessary SYMBOL_EXPORT's.
 #if !defined(STAPCONF_TASK_USER_REGSET_VIEW_EXPORTED)
 static void *kallsyms_task_user_regset_view;
@@ -243,7 +231,7 @@ static void *kallsyms___lock_task_sighand;
    We only need to compile in the unwinder when both STP_NEED_UNWIND_DATA
    (set when a stap script defines pragma:unwind, as done in
    [u]context-unwind.stp) is defined and the architecture actually supports
-   dwarf unwinding (as defined by STP_USE_DWARF_UNWINDER in runtime.h).  */
+   dwarf unwinding (as defined by STP_USE_DWARF_UNWINDER in sym.h).  */
 #ifdef STP_USE_DWARF_UNWINDER
 #include "unwind.c"
 #else
@@ -10,6 +10,20 @@
 #ifndef _STP_SYM_H_
 #define _STP_SYM_H_
 
+#ifdef __KERNEL__
+/* dwarf unwinder only tested so far on arm, i386, x86_64, ppc64 and s390x.
+   Only define STP_USE_DWARF_UNWINDER when STP_NEED_UNWIND_DATA,
+   as set through a pragma:unwind in one of the [u]context-unwind.stp
+   functions. */
+#if (defined(__arm__) || defined(__i386__) || defined(__x86_64__) || defined(__powerpc64__)) || defined (__s390x__) || defined(__aarch64__) || defined(__mips__)
+#ifdef STP_NEED_UNWIND_DATA
+#ifndef STP_USE_DWARF_UNWINDER
+#define STP_USE_DWARF_UNWINDER
+#endif
+#endif
+#endif
+#endif /* __KERNEL__ */
+
 /* Constants for printing address symbols. */
 
 /* Prints address as hex, plus space, no newline. */
@@ -126,6 +140,10 @@ struct _stp_module {
 	int build_id_len;
 };
 
+/* The translation units holding just the symbol tables of one module
+   need nothing but the above. */
+#ifndef STP_SYMBOL_DATA_ONLY
+
 /* Defined by translator-generated stap-symbols.h. */
 static struct _stp_module *_stp_modules [];
 static const unsigned _stp_num_modules;
@@ -154,4 +172,5 @@ static struct _stp_symbol _stp_module_self_symbols_0[];
 static struct _stp_symbol _stp_module_self_symbols_1[];
 #endif /* defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)
           || defined(STP_NEED_LINE_DATA) */
+#endif /* STP_SYMBOL_DATA_ONLY */
 #endif /* _STP_SYM_H_ */
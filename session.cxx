@@ -63,12 +63,18 @@ extern int optind;
 bool systemtap_session::NSPR_Initialized = false;
 #endif
 
+thread_local bool systemtap_session::defer_reports = false;
+thread_local bool systemtap_session::reports_deferred = false;
+
 systemtap_session::systemtap_session ():
   // NB: pointer members must be manually initialized!
   // NB: don't forget the copy constructor too!
   runtime_mode(kernel_runtime),
   base_hash(0),
+  tapset_hash(0),
+  fingerprints(0),
   pattern_root(new match_node),
+  library_index(0),
   dfa_counter (0),
   dfa_maxstate (0),
   dfa_maxtag (0),
@@ -148,6 +154,7 @@ systemtap_session::systemtap_session ():
   use_cache = true;
   use_script_cache = true;
   poison_cache = false;
+  content_fingerprints = false;
   tapset_compile_coverage = false;
   need_uprobes = false;
   need_unwind = false;
@@ -180,6 +187,8 @@ systemtap_session::systemtap_session ():
     && strcmp(getenv("TERM") ?: "notdumb", "dumb"); // on auto
   interactive_mode = false;
   pass_1a_complete = false;
+  jobs = thread::hardware_concurrency();
+  if (jobs < 1) jobs = 1;
   timeout = 0;
 
   // PR12443: put compiled-in / -I paths in front, to be preferred during 
@@ -258,8 +267,11 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   //     plus copying any wanted implicit fields (strings, vectors, etc.)
   runtime_mode(other.runtime_mode),
   base_hash(0),
+  tapset_hash(0),
+  fingerprints(0),
   pattern_root(new match_node),
   user_files (other.user_files),
+  library_index(0),
   dfa_counter(0),
   dfa_maxstate (0),
   dfa_maxtag (0),
@@ -310,6 +322,8 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   runtime_specified = other.runtime_specified;
   include_arg_start = other.include_arg_start;
   timing = other.timing;
+  timing_report = other.timing_report;
+  timings = other.timings;
   guru_mode = other.guru_mode;
   bulk_mode = other.bulk_mode;
   unoptimized = other.unoptimized;
@@ -337,6 +351,7 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   use_cache = other.use_cache;
   use_script_cache = other.use_script_cache;
   poison_cache = other.poison_cache;
+  content_fingerprints = other.content_fingerprints;
   tapset_compile_coverage = other.tapset_compile_coverage;
   need_uprobes = false;
   need_unwind = false;
@@ -365,6 +380,7 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   color_mode = other.color_mode;
   interactive_mode = other.interactive_mode;
   pass_1a_complete = other.pass_1a_complete;
+  jobs = other.jobs;
   timeout = other.timeout;
 
   include_path = other.include_path;
@@ -408,6 +424,7 @@ systemtap_session::~systemtap_session ()
   remove_tmp_dir();
   delete_map(subsessions);
   delete pattern_root;
+  delete library_index;
 }
 
 const string
@@ -563,6 +580,7 @@ systemtap_session::usage (int exitcode)
      "              interactive mode %s\n"
 #endif
      "   -s NUM     buffer size in megabytes, instead of %d\n"
+     "   -j NUM     use up to NUM threads for parallel work, instead of %u\n"
      "   -I DIR     look in DIR for additional .stp script files", (unoptimized ? _(" [set]") : ""),
          (suppress_warnings ? _(" [set]") : ""), (panic_warnings ? _(" [set]") : ""),
          (guru_mode ? _(" [set]") : ""), (prologue_searching_mode == prologue_searching_always ? _(" [set]") : ""),
@@ -570,7 +588,7 @@ systemtap_session::usage (int exitcode)
 #ifdef HAVE_LIBREADLINE
          (interactive_mode ? _(" [set]") : ""),
 #endif
-	 buffer_size);
+	 buffer_size, jobs);
   if (include_path.size() == 0)
     cout << endl;
   else
@@ -616,6 +634,9 @@ systemtap_session::usage (int exitcode)
     "   --all-modules\n"
     "              add unwind/symbol data for all loaded kernel objects.\n"
     "   -t         collect probe timing information\n"
+    "   --timing=json[:FILE]\n"
+    "              report the time and memory used by each pass and phase\n"
+    "              of the translator to FILE, instead of stderr\n"
     "   -T TIME    terminate the script after TIME seconds\n"
 #ifdef HAVE_LIBSQLITE3
     "   -q         generate information on tapset coverage\n"
@@ -920,6 +941,28 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
 	  server_args.push_back (string ("-") + (char)grc + optarg);
           break;
 
+        case 'j':
+          assert(optarg);
+          if (client_options) {
+            cerr << _F("ERROR: %s is invalid with %s", "-j", "--client-options") << endl;
+            return 1;
+          }
+          {
+            unsigned long n = strtoul (optarg, &num_endptr, 10);
+            if (*num_endptr != '\0' || n < 1)
+              {
+                cerr << _("Invalid number of jobs (should be at least 1).") << endl;
+                return 1;
+              }
+            // More jobs than processors gain nothing, and -j also sets
+            // the parallelism of kbuild.
+            long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+            if (ncpus > 0 && n > (unsigned long) ncpus)
+              n = ncpus;
+            jobs = n;
+          }
+          break;
+
 	case 'c':
           assert(optarg);
 	  cmd = string (optarg);
@@ -1212,6 +1255,22 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
 	  poison_cache = true;
 	  break;
 
+	case LONG_OPT_CACHE_FINGERPRINT:
+	  if (client_options) {
+	    cerr << _F("ERROR: %s is invalid with %s", "--cache-fingerprint", "--client-options") << endl;
+	    return 1;
+	  }
+	  if (strcmp (optarg, "stat") == 0)
+	    content_fingerprints = false;
+	  else if (strcmp (optarg, "content") == 0)
+	    content_fingerprints = true;
+	  else
+	    {
+	      cerr << _F("Invalid --cache-fingerprint mode '%s'.", optarg) << endl;
+	      return 1;
+	    }
+	  break;
+
 	case LONG_OPT_CLEAN_CACHE:
 	  if (client_options) {
 	    cerr << _F("ERROR: %s is invalid with %s", "--clean-cache", "--client-options") << endl;
@@ -1584,6 +1643,24 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
             }
           break;
 
+        case LONG_OPT_TIMING:
+          if (client_options)
+            {
+              cerr << _F("ERROR: %s is invalid with %s", "--timing", "--client-options") << endl;
+              return 1;
+            }
+          if (strcmp (optarg, "json") == 0)
+            timing_report = "-";
+          else if (strncmp (optarg, "json:", 5) == 0 && optarg[5] != '\0')
+            timing_report = optarg + 5;
+          else
+            {
+              cerr << _F("Invalid --timing format '%s'.", optarg) << endl;
+              return 1;
+            }
+          timings.reset (new phase_timings);
+          break;
+
 	case '?':
 	  // Invalid/unrecognized option given or argument required, but
 	  // not given. In both cases getopt_long() will have printed the
@@ -2162,43 +2239,66 @@ systemtap_session::setup_kernel_release (const char* kstr)
 void
 systemtap_session::register_library_aliases()
 {
-  vector<stapfile*> files(library_files);
+  vector<stapfile*> files;
+  if (library_index)
+    {
+      // Library aliases are registered as probe points refer to them,
+      // but any that share a name with the user's own must come first.
+      for (unsigned f = 0; f < user_files.size(); ++f)
+        for (unsigned a = 0; a < user_files[f]->aliases.size(); ++a)
+          {
+            probe_alias * alias = user_files[f]->aliases[a];
+            for (unsigned n = 0; n < alias->alias_names.size(); ++n)
+              library_index->load_aliases(*this,
+                                          alias->alias_names[n]->components[0]->functor);
+          }
+    }
+  else
+    files = library_files;
   files.insert(files.end(), user_files.begin(), user_files.end());
 
   for (unsigned f = 0; f < files.size(); ++f)
+    register_library_aliases(files[f]);
+}
+
+
+// Register the aliases of the given file, or just those whose first
+// component is PREFIX.
+void
+systemtap_session::register_library_aliases(stapfile* file, const string& prefix)
+{
+  for (unsigned a = 0; a < file->aliases.size(); ++a)
     {
-      stapfile * file = files[f];
-      for (unsigned a = 0; a < file->aliases.size(); ++a)
-	{
-	  probe_alias * alias = file->aliases[a];
-          try
+      probe_alias * alias = file->aliases[a];
+      try
+        {
+          for (unsigned n = 0; n < alias->alias_names.size(); ++n)
             {
-              for (unsigned n = 0; n < alias->alias_names.size(); ++n)
+              probe_point * name = alias->alias_names[n];
+              if (!prefix.empty() && name->components[0]->functor != prefix)
+                continue;
+              match_node * mn = pattern_root;
+              for (unsigned c = 0; c < name->components.size(); ++c)
                 {
-                  probe_point * name = alias->alias_names[n];
-                  match_node * mn = pattern_root;
-                  for (unsigned c = 0; c < name->components.size(); ++c)
-                    {
-                      probe_point::component * comp = name->components[c];
-                      // XXX: alias parameters
-                      if (comp->arg)
-                        throw SEMANTIC_ERROR(_F("alias component %s contains illegal parameter",
-                                                comp->functor.to_string().c_str()));
-                      mn = mn->bind(comp->functor);
-                    }
-		  // PR 12916: All probe aliases are OK for all users. The actual
-		  // referenced probe points will be checked when the alias is resolved.
-		  mn->bind_privilege (pr_all);
-                  mn->bind(new alias_expansion_builder(alias));
+                  probe_point::component * comp = name->components[c];
+                  // XXX: alias parameters
+                  if (comp->arg)
+                    throw SEMANTIC_ERROR(_F("alias component %s contains illegal parameter",
+                                            comp->functor.to_string().c_str()));
+                  mn = mn->bind(comp->functor);
                 }
+              // PR 12916: All probe aliases are OK for all users. The actual
+              // referenced probe points will be checked when the alias is resolved.
+              mn->bind_privilege (pr_all);
+              mn->bind(new alias_expansion_builder(alias));
             }
-          catch (const semantic_error& e)
-            {
-              semantic_error er(ERR_SRC, _("while registering probe alias"),
-                                alias->tok, NULL, &e);
-              print_error (er);
-            }
-	}
+        }
+      catch (const semantic_error& e)
+        {
+          semantic_error er(ERR_SRC, _("while registering probe alias"),
+                            alias->tok, NULL, &e);
+          print_error (er);
+        }
     }
 }
 
@@ -2238,6 +2338,12 @@ systemtap_session::print_token (ostream& o, const token* tok)
 void
 systemtap_session::print_error (const semantic_error& se)
 {
+  if (defer_reports)
+    {
+      reports_deferred = true;
+      return;
+    }
+
   // skip error message printing for listing mode with low verbosity
   if (this->dump_mode && this->verbose <= 1)
     {
@@ -2377,6 +2483,12 @@ systemtap_session::print_error_details (std::ostream& message,
 void
 systemtap_session::print_warning (const string& message_str, const token* tok)
 {
+  if (defer_reports)
+    {
+      reports_deferred = true;
+      return;
+    }
+
   // Only output in dump mode if -vv is supplied:
   if (suppress_warnings && (!dump_mode || verbose <= 1))
     return; // NB: don't count towards suppressed_warnings count
@@ -2401,6 +2513,12 @@ systemtap_session::print_error (const parse_error &pe,
                                 const std::string &input_name,
                                 bool is_warningerr)
 {
+  if (defer_reports)
+    {
+      reports_deferred = true;
+      return;
+    }
+
   // duplicate elimination
   if (verbose > 0 || seen_errors[pe.errsrc_chain()] < 1)
     {
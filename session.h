@@ -44,7 +44,9 @@ extern "C" {
 
 // forward decls for all referenced systemtap types
 class stap_hash;
+class fingerprint_memo;
 class match_node;
+class tapset_index;
 struct stapfile;
 struct vardecl;
 struct token;
@@ -208,6 +210,8 @@ public:
   unsigned perpass_verbose[5];
   unsigned verbose;
   bool timing;
+  std::string timing_report; // --timing=json destination, "-" for stderr
+  std::shared_ptr<phase_timings> timings; // set by --timing=json
   bool save_module;
   bool save_uprobes;
   bool modname_given;
@@ -252,6 +256,7 @@ public:
   bool color_errors;
   bool interactive_mode;
   bool pass_1a_complete;
+  unsigned jobs; // -j; upper bound on worker threads
 
   enum { color_never, color_auto, color_always } color_mode;
   enum { prologue_searching_never, prologue_searching_auto, prologue_searching_always } prologue_searching_mode;
@@ -316,8 +321,12 @@ public:
   bool poison_cache;            // consider the cache to be write-only
   std::string cache_path;       // usually ~/.systemtap/cache
   std::string hash_path;        // path to the cached script module
+  std::string canonical_hash_path; // path to the canonical script link
   std::string stapconf_path;    // path to the cached stapconf
   stap_hash *base_hash;         // hash common to all caching
+  stap_hash *tapset_hash;       // hash common to tapset token caching
+  fingerprint_memo *fingerprints; // file digests for content fingerprints
+  bool content_fingerprints;    // --cache-fingerprint=content
 
   // Skip bad $ vars
   bool skip_badvars;
@@ -332,6 +341,7 @@ public:
 
   match_node* pattern_root;
   void register_library_aliases();
+  void register_library_aliases(stapfile* file, const std::string& prefix = "");
 
   // data for various preprocessor library macros
   std::map<std::string, macrodecl*> library_macros;
@@ -339,6 +349,7 @@ public:
   // parse trees for the various script files
   std::vector<stapfile*> user_files;
   std::vector<stapfile*> library_files;
+  tapset_index* library_index; // if set, library_files are loaded lazily
 
   // filters to run over all code before symbol resolution
   //   e.g. @cast expansion
@@ -449,6 +460,13 @@ public:
                                const std::string &input_name);
   void print_warning (const std::string& w, const token* tok = 0);
   void printscript(std::ostream& o);
+
+  // Worker threads (see parse_library_files) run with defer_reports
+  // set.  Instead of printing anything or touching the bookkeeping
+  // above, print_error and print_warning then merely set
+  // reports_deferred, and the caller redoes that work serially.
+  static thread_local bool defer_reports;
+  static thread_local bool reports_deferred;
   void report_suppression();
 
   // NB: It is very important for all of the above (and below) fields
@@ -27,7 +27,15 @@
 #include <climits>
 #include <iostream>
 #include <map>
+#include <set>
+#include <memory>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
 
 extern "C" {
 #include <unistd.h>
@@ -45,7 +53,10 @@ extern "C" {
 #include <ssl.h>
 #include <nss.h>
 #include <keyhi.h>
+#include <pk11pub.h>
+#include <hasht.h>
 #include <regex.h>
+#include <utime.h>
 #include <dirent.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -120,8 +131,10 @@ static bool   keep_temp;
 static string mok_path;
 
 sem_t sem_client;
+static long max_connections; // builds plus the requests queued for them
 static int pending_interrupts;
 #define CONCURRENCY_TIMEOUT_S 3
+#define QUEUED_REQUESTS_PER_THREAD 3
 
 // Message handling.
 // Server_error messages are printed to stderr and logged, if requested.
@@ -2131,6 +2144,466 @@ check_uncompressed_request_size (const char * zip_file)
   return 0; // If it got to this point, everthing went well.
 }
 
+/* Identical requests, e.g. from a fleet-wide rollout of one script, are
+ * built only once.  Each response that stap built successfully is kept in
+ * the cache under a digest of everything it depends on, and a request that
+ * comes in while an identical one is being built waits for that build
+ * and sends its response, whether it succeeded or not.  */
+struct response_build
+{
+  bool done;
+  string zip;     // the response for the waiting requests, once done
+  string handoff; // a temporary copy of a response not kept in the cache
+
+  response_build (): done (false) {}
+  ~response_build ()
+  {
+    // NB: the last request done with the build removes its temporary copy
+    if (! handoff.empty ())
+      unlink (handoff.c_str ());
+  }
+};
+
+static mutex response_lock;
+static condition_variable response_built;
+static map<string, shared_ptr<response_build> > responses_in_flight;
+
+static string
+response_cache_path ()
+{
+  // NB: under the stap cache, so the cache cleaning of the stap runs
+  // we spawn also bounds these.
+  string data_path;
+  const char* s_d = getenv ("SYSTEMTAP_DIR");
+  if (s_d != NULL)
+    data_path = s_d;
+  else
+    data_path = get_home_directory() + string("/.systemtap");
+  return data_path + "/cache/server";
+}
+
+// List the files under dirName, relative to it.
+static bool
+list_tree_files (const string &dirName, const string &prefix, vector<string> &files)
+{
+  DIR *dir = opendir (dirName.c_str ());
+  if (! dir)
+    return false;
+
+  bool ok = true;
+  struct dirent *ent;
+  while (ok && (ent = readdir (dir)) != NULL)
+    {
+      string name = ent->d_name;
+      if (name == "." || name == "..")
+        continue;
+
+      struct stat st;
+      string path = dirName + "/" + name;
+      if (lstat (path.c_str (), & st) != 0)
+        ok = false;
+      else if (S_ISDIR (st.st_mode))
+        ok = list_tree_files (path, prefix + name + "/", files);
+      else
+        files.push_back (prefix + name);
+    }
+  closedir (dir);
+  return ok;
+}
+
+static void
+add_file_stat (ostream &key, const string &path)
+{
+  struct stat st;
+  key << path << ": ";
+  if (stat (path.c_str (), & st) == 0)
+    key << st.st_size << " " << st.st_mtime;
+  key << "\n";
+}
+
+// Add the files under dirName to key, by their sizes and mtimes.
+static void
+add_tree_stat (ostream &key, const string &dirName)
+{
+  vector<string> files;
+  list_tree_files (dirName, "", files);
+  sort (files.begin (), files.end ());
+  key << dirName << ":\n";
+  for (unsigned i = 0; i < files.size (); i++)
+    add_file_stat (key, dirName + "/" + files[i]);
+}
+
+// Add the files of the request to key, except for those named in skip.
+static bool
+add_request_files (ostream &key, const string &requestDirName, const set<string> &skip)
+{
+  vector<string> files;
+  if (! list_tree_files (requestDirName, "", files))
+    return false;
+  sort (files.begin (), files.end ());
+  for (unsigned i = 0; i < files.size (); i++)
+    {
+      if (skip.count (files[i]))
+        continue;
+
+      string path = requestDirName + "/" + files[i];
+      struct stat st;
+      if (lstat (path.c_str (), & st) != 0)
+        return false;
+
+      key << files[i] << ": ";
+      if (S_ISLNK (st.st_mode))
+        {
+          char target[PATH_MAX];
+          ssize_t len = readlink (path.c_str (), target, sizeof (target));
+          if (len < 0)
+            return false;
+          key << "-> " << string (target, len);
+        }
+      else
+        {
+          ifstream f (path.c_str ());
+          if (! f)
+            return false;
+          key << st.st_size << "\n" << f.rdbuf ();
+        }
+      key << "\n";
+    }
+  return true;
+}
+
+static string
+sha256_hex (const string &data)
+{
+  unsigned char digest[SHA256_LENGTH];
+  if (PK11_HashBuf (SEC_OID_SHA256, digest, (const unsigned char *) data.data (),
+                    data.size ()) != SECSuccess)
+    return "";
+
+  string result;
+  char hex[3];
+  for (unsigned i = 0; i < sizeof (digest); i++)
+    {
+      snprintf (hex, sizeof (hex), "%02x", digest[i]);
+      result += hex;
+    }
+  return result;
+}
+
+/* Compute a digest of the request in requestDirName (the script, the client's
+ * options, its kernel release and arch, privilege, locale, MOK fingerprints and
+ * protocol version) and of what this server would build it with: stap, its
+ * tapset and runtime trees and the kernel build tree.  Returns an
+ * empty string if the request can't be fingerprinted.  */
+static string
+request_fingerprint (const string &requestDirName)
+{
+  string kernel_version;
+  ifstream versionfile((requestDirName + "/sysinfo").c_str());
+  if (! (versionfile >> kernel_version >> kernel_version)) // Skip sysinfo: label
+    return "";
+  map<string,string>::const_iterator tree = kernel_build_tree.find (kernel_version);
+  if (tree == kernel_build_tree.end ())
+    return "";
+
+  ostringstream key;
+  key << "options: " << stap_options << "\n";
+  key << "certificate: " << cert_serial_number << "\n";
+  add_file_stat (key, getenv ("SYSTEMTAP_STAP") ?: STAP_PREFIX "/bin/stap");
+  add_tree_stat (key, getenv ("SYSTEMTAP_TAPSET") ?: PKGDATADIR "/tapset");
+  add_tree_stat (key, getenv ("SYSTEMTAP_RUNTIME") ?: PKGDATADIR "/runtime");
+  add_file_stat (key, tree->second + "/.config");
+  add_file_stat (key, tree->second + "/Module.symvers");
+  if (! add_request_files (key, requestDirName, set<string> ()))
+    return "";
+  return sha256_hex (key.str ());
+}
+
+/* Compute a digest of just the script and the client's options, which is
+ * what similar requests, e.g. for other kernels, have in common.  */
+static string
+request_shape (const string &requestDirName)
+{
+  static const set<string> incidental = {
+    "sysinfo", "locale", "version", "mok_fingerprints"
+  };
+  ostringstream key;
+  if (! add_request_files (key, requestDirName, incidental))
+    return "";
+  return sha256_hex (key.str ());
+}
+
+static bool
+get_cached_response (const string &fingerprint, const string &responseFileName)
+{
+  string cached = response_cache_path () + "/" + fingerprint + ".zip";
+  if (get_file_size (cached) <= 0 || ! copy_file (cached, responseFileName))
+    return false;
+  utime (cached.c_str (), NULL); // for the LRU order of the cache cleaning
+  return true;
+}
+
+/* Returns true if the response to the request with the given fingerprint was
+ * copied to responseFileName, from the cache or from an identical request
+ * built meanwhile.  Otherwise, the caller is to build the response and then
+ * call release_response.  */
+static bool
+claim_response (const string &fingerprint, const string &responseFileName)
+{
+  // NB: the zips are copied without holding response_lock, so that
+  // requests for other responses don't wait for them.
+  if (get_cached_response (fingerprint, responseFileName))
+    return true;
+
+  shared_ptr<response_build> build;
+  {
+    unique_lock<mutex> guard (response_lock);
+    auto it = responses_in_flight.find (fingerprint);
+    if (it == responses_in_flight.end ())
+      {
+        responses_in_flight[fingerprint] = make_shared<response_build> ();
+        return false;
+      }
+
+    log (_("Waiting for an identical request in progress"));
+    build = it->second;
+    while (! build->done)
+      response_built.wait (guard);
+  }
+
+  if (! build->zip.empty () && copy_file (build->zip, responseFileName))
+    return true;
+
+  // The build we waited for couldn't even produce a response; build our
+  // own, alongside the other requests that waited for it.
+  return false;
+}
+
+/* Hand the response in responseFileName, or none if it is empty, to the
+ * requests waiting for the one with the given fingerprint, and keep it in
+ * the cache if cacheable.  */
+static void
+release_response (const string &fingerprint, const string &responseFileName, bool cacheable)
+{
+  shared_ptr<response_build> build;
+  {
+    lock_guard<mutex> guard (response_lock);
+    build = responses_in_flight[fingerprint];
+  }
+
+  if (! responseFileName.empty () && cacheable)
+    {
+      string cache_path = response_cache_path ();
+      string cached = cache_path + "/" + fingerprint + ".zip";
+      if (create_dir (cache_path.c_str ()) == 0
+          && copy_file (responseFileName, cached))
+        build->zip = cached;
+    }
+  if (build->zip.empty () && ! responseFileName.empty ())
+    {
+      // NB: our own response goes away with our tmpdir, possibly before
+      // the waiting requests copy it.
+      char handoff[PATH_MAX];
+      snprintf (handoff, PATH_MAX, "%s/stap-response.XXXXXX", getenv ("TMPDIR") ?: "/tmp");
+      int fd = mkstemp (handoff);
+      if (fd >= 0)
+        {
+          close (fd);
+          build->handoff = handoff;
+          if (copy_file (responseFileName, build->handoff))
+            build->zip = build->handoff;
+        }
+    }
+
+  lock_guard<mutex> guard (response_lock);
+  responses_in_flight.erase (fingerprint);
+  build->done = true;
+  response_built.notify_all ();
+}
+
+/* Builds are scheduled rather than started in the order their requests came
+ * in.  At most max_threads of them run at once, and among the queued ones,
+ * the next to go is that of the client which has recently used the least
+ * build time, and for the same client, the one expected to be quickest.
+ * So one client's batch of heavy compiles can't hold up everybody else's
+ * small ones.  Expected build times come from earlier builds of the same
+ * script with the same options.  Besides, a build waits while the server is
+ * short of memory or already loaded, unless nothing else is building.  */
+#define CLIENT_USAGE_HALF_LIFE_S 300.0
+#define MIN_AVAILABLE_MEMORY_KB (512 * 1024)
+#define MAX_BUILD_HISTORY 4096
+
+typedef chrono::steady_clock sched_clock;
+
+struct queued_build
+{
+  string client;
+  double estimate;
+  sched_clock::time_point arrival;
+};
+
+struct client_usage
+{
+  double seconds; // of build time, decaying
+  sched_clock::time_point updated;
+  double running; // estimated seconds of the builds now running
+};
+
+static mutex build_lock;
+static condition_variable build_slot_freed;
+static long builds_running;
+static vector<queued_build *> build_queue;
+static map<string, client_usage> client_usages;
+static map<string, double> build_history; // request shape -> seconds
+static double typical_build_s;
+
+static double
+client_share (const string &client, sched_clock::time_point now)
+{
+  map<string, client_usage>::iterator it = client_usages.find (client);
+  if (it == client_usages.end ())
+    return 0;
+  chrono::duration<double> age = now - it->second.updated;
+  it->second.seconds *= pow (0.5, age.count () / CLIENT_USAGE_HALF_LIFE_S);
+  it->second.updated = now;
+  return it->second.seconds + it->second.running;
+}
+
+static vector<queued_build *>::iterator
+next_build (sched_clock::time_point now)
+{
+  vector<queued_build *>::iterator best = build_queue.end ();
+  double best_share = 0;
+  for (vector<queued_build *>::iterator it = build_queue.begin ();
+       it != build_queue.end (); ++it)
+    {
+      double share = client_share ((*it)->client, now);
+      if (best == build_queue.end () || share < best_share
+          || (share == best_share && (*it)->estimate < (*best)->estimate))
+        {
+          best = it;
+          best_share = share;
+        }
+    }
+  return best;
+}
+
+// Whether the server can take on another build.
+static bool
+build_resources_available ()
+{
+  double load;
+  if (getloadavg (& load, 1) == 1
+      && load > 1.5 * thread::hardware_concurrency ())
+    return false;
+
+  ifstream meminfo ("/proc/meminfo");
+  string field;
+  long kb;
+  while (meminfo >> field >> kb)
+    {
+      if (field == "MemAvailable:")
+        return kb >= MIN_AVAILABLE_MEMORY_KB;
+      meminfo.ignore (numeric_limits<streamsize>::max (), '\n');
+    }
+  return true;
+}
+
+// Name the client for the fair share: by its certificate, if it sent one,
+// otherwise by its address.
+static string
+request_client (PRFileDesc *sslSocket, const PRNetAddr &addr)
+{
+  CERTCertificate *cert = SSL_PeerCertificate (sslSocket);
+  if (cert)
+    {
+      string subject = cert->subjectName ?: "";
+      CERT_DestroyCertificate (cert);
+      if (! subject.empty ())
+        return subject;
+    }
+
+  char buf[1024];
+  if (PR_NetAddrToString (& addr, buf, sizeof (buf)) == PR_SUCCESS)
+    return buf;
+  return _("unknown client");
+}
+
+static double
+acquire_build_slot (const string &client, const string &shape)
+{
+  unique_lock<mutex> guard (build_lock);
+  queued_build me;
+  me.client = client;
+  me.arrival = sched_clock::now ();
+  map<string, double>::const_iterator known = build_history.find (shape);
+  if (known != build_history.end ())
+    me.estimate = known->second;
+  else
+    me.estimate = typical_build_s;
+  build_queue.push_back (& me);
+
+  while (true)
+    {
+      vector<queued_build *>::iterator next = next_build (sched_clock::now ());
+      if (builds_running < max_threads && *next == & me)
+        {
+          if (builds_running == 0 || build_resources_available ())
+            {
+              build_queue.erase (next);
+              break;
+            }
+          // Look again shortly, since nobody notifies us of these.
+          build_slot_freed.wait_for (guard, chrono::seconds (1));
+        }
+      else
+        build_slot_freed.wait (guard);
+    }
+
+  builds_running++;
+  client_usages[client].running += me.estimate;
+  chrono::duration<double> queued = sched_clock::now () - me.arrival;
+  log (_F("Starting build for %s after %.1fs in the queue (%zu queued, %ld running, expected to take %.1fs)",
+          client.c_str (), queued.count (), build_queue.size (), builds_running,
+          me.estimate));
+
+  // Someone else may be next in line for another free slot.
+  build_slot_freed.notify_all ();
+  return me.estimate;
+}
+
+static void
+release_build_slot (const string &client, const string &shape, double estimate,
+                    sched_clock::time_point started)
+{
+  sched_clock::time_point now = sched_clock::now ();
+  chrono::duration<double> took = now - started;
+
+  lock_guard<mutex> guard (build_lock);
+  builds_running--;
+  client_share (client, now); // decay up to now
+  client_usage &usage = client_usages[client];
+  usage.seconds += took.count ();
+  usage.running -= estimate;
+
+  if (! shape.empty ())
+    {
+      // NB: a crude bound, but the history refills quickly
+      if (build_history.size () >= MAX_BUILD_HISTORY)
+        build_history.clear ();
+      map<string, double>::iterator it = build_history.find (shape);
+      if (it == build_history.end ())
+        build_history[shape] = took.count ();
+      else
+        it->second = (it->second + took.count ()) / 2;
+    }
+  typical_build_s = typical_build_s ? (typical_build_s + took.count ()) / 2 : took.count ();
+
+  log (_F("Build for %s finished in %.1fs (%zu queued, %ld running)",
+          client.c_str (), took.count (), build_queue.size (), builds_running));
+  build_slot_freed.notify_all ();
+}
+
 /* Function:  void *handle_connection()
  *
  * Purpose: Handle a connection to a socket.  Copy in request zip
@@ -2155,6 +2628,7 @@ handle_connection (void *arg)
                         copy for each connection.*/
   vector<string>     argv;
   PRInt32            bytesRead;
+  string             fingerprint;
 
   /* Detatch to avoid a memory leak */
   if(max_threads > 0)
@@ -2274,19 +2748,47 @@ handle_connection (void *arg)
       goto cleanup;
     }
 
-  /* Handle the request zip file.  An error therein should still result
-     in a response zip file (containing stderr etc.) so we don't have to
-     have a result code here.  */
-  handleRequest(requestDirName, responseDirName, stapstderr);
-
-  /* Zip the response. */
-  int ziprc;
-  argv = { "zip", "-q", "-r", responseFileName, "." };
-  rc = spawn_and_wait (argv, &ziprc, NULL, NULL, NULL, responseDirName);
-  if (rc != PR_SUCCESS || ziprc != 0)
+  fingerprint = request_fingerprint (requestDirName);
+  if (! fingerprint.empty () && claim_response (fingerprint, responseFileName))
+    log (_F("Using cached response %s", fingerprint.c_str ()));
+  else
     {
-      server_error (_("Unable to compress server response"));
-      goto cleanup;
+      /* Handle the request zip file.  An error therein should still result
+         in a response zip file (containing stderr etc.) so we don't have to
+         have a result code here.  */
+      if (max_threads > 0)
+        {
+          string client = request_client (sslSocket, addr);
+          string shape = request_shape (requestDirName);
+          double estimate = acquire_build_slot (client, shape);
+          sched_clock::time_point started = sched_clock::now ();
+          handleRequest(requestDirName, responseDirName, stapstderr);
+          release_build_slot (client, shape, estimate, started);
+        }
+      else
+        handleRequest(requestDirName, responseDirName, stapstderr);
+
+      /* Zip the response. */
+      int ziprc;
+      argv = { "zip", "-q", "-r", responseFileName, "." };
+      rc = spawn_and_wait (argv, &ziprc, NULL, NULL, NULL, responseDirName);
+      bool zipped = (rc == PR_SUCCESS && ziprc == 0);
+
+      // Only cache the responses of successful builds, but hand any
+      // response to the identical requests waiting for this one.
+      if (! fingerprint.empty ())
+        {
+          int staprc;
+          ifstream rcfile ((string (responseDirName) + "/rc").c_str ());
+          bool built = (rcfile >> staprc) && staprc == 0;
+          release_response (fingerprint, zipped ? responseFileName : "", built);
+        }
+
+      if (! zipped)
+        {
+          server_error (_("Unable to compress server response"));
+          goto cleanup;
+        }
     }
 
   secStatus = writeDataToSocket (sslSocket, responseFileName);
@@ -2403,10 +2905,10 @@ accept_connections (PRFileDesc *listenSocket, CERTCertificate *cert)
           sem_getvalue(&sem_client, &idle_threads);
           if(idle_threads <= 0)
             log(_("Server is overloaded. Processing times may be longer than normal."));
-          else if (idle_threads == max_threads)
+          else if (idle_threads == max_connections)
             log(_("Processing 1 request..."));
           else
-            log(_F("Processing %d concurrent requests...", ((int)max_threads - idle_threads) + 1));
+            log(_F("Processing %d concurrent requests...", ((int)max_connections - idle_threads) + 1));
 
           sem_wait(&sem_client);
         }
@@ -2517,9 +3019,9 @@ server_main (PRFileDesc *listenSocket)
    * If we got here from an interrupt, exit immediately if
    * the timeout is reached. Otherwise, wait indefinitiely
    * until the threads exit (or an interrupt is recieved).*/
-  if(idle_threads < max_threads)
-    log(_F("Waiting for %d outstanding requests to complete...", (int)max_threads - idle_threads));
-  while(idle_threads < max_threads)
+  if(idle_threads < max_connections)
+    log(_F("Waiting for %d outstanding requests to complete...", (int)max_connections - idle_threads));
+  while(idle_threads < max_connections)
     {
       if(pending_interrupts && timeout++ > CONCURRENCY_TIMEOUT_S)
         {
@@ -2660,10 +3162,12 @@ listen ()
       goto done;
     }
 
-  /* Initialize semephore with the maximum number of threads
-   * defined by --max-threads. If it is not defined, the
-   * default is the number of processors */
-  sem_init(&sem_client, 0, max_threads);
+  /* Initialize semephore with the maximum number of connections.
+   * Up to --max-threads of them build at once (the default is the
+   * number of processors), and the others wait for their turn in
+   * the build queue. */
+  max_connections = max_threads * (1 + QUEUED_REQUESTS_PER_THREAD);
+  sem_init(&sem_client, 0, max_connections);
 
   // Loop forever. We check our certificate (and regenerate, if necessary) and then start the
   // server. The server will go down when our certificate is no longer valid (e.g. expired). We
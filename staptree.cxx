@@ -119,7 +119,7 @@ probe_point::from_globby_comp(const std::string& comp)
   return false;
 }
 
-unsigned probe::last_probeidx = 0;
+atomic<unsigned> probe::last_probeidx (0);
 
 probe::probe ():
   body (0), base (0), tok (0), systemtap_v_conditional (0), privileged (false),
@@ -2340,6 +2340,8 @@ functioncall_traversing_visitor::enter_functioncall (functioncall* e)
         {
           if (seen.find(referent) == seen.end())
             seen.insert (referent);
+          else if (traverse_once)
+            continue;
           nested.insert (referent);
           // recurse
           functiondecl* last_current_function = current_function;
@@ -2435,7 +2437,9 @@ varuse_collecting_visitor::visit_embeddedcode (embeddedcode *s)
   assert (current_function); // only they get embedded code
 
   /* We need to lock globals that are accessed through embedded C code */
-  for (unsigned i = 0; i < session.globals.size(); i++)
+  /* (skipping the per-global searches in the usual case of no pragmas) */
+  bool pragmas_p = (s->code.find("/* pragma:") != string::npos);
+  for (unsigned i = 0; pragmas_p && i < session.globals.size(); i++)
     {
       vardecl* v = session.globals[i];
       string name = v->unmangled_name;
@@ -2496,7 +2500,9 @@ void
 varuse_collecting_visitor::visit_embedded_expr (embedded_expr *e)
 {
   /* We need to lock globals that are accessed through embedded C code */
-  for (unsigned i = 0; i < session.globals.size(); i++)
+  /* (skipping the per-global searches in the usual case of no pragmas) */
+  bool pragmas_p = (e->code.find("/* pragma:") != string::npos);
+  for (unsigned i = 0; pragmas_p && i < session.globals.size(); i++)
     {
       vardecl* v = session.globals[i];
       string name = v->unmangled_name;
@@ -2864,13 +2870,15 @@ varuse_collecting_visitor::side_effect_free_wrt (const set<vardecl*>& vars)
   // variables of called functions.  But visible side-effects only
   // occur if the client's locals, or any globals are written-to.
 
-  set<vardecl*> intersection;
-  insert_iterator<set<vardecl*> > int_it (intersection, intersection.begin());
-  set_intersection (written.begin(), written.end(),
-                    vars.begin(), vars.end(),
-                    int_it);
-
-  return (intersection.empty() && !embedded_seen);
+  // NB: the written list is usually much shorter than vars, which
+  // tends to hold all the globals, so probe vars rather than merging.
+  if (embedded_seen)
+    return false;
+  for (set<vardecl*>::const_iterator it = written.begin();
+       it != written.end(); it++)
+    if (vars.find (*it) != vars.end())
+      return false;
+  return true;
 }
 
 
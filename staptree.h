@@ -10,6 +10,7 @@
 #ifndef STAPTREE_H
 #define STAPTREE_H
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <stack>
@@ -131,7 +132,7 @@ struct token;
 struct visitor;
 struct update_visitor;
 
-struct visitable
+struct visitable: public arena_allocated
 {
   virtual ~visitable ();
 };
@@ -573,7 +574,7 @@ struct hist_op: public indexable
 // ------------------------------------------------------------------------
 
 
-struct symboldecl // unique object per (possibly implicit)
+struct symboldecl: public arena_allocated // unique object per (possibly implicit)
 		  // symbol declaration
 {
   const token* tok;
@@ -800,9 +801,9 @@ struct stapfile
 };
 
 
-struct probe_point
+struct probe_point: public arena_allocated
 {
-  struct component // XXX: sort of a restricted functioncall
+  struct component: public arena_allocated // XXX: sort of a restricted functioncall
   {
     interned_string functor;
     literal* arg; // optional
@@ -828,9 +829,9 @@ struct probe_point
 std::ostream& operator << (std::ostream& o, const probe_point& k);
 
 
-struct probe
+struct probe: public arena_allocated
 {
-  static unsigned last_probeidx;
+  static std::atomic<unsigned> last_probeidx;
 
   std::vector<probe_point*> locations;
   statement* body;
@@ -1065,7 +1066,9 @@ struct functioncall_traversing_visitor: public traversing_visitor
   std::set<functiondecl*> seen;
   std::set<functiondecl*> nested;
   functiondecl* current_function;
-  functioncall_traversing_visitor(): current_function(0) {}
+  bool traverse_once; // enter each function only once, not at every call
+  functioncall_traversing_visitor(bool once = false):
+    current_function(0), traverse_once(once) {}
   void visit_functioncall (functioncall* e);
   void enter_functioncall (functioncall* e);
   virtual void note_recursive_functioncall (functioncall* e);
@@ -1086,7 +1089,8 @@ struct varuse_collecting_visitor: public functioncall_traversing_visitor
   bool current_lvalue_read;
   expression* current_lvalue;
   expression* current_lrvalue;
-  varuse_collecting_visitor(systemtap_session& s):
+  varuse_collecting_visitor(systemtap_session& s, bool once = false):
+    functioncall_traversing_visitor (once),
     session (s),
     embedded_seen (false),
     current_lvalue_read (false),
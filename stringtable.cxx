@@ -14,6 +14,7 @@
 #include <string>
 #include <cstring>
 #include <fstream>
+#include <mutex>
 #include <unordered_set>
 
 
@@ -34,7 +35,7 @@ static bool whitespace_p (char c)
 // A custom hash 
 struct stringtable_hash
 {
-  size_t operator()(const string& c) const {
+  size_t operator()(const string_ref& c) const {
     const char* b = c.data();
     size_t real_length = c.size();
     const size_t blocksize = 32; // a cache line or two
@@ -63,7 +64,7 @@ struct stringtable_hash
 
 #if INTERNED_STRING_INSTRUMENT
     ofstream f ("/tmp/hash.log", ios::app);
-    string s = c.substr(0,32);
+    string s = c.substr(0,32).to_string();
     s.erase (remove_if(s.begin(), s.end(), whitespace_p), s.end());
     f << hash << " " << c.length() << " " << s << endl;
     f.close();
@@ -72,27 +73,124 @@ struct stringtable_hash
     return hash;
   }
 };
-typedef unordered_set<std::string, stringtable_hash> stringtable_t;
 #else
-typedef unordered_set<std::string> stringtable_t;
+struct stringtable_hash
+{
+  size_t operator()(const string_ref& c) const {
+    size_t hash = 0;
+    for (size_t i = 0; i < c.size(); ++i)
+      hash = (hash * 131) + c[i];
+    return hash;
+  }
+};
 #endif
 
 
-static char chartable[256];
-static stringtable_t stringtable;
-// XXX: set a larger initial size?  For reference, a
+static struct chartable_t
+{
+  char chars[256];
+  chartable_t() { for (unsigned i = 0; i < 256; ++i) chars[i] = (char) i; }
+} chartable; // NB: fully initialized up front, so that it's safe to share
+
+
+// The table is split by hash into shards, each with its own lock, so
+// that threads interning different strings rarely contend.  The string
+// bytes are copied into large chunks owned by the shard, which the hash
+// sets merely point into; nothing is ever freed.
+//
+// The sets are sized up front for a typical run.  For reference, the
+// tapsets alone account for some 11,000 entries, while a
 //
 //    probe kernel.function("*") {}
 //
-// can intern some 450,000 entries.
+// can intern some 450,000.
+struct stringtable_shard
+{
+  typedef unordered_set<string_ref, stringtable_hash> set_t;
+
+  mutex lock;
+  set_t strings;
+  char* chunk;
+  size_t chunk_left;
+  size_t hits, misses, bytes;
+
+  stringtable_shard();
+  string_ref intern(const string_ref& value);
+};
+
+static const unsigned stringtable_shards = 16; // a power of two
+static const size_t stringtable_initial_size = 32768;
+static const size_t stringtable_chunk_size = 16 * 1024;
+
+static stringtable_shard stringtable[stringtable_shards];
+
+
+stringtable_shard::stringtable_shard():
+  strings(stringtable_initial_size / stringtable_shards),
+  chunk(0), chunk_left(0), hits(0), misses(0), bytes(0)
+{
+}
+
+
+string_ref
+stringtable_shard::intern(const string_ref& value)
+{
+  lock_guard<mutex> guard(lock);
+
+  set_t::iterator it = strings.find(value);
+  if (it != strings.end())
+    {
+      hits++;
+      PROBE2(stap, intern_string, it->data(), false);
+      return *it;
+    }
+
+  // Keep the NUL, like the std::strings of yore.  Big strings get an
+  // allocation of their own, rather than wasting most of a chunk.
+  size_t size = value.size() + 1;
+  char* p;
+  if (size > stringtable_chunk_size / 8)
+    {
+      p = new char[size];
+      bytes += size;
+    }
+  else
+    {
+      if (size > chunk_left)
+        {
+          chunk = new char[stringtable_chunk_size];
+          chunk_left = stringtable_chunk_size;
+          bytes += stringtable_chunk_size;
+        }
+      p = chunk;
+      chunk += size;
+      chunk_left -= size;
+    }
+  memcpy(p, value.data(), value.size());
+  p[value.size()] = '\0';
+
+  misses++;
+  string_ref stored(p, value.size());
+  strings.insert(stored);
+  PROBE2(stap, intern_string, p, true);
+  return stored;
+}
+
+
+static string_ref
+stringtable_intern(const string_ref& value)
+{
+  size_t hash = stringtable_hash()(value);
+  size_t shard = (hash ^ (hash >> 17)) & (stringtable_shards - 1);
+  return stringtable[shard].intern(value);
+}
 
 
 // Generate a long-lived string_ref for the given input string.  In
 // the absence of proper refcounting, memory is kept for the whole
 // duration of the systemtap run.  Try to reuse the same string
 // object for multiple invocations.  Old string_refs remain valid 
-// because std::set<> guarantees iterator validity across inserts,
-// which means that our value strings stay put.
+// because the interned bytes are never moved or freed.
 
 // static
 interned_string interned_string::intern(const string& value)
@@ -103,10 +201,7 @@ interned_string interned_string::intern(const string& value)
   if (value.size() == 1)
     return intern(value[0]);
 
-  pair<stringtable_t::iterator,bool> result = stringtable.insert(value);
-  PROBE2(stap, intern_string, value.c_str(), result.second);
-  stringtable_t::iterator it = result.first; // persistent iterator!
-  return string_ref (it->data(), it->length()); // hope for RVO/elision
+  return stringtable_intern(string_ref(value)); // hope for RVO/elision
 
   // XXX: for future consideration, consider searching the stringtable
   // for instances where 'value' is a substring.  We could string_ref
@@ -124,7 +219,7 @@ interned_string interned_string::intern(const char* value)
   if (!value[1])
     return intern(value[0]);
 
-  return intern(string(value));
+  return stringtable_intern(string_ref(value));
 }
 
 // static
@@ -134,10 +229,20 @@ interned_string interned_string::intern(char value)
     return interned_string ();
 
   size_t i = (unsigned char) value;
-  if (!chartable[i]) // lazy init
-    chartable[i] = value;
+  return string_ref (&chartable.chars[i], 1);
+}
 
-  return string_ref (&chartable[i], 1);
+// static
+void interned_string::stats(size_t& hits, size_t& misses, size_t& bytes)
+{
+  hits = misses = bytes = 0;
+  for (unsigned i = 0; i < stringtable_shards; ++i)
+    {
+      lock_guard<mutex> guard(stringtable[i].lock);
+      hits += stringtable[i].hits;
+      misses += stringtable[i].misses;
+      bytes += stringtable[i].bytes;
+    }
 }
 
 #if INTERNED_STRING_FIND_MEMMEM
@@ -105,6 +105,9 @@ struct interned_string: public boost::string_ref
     return find (static_cast<const boost::string_ref&> (f));
   }
   
+  // interning statistics for the whole run, reported under -v
+  static void stats(size_t& hits, size_t& misses, size_t& bytes);
+
 private:
   static interned_string intern(const std::string& value);
   static interned_string intern(const char* value);
@@ -155,6 +158,12 @@ struct interned_string : public std::string {
     return (this->compare(0, value.length(), value) == 0);
   }
 
+  // nothing is interned without boost::string_ref
+  static void stats(size_t& hits, size_t& misses, size_t& bytes)
+  {
+    hits = misses = bytes = 0;
+  }
+
 private:
   // c_str is not allowed on boost::string_ref, so add a private unimplemented
   // declaration here to prevent the use of string::c_str accidentally.
@@ -20,6 +20,7 @@
 #include "buildrun.h"
 #include "dwarf_wrappers.h"
 #include "hash.h"
+#include "cache.h"
 #include "dwflpp.h"
 #include "setupdwfl.h"
 #include <gelf.h>
@@ -976,27 +977,63 @@ struct dwarf_builder: public derived_probe_builder
   // recursive calls to build() when deriving globby probes.
   set <string> modules_seen;
 
-  dwarf_builder() {}
+  // dwflpps set up by prefetch_dwarf() ahead of their first use, with
+  // the build ids that they would have added to the session by then.
+  struct prefetched_dw
+  {
+    dwflpp* dw;
+    vector<string> build_ids;
+  };
+  map <string,prefetched_dw> kern_prefetched;
+  map <string,prefetched_dw> user_prefetched;
+  bool prefetched;
+
+  dwarf_builder(): prefetched(false) {}
 
   dwflpp *get_kern_dw(systemtap_session& sess, const string& module)
   {
     if (kern_dw[module] == 0)
-      kern_dw[module] = new dwflpp(sess, module, true); // might throw
+      kern_dw[module] = take_prefetched(sess, kern_prefetched, module)
+                        ?: new dwflpp(sess, module, true); // might throw
     return kern_dw[module];
   }
 
   dwflpp *get_user_dw(systemtap_session& sess, const string& module)
   {
     if (user_dw[module] == 0)
-      user_dw[module] = new dwflpp(sess, module, false); // might throw
+      user_dw[module] = take_prefetched(sess, user_prefetched, module)
+                        ?: new dwflpp(sess, module, false); // might throw
     return user_dw[module];
   }
 
+  dwflpp *take_prefetched(systemtap_session& sess,
+                          map<string,prefetched_dw>& prefetched_map,
+                          const string& module)
+  {
+    auto it = prefetched_map.find(module);
+    if (it == prefetched_map.end())
+      return 0;
+    dwflpp *dw = it->second.dw;
+    sess.build_ids.insert(sess.build_ids.end(),
+                          it->second.build_ids.begin(),
+                          it->second.build_ids.end());
+    prefetched_map.erase(it);
+    return dw;
+  }
+
+  void prefetch_dwarf(systemtap_session& sess);
+
   /* NB: not virtual, so can be called from dtor too: */
   void dwarf_build_no_more (bool)
   {
     delete_map(kern_dw);
     delete_map(user_dw);
+    for (auto it = kern_prefetched.begin(); it != kern_prefetched.end(); ++it)
+      delete it->second.dw;
+    for (auto it = user_prefetched.begin(); it != user_prefetched.end(); ++it)
+      delete it->second.dw;
+    kern_prefetched.clear();
+    user_prefetched.clear();
   }
 
   void build_no_more (systemtap_session &s)
@@ -4538,11 +4575,13 @@ struct dwarf_cast_expanding_visitor: public var_expanding_visitor
 {
   dwarf_builder& db;
   map<string,string> compiled_headers;
+  bool batched_typequeries;
 
   dwarf_cast_expanding_visitor(systemtap_session& s, dwarf_builder& db):
-    var_expanding_visitor(s), db(db) {}
+    var_expanding_visitor(s), db(db), batched_typequeries(false) {}
   void visit_cast_op (cast_op* e);
   void filter_special_modules(string& module);
+  void batch_typequeries();
 };
 
 
@@ -4672,11 +4711,24 @@ void dwarf_cast_expanding_visitor::filter_special_modules(string& module)
                     clog << _("Pass 2: using cached ") << cached_module << endl;
                   compiled_headers[header] = module = cached_module;
                   close(fd);
+                  cache_hit(cached_module);
                   return;
                 }
             }
         }
 
+      // no cached module; build it along with the script's others
+      if (startswith(module, "kernel") && !batched_typequeries)
+        {
+          batch_typequeries();
+          it = compiled_headers.find(header);
+          if (it != compiled_headers.end())
+            {
+              module = it->second;
+              return;
+            }
+        }
+
       // no cached module, time to make it
       if (make_typequery(sess, module) == 0)
         {
@@ -4689,6 +4741,80 @@ void dwarf_cast_expanding_visitor::filter_special_modules(string& module)
 }
 
 
+struct typequery_collector: public traversing_visitor
+{
+  set<string> modules;
+
+  void visit_cast_op (cast_op* e)
+    {
+      traversing_visitor::visit_cast_op (e);
+      vector<string> alternatives;
+      tokenize(e->module, alternatives, ":");
+      for (unsigned i = 0; i < alternatives.size(); ++i)
+        if (startswith(alternatives[i], "kernel<")
+            && alternatives[i][alternatives[i].size() - 1] == '>')
+          modules.insert(alternatives[i]);
+    }
+};
+
+
+// Build the kernel typequery modules for all of the @casts in the
+// user's script in one go, the first time one of them is missing.
+// Tapset functions are left to build theirs one at a time, since most
+// of what the library files contain is never used.
+void dwarf_cast_expanding_visitor::batch_typequeries()
+{
+  batched_typequeries = true;
+
+  typequery_collector tc;
+  for (unsigned i = 0; i < sess.user_files.size(); ++i)
+    {
+      stapfile *f = sess.user_files[i];
+      for (unsigned j = 0; j < f->probes.size(); ++j)
+        f->probes[j]->body->visit (&tc);
+      for (unsigned j = 0; j < f->aliases.size(); ++j)
+        f->aliases[j]->body->visit (&tc);
+      for (unsigned j = 0; j < f->functions.size(); ++j)
+        f->functions[j]->body->visit (&tc);
+    }
+
+  vector<string> missing;
+  map<string,string> cached_modules;
+  for (set<string>::iterator it = tc.modules.begin(); it != tc.modules.end(); ++it)
+    {
+      if (compiled_headers.find(*it) != compiled_headers.end())
+        continue;
+      if (sess.use_cache)
+        {
+          string cached_module = find_typequery_hash(sess, *it);
+          if (!cached_module.empty() && !sess.poison_cache
+              && file_exists(cached_module))
+            {
+              if (sess.verbose > 2)
+                clog << _("Pass 2: using cached ") << cached_module << endl;
+              compiled_headers[*it] = cached_module;
+              cache_hit(cached_module);
+              continue;
+            }
+          cached_modules[*it] = cached_module;
+        }
+      missing.push_back(*it);
+    }
+
+  // A single one is no different from building it on its own
+  if (missing.size() < 2)
+    return;
+
+  map<string,string> kos = make_typequeries(sess, missing);
+  for (map<string,string>::iterator it = kos.begin(); it != kos.end(); ++it)
+    {
+      if (sess.use_cache && !cached_modules[it->first].empty())
+        copy_file(it->second, cached_modules[it->first], sess.verbose > 2);
+      compiled_headers[it->first] = it->second;
+    }
+}
+
+
 void dwarf_cast_expanding_visitor::visit_cast_op (cast_op* e)
 {
   bool lvalue = is_active_lvalue(e);
@@ -8015,6 +8141,131 @@ handle_module_token(systemtap_session &sess, interned_string &module_token_val)
     }
 }
 
+// Derivation visits the probe points one at a time, and reading the
+// DWARF of each module it needs in turn is often what pass 2 spends
+// most of its time on.  But the DWARF of distinct modules (the kernel,
+// each kernel module, each program) is independent.  So the first time
+// we are asked to build anything, look through the user's script for
+// the literal kernel.*, module("NAME").* and process("PATH").* function
+// and statement probe points, set up a dwflpp for each such module
+// that is not already around, and read their DWARF in on up to
+// s.jobs threads.  The results are only taken by get_kern_dw() and
+// get_user_dw() when derivation would have made the same dwflpp.
+//
+// Setting up a dwflpp is done serially, as elfutils' offline module
+// search relies on global state.  Any dwflpp whose setup would have
+// reported something is thrown away, so that derivation sets it up
+// again and reports it in its usual place.
+void
+dwarf_builder::prefetch_dwarf(systemtap_session& sess)
+{
+  prefetched = true;
+  if (sess.jobs < 2 || sess.verbose > 1 || sess.download_dbinfo != 0)
+    return;
+
+  vector<pair<string,bool> > modules; // name, kernel_p
+  set<string> modules_set;
+  for (unsigned i = 0; i < sess.user_files.size(); i++)
+    {
+      stapfile* f = sess.user_files[i];
+      for (unsigned j = 0; j < f->probes.size(); j++)
+        for (unsigned k = 0; k < f->probes[j]->locations.size(); k++)
+          {
+            probe_point* loc = f->probes[j]->locations[k];
+            if (loc->components.size() < 2 || !loc->auto_path.empty())
+              continue;
+            interned_string second = loc->components[1]->functor;
+            if (second != TOK_FUNCTION && second != TOK_STATEMENT)
+              continue;
+
+            probe_point::component* first = loc->components[0];
+            literal_string* lit = dynamic_cast<literal_string*>(first->arg);
+            string module;
+            bool kernel_p = true;
+            if (first->functor == TOK_KERNEL && !first->arg)
+              module = "kernel";
+            else if (first->functor == TOK_MODULE && lit)
+              {
+                interned_string name = lit->value;
+                handle_module_token (sess, name);
+                module = name;
+              }
+            else if (first->functor == TOK_PROCESS && lit)
+              {
+                // NB: as in build(), for the plain process("PATH") case
+                string path = sess.sysroot + (string) lit->value;
+                if (contains_glob_chars (path))
+                  continue;
+                module = find_executable (path, "", sess.sysenv);
+                if (!is_fully_resolved (module, "", sess.sysenv))
+                  continue;
+
+                // Leave #! scripts and such to build()
+                char magic[SELFMAG];
+                ifstream elf (module.c_str());
+                if (!elf.read (magic, SELFMAG) || memcmp (magic, ELFMAG, SELFMAG))
+                  continue;
+                kernel_p = false;
+              }
+            else
+              continue;
+
+            if (dwflpp::name_has_wildcard (module) || module.empty())
+              continue;
+            if ((kernel_p ? kern_dw : user_dw).count (module))
+              continue;
+            if (modules_set.insert ((kernel_p ? "k:" : "u:") + module).second)
+              modules.push_back (make_pair (module, kernel_p));
+          }
+    }
+  if (modules.size() < 2)
+    return;
+
+  vector<dwflpp*> dws;
+  for (unsigned i = 0; i < modules.size(); i++)
+    {
+      size_t old_build_ids = sess.build_ids.size();
+      dwflpp* dw = 0;
+
+      sess.defer_reports = true;
+      sess.reports_deferred = false;
+      try
+        {
+          dw = new dwflpp(sess, modules[i].first, modules[i].second);
+        }
+      catch (...)
+        {
+          sess.reports_deferred = true;
+        }
+      sess.defer_reports = false;
+
+      prefetched_dw p;
+      p.dw = dw;
+      p.build_ids.assign (sess.build_ids.begin() + old_build_ids,
+                          sess.build_ids.end());
+      sess.build_ids.resize (old_build_ids);
+      if (sess.reports_deferred)
+        {
+          delete dw;
+          sess.reports_deferred = false;
+          continue;
+        }
+
+      (modules[i].second ? kern_prefetched : user_prefetched)[modules[i].first] = p;
+      dw->find_function_indexes();
+      dws.push_back (dw);
+    }
+
+  parallel_for (dws.size(), sess.jobs, [&](size_t i, unsigned)
+    {
+      if (pending_interrupts)
+        return false;
+      dws[i]->prefetch();
+      return true;
+    });
+}
+
+
 void
 dwarf_builder::build(systemtap_session & sess,
 		     probe * base,
@@ -8029,6 +8280,9 @@ dwarf_builder::build(systemtap_session & sess,
   dwflpp* dw = 0;
   literal_map_t filled_parameters = parameters;
 
+  if (!prefetched)
+    prefetch_dwarf(sess);
+
   interned_string module_name;
   int64_t proc_pid;
   if (has_null_param (parameters, TOK_KERNEL))
@@ -11647,45 +11901,14 @@ tracepoint_builder::get_tracequery_modules(systemtap_session& s,
         clog << "  " << headers[i] << endl;
     }
 
-  map<string,string> headers_cache_obj;  // header name -> cache/.../tracequery_hash.o file name
-  // Map the headers to cache .o names.  Note that this has side-effects of
-  // creating the $SYSTEMTAP_DIR/.cache/XX/... directory and the hash-log file,
-  // so we prefer not to repeat this.
-  vector<string> uncached_headers;
-  for (size_t i=0; i<headers.size(); i++)
-    headers_cache_obj[headers[i]] = find_tracequery_hash(s, headers[i]);
-
-  // They may be in the cache already.
-  if (s.use_cache && !s.poison_cache)
-    for (size_t i=0; i<headers.size(); i++)
-      {
-        // see if the cached module exists
-        const string& tracequery_path = headers_cache_obj[headers[i]];
-        if (!tracequery_path.empty() && file_exists(tracequery_path))
-          {
-            if (s.verbose > 2)
-              clog << _F("Pass 2: using cached %s", tracequery_path.c_str()) << endl;
-
-            // an empty file is a cached failure
-            if (get_file_size(tracequery_path) > 0)
-              modules.push_back (tracequery_path);
-          }
-        else
-          uncached_headers.push_back(headers[i]);
-      }
-  else
-    uncached_headers = headers;
-
-  // If we have nothing left to search for, quit
-  if (uncached_headers.empty()) return;
-
   map<string,string> headers_tracequery_src; // header -> C-source code mapping
 
-  // We could query several subsets of headers[] to make this go
-  // faster, but let's KISS and do one at a time.
-  for (size_t i=0; i<uncached_headers.size(); i++)
+  // Generate each header's query first; its source is part of the
+  // header's cache key, so that only the queries whose header or extra
+  // decls changed need to be rebuilt.
+  for (size_t i=0; i<headers.size(); i++)
     {
-      const string& header = uncached_headers[i];
+      const string& header = headers[i];
 
       // create a tracequery source file
       ostringstream osrc;
@@ -11749,13 +11972,48 @@ tracepoint_builder::get_tracequery_modules(systemtap_session& s,
       headers_tracequery_src[header] = osrc.str();
     }
 
-  // now build them all together
-  map<string,string> tracequery_objs = make_tracequeries(s, headers_tracequery_src);
+  map<string,string> headers_cache_obj;  // header name -> cache/.../tracequery_hash.o file name
+  // Map the headers to cache .o names.  Note that this has side-effects of
+  // creating the $SYSTEMTAP_DIR/.cache/XX/... directory and the hash-log file,
+  // so we prefer not to repeat this.
+  map<string,string> uncached_src;
+  for (size_t i=0; i<headers.size(); i++)
+    headers_cache_obj[headers[i]] = find_tracequery_hash(s, headers[i],
+                                                         headers_tracequery_src[headers[i]]);
+
+  // They may be in the cache already.
+  if (s.use_cache && !s.poison_cache)
+    for (size_t i=0; i<headers.size(); i++)
+      {
+        // see if the cached module exists
+        const string& tracequery_path = headers_cache_obj[headers[i]];
+        if (!tracequery_path.empty() && file_exists(tracequery_path))
+          {
+            if (s.verbose > 2)
+              clog << _F("Pass 2: using cached %s", tracequery_path.c_str()) << endl;
+            cache_hit(tracequery_path);
+
+            // an empty file is a cached failure
+            if (get_file_size(tracequery_path) > 0)
+              modules.push_back (tracequery_path);
+          }
+        else
+          uncached_src[headers[i]] = headers_tracequery_src[headers[i]];
+      }
+  else
+    uncached_src = headers_tracequery_src;
+
+  // If we have nothing left to search for, quit
+  if (uncached_src.empty()) return;
+
+  // now build them all together; make -j compiles them concurrently
+  map<string,string> tracequery_objs = make_tracequeries(s, uncached_src);
 
   // now extend the modules list, and maybe plop them into the cache
-  for (size_t i=0; i<uncached_headers.size(); i++)
+  for (map<string,string>::const_iterator it = uncached_src.begin();
+       it != uncached_src.end(); ++it)
     {
-      const string& header = uncached_headers[i];
+      const string& header = it->first;
       const string& tracequery_obj = tracequery_objs[header];
       const string& tracequery_path = headers_cache_obj[header];
       if (tracequery_obj !="" && file_exists(tracequery_obj))
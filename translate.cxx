@@ -22,6 +22,8 @@
 #include "dwflpp.h"
 #include "stapregex.h"
 #include "stringtable.h"
+#include "hash.h"
+#include "cache.h"
 
 #include <byteswap.h>
 #include <cstdlib>
@@ -6092,6 +6094,10 @@ struct unwindsym_dump_context
   size_t debug_line_len;
 
   set<string> undone_unwindsym_modules;
+
+  // When set, output goes here and the tables of each module are split
+  // off into a translation unit of their own; see finish_unwindsym_module.
+  ostringstream *module_tables;
 };
 
 static bool need_byte_swap_for_target (const unsigned char e_ident[])
@@ -7099,7 +7105,8 @@ dump_unwindsym_cxt (Dwfl_Module *m,
         mainname = lex_cast_qstring (modname);
     }
 
-  c->output << "static struct _stp_module _stp_module_" << stpmod_idx << " = {\n";
+  c->output << (c->module_tables ? "" : "static ")
+            << "struct _stp_module _stp_module_" << stpmod_idx << " = {\n";
   c->output << ".name = " << mainname.c_str() << ",\n";
   c->output << ".path = " << lex_cast_qstring (path_remove_sysroot(c->session,mainpath)) << ",\n";
   c->output << ".eh_frame_addr = 0x" << hex << eh_addr << dec << ", \n";
@@ -7215,6 +7222,67 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   return DWARF_CB_OK;
 }
 
+// Each module's tables only refer to one another, apart from the
+// _stp_module_N struct that _stp_modules[] lists.  So for kernel modules,
+// they are written out as a translation unit of their own, which kbuild
+// can compile in parallel with the rest of the module source.
+static void
+finish_unwindsym_module (unwindsym_dump_context *c)
+{
+  c->stp_module_index++;
+  if (!c->module_tables)
+    return;
+
+  systemtap_session& s = c->session;
+  translator_output *o = s.op_create_auxiliary();
+  o->line() << "#include <linux/types.h>\n";
+  o->line() << "#include <linux/stddef.h>\n";
+  if (s.need_unwind)
+    o->line() << "#define STP_NEED_UNWIND_DATA 1\n";
+  if (s.need_lines)
+    o->line() << "#define STP_NEED_LINE_DATA 1\n";
+  o->line() << "#define STP_SYMBOL_DATA_ONLY\n";
+  o->line() << "#include \"sym.h\"\n";
+  o->line() << c->module_tables->str();
+  o->close();
+  c->module_tables->str("");
+}
+
+// The tables of a module with a build-id are kept in the cache, along
+// with the kretprobe trampoline address they may have turned up, or "-".
+static bool
+load_unwindsym_module (unwindsym_dump_context *c, const string& path)
+{
+  ifstream in (path.c_str());
+  string trampoline;
+  if (!getline (in, trampoline))
+    return false;
+  ostringstream tables;
+  tables << in.rdbuf();
+  if (in.bad() || tables.str().empty())
+    return false;
+
+  if (trampoline != "-")
+    c->stp_kretprobe_trampoline_addr = strtoul (trampoline.c_str(), NULL, 16);
+  c->output << tables.str();
+  return true;
+}
+
+static void
+save_unwindsym_module (unwindsym_dump_context *c, const string& path,
+                       bool set_trampoline)
+{
+  ostringstream out;
+  if (set_trampoline)
+    out << hex << c->stp_kretprobe_trampoline_addr << dec << "\n";
+  else
+    out << "-\n";
+  out << c->module_tables->str();
+  if (!write_file_atomically (path, out.str ()) && c->session.verbose > 1)
+    clog << _F("Failed to save symbol data file \"%s\": %s",
+               path.c_str (), strerror (errno)) << endl;
+}
+
 static void dump_kallsyms(unwindsym_dump_context *c)
 {
   ifstream kallsyms("/proc/kallsyms");
@@ -7265,7 +7333,8 @@ static void dump_kallsyms(unwindsym_dump_context *c)
             << ".num_symbols = " << size << ",\n";
   c->output << "},\n";
   c->output << "};\n";
-  c->output << "static struct _stp_module _stp_module_" << stpmod_idx << " = {\n";
+  c->output << (c->module_tables ? "" : "static ")
+            << "struct _stp_module _stp_module_" << stpmod_idx << " = {\n";
   c->output << ".name = " << lex_cast_qstring("kernel") << ",\n";
   c->output << ".sections = _stp_module_" << stpmod_idx << "_sections" << ",\n";
   c->output << ".num_sections = sizeof(_stp_module_" << stpmod_idx << "_sections)/"
@@ -7273,7 +7342,7 @@ static void dump_kallsyms(unwindsym_dump_context *c)
   c->output << "};\n\n";
 
   c->undone_unwindsym_modules.erase("kernel");
-  c->stp_module_index++;
+  finish_unwindsym_module (c);
 }
 
 static int
@@ -7314,6 +7383,37 @@ dump_unwindsyms (Dwfl_Module *m,
   c->build_id_bits = NULL;
   res = dump_build_id (m, c, name, base);
 
+  // Apart from what the script needs of them, the tables only depend on
+  // the module file, which its build-id identifies, and on the separate
+  // debuginfo file found for it, if any.
+  string cache_path;
+  unsigned long trampoline_addr = c->stp_kretprobe_trampoline_addr;
+  if (res == DWARF_CB_OK && c->build_id_len > 0 && c->module_tables
+      && c->session.use_cache)
+    {
+      phase_timer timer (c->session.timings, "cache.symbol_data");
+      string build_id = hex_dump (c->build_id_bits, c->build_id_len);
+      const char *mainfile = NULL, *debugfile = NULL;
+      Dwarf_Addr bias;
+      dwfl_module_getdwarf (m, &bias); // NB: looks for the debuginfo file
+      dwfl_module_info (m, NULL, NULL, NULL, NULL, NULL, &mainfile, &debugfile);
+      cache_path = find_symbol_data_hash (c->session, build_id, modname,
+                                          resolve_path (mainfile ?: ""),
+                                          resolve_path (debugfile ?: ""),
+                                          base, c->stp_module_index);
+      if (!cache_path.empty() && !c->session.poison_cache
+          && load_unwindsym_module (c, cache_path))
+        {
+          cache_hit (cache_path);
+          if (c->session.verbose > 1)
+            clog << _F("Using cached symbol data %s for %s",
+                       cache_path.c_str(), name) << endl;
+          c->undone_unwindsym_modules.erase (modname);
+          finish_unwindsym_module (c);
+          return DWARF_CB_OK;
+        }
+    }
+
   c->seclist.clear();
   if (res == DWARF_CB_OK)
     res = dump_section_list(m, c, name, base);
@@ -7351,8 +7451,24 @@ dump_unwindsyms (Dwfl_Module *m,
   if (res == DWARF_CB_OK)
     res = dump_unwindsym_cxt (m, c, name, base);
 
+  // Tables that were too big or missing were dropped with a warning,
+  // which a cached copy would lose.
+  if (res == DWARF_CB_OK && !cache_path.empty()
+      && !(c->session.need_unwind && !c->debug_frame && !c->eh_frame)
+      && !(c->session.need_lines && !c->debug_line)
+      && c->debug_len <= MAX_UNWIND_TABLE_SIZE
+      && c->eh_len <= MAX_UNWIND_TABLE_SIZE
+      && c->eh_frame_hdr_len <= MAX_UNWIND_TABLE_SIZE
+      && c->debug_frame_hdr_len <= MAX_UNWIND_TABLE_SIZE
+      && c->debug_line_len <= MAX_UNWIND_TABLE_SIZE)
+    {
+      phase_timer timer (c->session.timings, "cache.symbol_data");
+      save_unwindsym_module (c, cache_path,
+                             trampoline_addr != c->stp_kretprobe_trampoline_addr);
+    }
+
   if (res == DWARF_CB_OK)
-    c->stp_module_index++;
+    finish_unwindsym_module (c);
 
   return res;
 }
@@ -7477,15 +7593,27 @@ prepare_symbol_data (systemtap_session& s)
 void
 emit_symbol_data (systemtap_session& s)
 {
-  string symfile = "stap-symbols.h";
+  phase_timer timer (s.timings, "pass3.symbol_data");
 
-  s.op->newline() << "#include " << lex_cast_qstring (symfile);
-
-  ofstream kallsyms_out ((s.tmpdir + "/" + symfile).c_str());
+  // For the kernel module, the tables of each module make up separate
+  // translation units (see finish_unwindsym_module), and only the
+  // _stp_modules[] list is left inline.  Dyninst modules are built from
+  // a single source file, which includes it all.
+  ofstream kallsyms_out;
+  ostringstream module_tables;
+  bool split_p = !s.runtime_usermode_p();
+  if (!split_p)
+    {
+      string symfile = "stap-symbols.h";
+      s.op->newline() << "#include " << lex_cast_qstring (symfile);
+      kallsyms_out.open ((s.tmpdir + "/" + symfile).c_str());
+    }
 
   vector<pair<string,unsigned> > seclist;
   map<unsigned, addrmap_t> addrmap;
-  unwindsym_dump_context ctx = { s, kallsyms_out,
+  unwindsym_dump_context ctx = { s,
+				 (split_p ? (ostream&) module_tables
+				  : (ostream&) kallsyms_out),
 				 0, /* module index */
 				 0, NULL, 0, /* build_id len, bits, vaddr */
 				 ~0UL, /* stp_kretprobe_trampoline_addr */
@@ -7504,7 +7632,8 @@ emit_symbol_data (systemtap_session& s)
 				 0, /* eh_frame_hdr_addr */
 				 NULL, /* debug_line */
 				 0, /* debug_line_len */
-				 s.unwindsym_modules };
+				 s.unwindsym_modules,
+				 (split_p ? &module_tables : NULL) };
 
   // Micro optimization, mainly to speed up tiny regression tests
   // using just begin probe.
@@ -7617,6 +7746,9 @@ emit_symbol_data_done (unwindsym_dump_context *ctx, systemtap_session& s)
 
   // Print out a definition of the runtime's _stp_modules[] globals.
   ctx->output << "\n";
+  if (ctx->module_tables)
+    for (unsigned i=0; i<ctx->stp_module_index; i++)
+      ctx->output << "extern struct _stp_module _stp_module_" << i << ";\n";
   self_unwind_declarations(ctx);
    ctx->output << "static struct _stp_module *_stp_modules [] = {\n";
   for (unsigned i=0; i<ctx->stp_module_index; i++)
@@ -7635,6 +7767,10 @@ emit_symbol_data_done (unwindsym_dump_context *ctx, systemtap_session& s)
     ctx->output << "0x" << hex << ctx->stp_kretprobe_trampoline_addr << dec
 		<< ";\n";
 
+  // Whatever wasn't split off goes inline.
+  if (ctx->module_tables)
+    s.op->newline() << ctx->module_tables->str();
+
   // Some nonexistent modules may have been identified with "-d".  Note them.
   if (! s.suppress_warnings)
     for (set<string>::iterator it = ctx->undone_unwindsym_modules.begin();
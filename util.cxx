@@ -25,6 +25,7 @@
 #include <cassert>
 #include <ext/stdio_filebuf.h>
 #include <algorithm>
+#include <atomic>
 #include <mutex>
 
 extern "C" {
@@ -35,12 +36,14 @@ extern "C" {
 #include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <regex.h>
 #include <stdarg.h>
+#include <time.h>
 }
 
 using namespace std;
@@ -173,6 +176,64 @@ error:
 }
 
 
+// The umask, read before main() so that no other thread can be creating
+// files while it's briefly cleared.
+static mode_t
+read_umask()
+{
+  mode_t mask = umask(0);
+  umask(mask);
+  return mask;
+}
+static const mode_t process_umask = read_umask();
+
+
+// Write a file via a temporary file and atomic rename, so that readers
+// (such as concurrent stap runs sharing the cache) never see a partial
+// file.  Returns false with errno set on failure.
+bool
+write_file_atomically(const string& path, const string& contents)
+{
+  string tmp = path + string(".XXXXXX");
+  char *tmp_name = (char *)tmp.c_str();
+  int fd = mkstemp(tmp_name);
+  if (fd == -1)
+    return false;
+
+  const char *p = contents.data();
+  size_t left = contents.size();
+  while (left > 0)
+    {
+      ssize_t n = write(fd, p, left);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          int saved_errno = errno;
+          close(fd);
+          unlink(tmp_name);
+          errno = saved_errno;
+          return false;
+        }
+      p += n;
+      left -= n;
+    }
+
+  // mkstemp creates the file 0600; give it the usual permissions.
+  fchmod(fd, 0666 & ~process_umask);
+
+  // The close can fail on NFS if out of space.
+  if (close(fd) == -1 || rename(tmp_name, path.c_str()) == -1)
+    {
+      int saved_errno = errno;
+      unlink(tmp_name);
+      errno = saved_errno;
+      return false;
+    }
+  return true;
+}
+
+
 // Make sure a directory exists.
 int
 create_dir(const char *dir, int mode)
@@ -321,6 +382,181 @@ getmemusage ()
   return oss.str();
 }
 
+
+static atomic<size_t> arena_objects;
+static atomic<size_t> arena_bytes;
+static const size_t arena_chunk_size = 256 * 1024;
+static const size_t arena_align = alignof(max_align_t);
+static const size_t arena_max_size = arena_chunk_size / 16;
+
+// Deleted objects, by size, each pointing to the next.
+static thread_local void* arena_free[arena_max_size / arena_align + 1];
+
+void*
+arena_allocated::operator new (size_t size)
+{
+  static thread_local char* chunk = 0;
+  static thread_local size_t chunk_left = 0;
+
+  size = (size + arena_align - 1) & ~(arena_align - 1);
+  arena_objects.fetch_add (1, memory_order_relaxed);
+  arena_bytes.fetch_add (size, memory_order_relaxed);
+
+  // The odd big one isn't worth wasting the rest of a chunk on.
+  if (size > arena_max_size)
+    return ::operator new (size);
+
+  void*& free_list = arena_free[size / arena_align];
+  if (free_list)
+    {
+      void* p = free_list;
+      free_list = *(void**) p;
+      return p;
+    }
+
+  if (size > chunk_left)
+    {
+      chunk = (char*) ::operator new (arena_chunk_size);
+      chunk_left = arena_chunk_size;
+    }
+  void* p = chunk;
+  chunk += size;
+  chunk_left -= size;
+  return p;
+}
+
+void
+arena_allocated::operator delete (void* p, size_t size)
+{
+  if (!p)
+    return;
+
+  size = (size + arena_align - 1) & ~(arena_align - 1);
+  if (size > arena_max_size)
+    {
+      ::operator delete (p);
+      return;
+    }
+
+  void*& free_list = arena_free[size / arena_align];
+  *(void**) p = free_list;
+  free_list = p;
+}
+
+void
+arena_allocated::stats (size_t& objects, size_t& bytes)
+{
+  objects = arena_objects.load (memory_order_relaxed);
+  bytes = arena_bytes.load (memory_order_relaxed);
+}
+
+
+void
+phase_timings::record (const char* name, double wall_ms, double cpu_ms,
+                       long maxrss_kb, unsigned long items)
+{
+  lock_guard<mutex> guard(lock);
+  auto it = index.find (name);
+  if (it == index.end())
+    {
+      it = index.insert (make_pair (name, phases.size())).first;
+      phases.push_back (phase { name, 0, 0, 0, 0, 0 });
+    }
+  phase& p = phases[it->second];
+  p.count ++;
+  p.items += items;
+  p.wall_ms += wall_ms;
+  p.cpu_ms += cpu_ms;
+  p.maxrss_kb = max (p.maxrss_kb, maxrss_kb);
+}
+
+
+void
+phase_timings::print_json (ostream& o) const
+{
+  lock_guard<mutex> guard(lock);
+  struct rusage ru;
+  getrusage (RUSAGE_SELF, &ru);
+
+  // NB: phase names are fixed identifiers, so need no JSON escaping.
+  o << "{" << endl
+    << "  \"version\": \"" << VERSION << "\"," << endl
+    << "  \"maxrss_kb\": " << ru.ru_maxrss << "," << endl
+    << "  \"phases\": [";
+  for (size_t i = 0; i < phases.size(); i++)
+    {
+      const phase& p = phases[i];
+      o << (i ? "," : "") << endl
+        << "    { \"name\": \"" << p.name << "\""
+        << ", \"count\": " << p.count
+        << ", \"items\": " << p.items
+        << fixed << setprecision(3)
+        << ", \"wall_ms\": " << p.wall_ms
+        << ", \"cpu_ms\": " << p.cpu_ms
+        << ", \"maxrss_kb\": " << p.maxrss_kb << " }";
+    }
+  o << endl << "  ]" << endl << "}" << endl;
+}
+
+
+static double
+wall_ms_now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+
+// cpu time of this thread plus any reaped children (e.g. kbuild's make)
+static double
+cpu_ms_now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  struct rusage children;
+  getrusage (RUSAGE_CHILDREN, &children);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0
+    + (children.ru_utime.tv_sec + children.ru_stime.tv_sec) * 1000.0
+    + (children.ru_utime.tv_usec + children.ru_stime.tv_usec) / 1000.0;
+}
+
+
+phase_timer::phase_timer (const shared_ptr<phase_timings>& t, const char* n):
+  timings (t.get()), name (0), items (0), wall_start (0), cpu_start (0)
+{
+  if (n)
+    start (n);
+}
+
+
+void
+phase_timer::start (const char* n)
+{
+  stop ();
+  if (! timings)
+    return;
+  name = n;
+  items = 0;
+  wall_start = wall_ms_now ();
+  cpu_start = cpu_ms_now ();
+}
+
+
+void
+phase_timer::stop ()
+{
+  if (! timings || ! name)
+    return;
+
+  struct rusage ru;
+  getrusage (RUSAGE_SELF, &ru);
+  timings->record (name, wall_ms_now () - wall_start,
+                   cpu_ms_now () - cpu_start, ru.ru_maxrss, items);
+  name = 0;
+}
+
+
 void
 tokenize(const string& str, vector<string>& tokens,
 	 const string& delimiters)
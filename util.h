@@ -16,6 +16,11 @@
 #include <map>
 #include <algorithm>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <system_error>
 
 extern "C" {
 #if ENABLE_NLS
@@ -74,6 +79,7 @@ size_t get_file_size(int fd);
 bool file_exists (const std::string &path);
 bool copy_file(const std::string& src, const std::string& dest,
                bool verbose=false);
+bool write_file_atomically(const std::string& path, const std::string& contents);
 int create_dir(const char *dir, int mode = 0777);
 int remove_file_or_dir(const char *dir);
 extern "C" gid_t get_gid (const char *group_name);
@@ -400,6 +406,101 @@ std::string levenshtein_suggest(const std::string& target,
                                 unsigned max = std::numeric_limits<unsigned>::max(),
                                 unsigned threshold = std::numeric_limits<unsigned>::max());
 
+// Base for the parse tree and elaboration nodes, which are many, small,
+// and mostly live until the end of the run anyway.  They are bump-
+// allocated out of large per-thread chunks; the few that get deleted
+// (mostly preprocessor tokens) are recycled for the next of their size.
+struct arena_allocated
+{
+  static void* operator new (size_t size);
+  static void operator delete (void* p, size_t size);
+
+  // number and total size of the objects allocated so far
+  static void stats (size_t& objects, size_t& bytes);
+};
+
+
+// Accumulated wall/cpu time and memory use of the translator's passes
+// and their interesting phases, as reported by --timing=json.  Phases
+// are listed in the order they first ran; each may run many times and
+// from several threads.
+class phase_timings
+{
+public:
+  void record (const char* name, double wall_ms, double cpu_ms,
+               long maxrss_kb, unsigned long items);
+  void print_json (std::ostream& o) const;
+
+private:
+  struct phase
+  {
+    std::string name;
+    unsigned long count;
+    unsigned long items;
+    double wall_ms;
+    double cpu_ms;
+    long maxrss_kb;
+  };
+
+  mutable std::mutex lock;
+  std::vector<phase> phases;
+  std::map<std::string, size_t> index; // into phases
+};
+
+// Charges the time from construction (or start) until destruction (or
+// stop) to the named phase.  A no-op when timings aren't being kept.
+class phase_timer
+{
+public:
+  phase_timer (const std::shared_ptr<phase_timings>& t, const char* name = 0);
+  ~phase_timer () { stop (); }
+
+  void start (const char* name);
+  void stop ();
+
+  // count some units of work done in this phase, e.g. CUs visited
+  void add (unsigned long n = 1) { items += n; }
+
+private:
+  phase_timings* timings;
+  const char* name;
+  unsigned long items;
+  double wall_start;
+  double cpu_start;
+};
+
+
+// Call body(i, t) for each i in [0, n) on up to nthreads threads, the
+// calling thread being number 0 and the others 1 and up, so that body can
+// keep per-thread state in a vector indexed by t.  Each thread takes the
+// next item in turn until they run out, or until body returns false.
+template <typename F> void
+parallel_for (size_t n, unsigned nthreads, F body)
+{
+  std::atomic<size_t> next (0);
+  auto worker = [&](unsigned t)
+    {
+      size_t i;
+      while ((i = next++) < n)
+        if (!body (i, t))
+          break;
+    };
+
+  std::vector<std::thread> workers;
+  try
+    {
+      for (unsigned t = 1; t < nthreads && t < n; ++t)
+        workers.push_back (std::thread (worker, t));
+    }
+  catch (const std::system_error&)
+    {
+      // make do with the threads we've got
+    }
+  worker (0);
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join ();
+}
+
 #ifndef HAVE_PPOLL
 // This is a poor-man's ppoll; see the implementation for more details...
 int ppoll(struct pollfd *fds, nfds_t nfds,